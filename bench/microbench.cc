@@ -0,0 +1,656 @@
+/* Micro-benchmarks for the simulator's core data structures.
+ *
+ * Each benchmark builds a fixture of a given size (number of entities, or
+ * number of ports for Links), times a batch of calls to the operation under
+ * test and reports the best of several repetitions.  Results are printed to
+ * stdout as CSV, one row per (benchmark, size) pair, so that runs of
+ * different versions can be concatenated and compared with standard tools.
+ */
+#include <boost/program_options.hpp>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bit_matrix.h"
+#include "bv.h"
+#include "common.h"
+#include "entities.h"
+#include "events.h"
+#include "links.h"
+#include "partitioner.h"
+#include "routes.h"
+#include "scheduler.h"
+#include "statistics.h"
+
+using std::cerr;
+using std::cout;
+using std::default_random_engine;
+using std::endl;
+using std::max;
+using std::min;
+using std::string;
+using std::uniform_int_distribution;
+using std::uniform_real_distribution;
+using std::unordered_map;
+using std::vector;
+
+namespace po = boost::program_options;
+using po::options_description;
+using po::value;
+using po::variables_map;
+using po::store;
+using po::command_line_parser;
+using po::notify;
+
+/* A benchmark sets up a fixture of the given size, times a batch of
+ * operations on it and returns the number of operations performed.  The time
+ * spent in the batch (excluding setup and teardown) is stored in seconds.
+ */
+typedef unsigned long (*Benchmark)(unsigned int size, double& seconds);
+
+/* Benchmarks whose single operation is linear in the size of the fixture do
+ * roughly this many units of work per repetition.
+ */
+const unsigned long kLinearBudget = 1 << 22;
+
+/* Keeps the compiler from discarding the results of timed calls. */
+volatile unsigned long sink;
+
+class Timer {
+ public:
+  Timer() : start_(std::chrono::steady_clock::now()) {}
+  double Elapsed() const {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start_).count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+unsigned long OpsForLinear(unsigned int size) {
+  return max(16UL, kLinearBudget / size);
+}
+
+vector<Controller*> MakeControllers(Scheduler& sched, Statistics& stats,
+                                    unsigned int n) {
+  vector<Controller*> ents;
+  ents.reserve(n);
+
+  for(Id id = 0; id < n; ++id)
+    ents.push_back(new Controller(sched, id, stats));
+
+  return ents;
+}
+
+void DeleteControllers(vector<Controller*>& ents) {
+  for(Controller* c : ents)
+    delete c;
+  ents.clear();
+}
+
+/* The scheduler does not initialize its clock until a simulation starts, so
+ * fixtures that read the current time run an empty simulation first.
+ */
+void StartClock(Scheduler& sched) {
+  unordered_map<Id, Entity*> none;
+  sched.StartSimulation(none);
+}
+
+/* Up events are used as the payload for the scheduler benchmarks because
+ * handling them touches a single flag, which keeps the measurement focused on
+ * the queue itself.
+ */
+unsigned long BenchSchedulerEnqueue(unsigned int size, double& seconds) {
+  const Time end = 1000;
+  Scheduler sched(end, size);
+  Statistics stats(sched);
+  vector<Controller*> ents = MakeControllers(sched, stats, size);
+
+  default_random_engine entropy_src;
+  uniform_real_distribution<Time> time_dist(0, end);
+  vector<Time> times(size);
+  for(Time& t : times)
+    t = time_dist(entropy_src);
+
+  Timer timer;
+  for(unsigned int i = 0; i < size; ++i)
+    sched.AddEvent(Up(times[i], ents[i]));
+  seconds = timer.Elapsed();
+
+  StartClock(sched);
+  DeleteControllers(ents);
+  return size;
+}
+
+unsigned long BenchSchedulerDequeue(unsigned int size, double& seconds) {
+  const Time end = 1000;
+  Scheduler sched(end, size);
+  Statistics stats(sched);
+  vector<Controller*> ents = MakeControllers(sched, stats, size);
+
+  default_random_engine entropy_src;
+  uniform_real_distribution<Time> time_dist(0, end);
+  for(unsigned int i = 0; i < size; ++i)
+    sched.AddEvent(Up(time_dist(entropy_src), ents[i]));
+
+  unordered_map<Id, Entity*> none;
+  Timer timer;
+  sched.StartSimulation(none);
+  seconds = timer.Elapsed();
+
+  DeleteControllers(ents);
+  return size;
+}
+
+/* Schedules size jittered gossip rounds per period up front, as
+ * SchedulePeriodicEvents does for size entities, and runs through all of
+ * them.  The rounds are shared out among a few entities that are down, so
+ * handling one does nothing and the measurement covers adding the timers and
+ * taking them out in order.
+ */
+unsigned long BenchSchedulerPeriodicTimers(unsigned int size, double& seconds) {
+  const Time kPeriod = 1;
+  const unsigned int kNumEntities = 16;
+  unsigned int rounds = max(4UL, OpsForLinear(size) / 4);
+  Scheduler sched(rounds * kPeriod, kNumEntities);
+  Statistics stats(sched);
+  vector<Controller*> ents = MakeControllers(sched, stats, kNumEntities);
+  for(Controller* c : ents) {
+    Down down(0, c);
+    c->Handle(&down);
+  }
+
+  default_random_engine entropy_src;
+  uniform_real_distribution<Time> jitter_dist(0, kPeriod);
+  vector<Time> times;
+  for(unsigned int r = 0; r < rounds; ++r)
+    for(unsigned int i = 0; i < size; ++i)
+      times.push_back(r * kPeriod + jitter_dist(entropy_src));
+
+  unordered_map<Id, Entity*> none;
+  Timer timer;
+  for(unsigned long i = 0; i < times.size(); ++i)
+    sched.AddEvent(InitiateGossip(times[i], ents[i % kNumEntities]));
+  sched.StartSimulation(none);
+  seconds = timer.Elapsed();
+
+  DeleteControllers(ents);
+  return times.size();
+}
+
+unsigned long BenchHistoryMarkAsSeen(unsigned int size, double& seconds) {
+  Scheduler sched(1, size);
+  Statistics stats(sched);
+  vector<Controller*> ents = MakeControllers(sched, stats, size);
+  BV bv(new vector<bool>(size), new unsigned int(1));
+
+  vector<Heartbeat*> beats;
+  for(unsigned int i = 0; i < size; ++i)
+    beats.push_back(new Heartbeat(0, ents[i], ents[0], 0, 0, bv));
+
+  HeartbeatHistory history(size);
+  Timer timer;
+  for(Heartbeat* h : beats)
+    history.MarkAsSeen(h, 0);
+  seconds = timer.Elapsed();
+
+  for(Heartbeat* h : beats)
+    delete h;
+  DeleteControllers(ents);
+  return size;
+}
+
+unsigned long BenchHistoryHasBeenSeen(unsigned int size, double& seconds) {
+  Scheduler sched(1, size);
+  Statistics stats(sched);
+  vector<Controller*> ents = MakeControllers(sched, stats, size);
+  BV bv(new vector<bool>(size), new unsigned int(1));
+
+  /* Half of the lookups hit and half miss */
+  vector<Heartbeat*> beats;
+  for(unsigned int i = 0; i < size; ++i)
+    beats.push_back(new Heartbeat(0, ents[i], ents[0], 0, i % 2, bv));
+
+  HeartbeatHistory history(size);
+  for(Heartbeat* h : beats)
+    if(h->sn_ == 0)
+      history.MarkAsSeen(h, 0);
+
+  unsigned long hits = 0;
+  Timer timer;
+  for(Heartbeat* h : beats)
+    hits += history.HasBeenSeen(h);
+  seconds = timer.Elapsed();
+  sink = hits;
+
+  for(Heartbeat* h : beats)
+    delete h;
+  DeleteControllers(ents);
+  return size;
+}
+
+/* Every iteration is one heartbeat period of a flooded network: the history
+ * sights a new heartbeat of every entity and then expires the entities that
+ * were not seen recently enough, as an entity does before sending its own.
+ * One entity in 64 stays silent, so some expire along the way.
+ */
+unsigned long BenchHistorySightAndExpire(unsigned int size, double& seconds) {
+  HeartbeatHistory history(size);
+  vector<Id> expired;
+
+  unsigned long ops = max(16UL, OpsForLinear(size) / 16);
+  Timer timer;
+  for(unsigned long i = 0; i < ops; ++i) {
+    for(Id id = 0; id < size; ++id)
+      if(id % 64 != 63 || i < Entity::kMinTimes)
+        history.Merge(id, i, i);
+    expired.clear();
+    history.ExpireRecentlySeen(i, &expired);
+  }
+  seconds = timer.Elapsed();
+  sink = expired.size();
+
+  return ops;
+}
+
+/* Every iteration delivers one new heartbeat to an entity that has heard from
+ * all of the other entities and then asks it for its recently seen vector.
+ * The heartbeat leaves every bit as it was, so the cached vector is reused.
+ */
+unsigned long BenchComputeRecentlySeen(unsigned int size, double& seconds) {
+  Scheduler sched(1, size);
+  Statistics stats(sched);
+  vector<Controller*> ents = MakeControllers(sched, stats, size);
+  BV bv(new vector<bool>(size), new unsigned int(1));
+  Controller* observer = ents[0];
+  StartClock(sched);
+
+  vector<Heartbeat*> beats;
+  for(SequenceNum sn = 0; sn < Entity::kMinTimes; ++sn)
+    for(unsigned int i = 0; i < size; ++i)
+      beats.push_back(new Heartbeat(0, ents[i], observer, 0, sn, bv));
+  for(Heartbeat* h : beats)
+    observer->Handle(h);
+
+  unsigned long ops = OpsForLinear(size);
+  vector<Heartbeat*> fresh;
+  for(unsigned long i = 0; i < ops; ++i)
+    fresh.push_back(new Heartbeat(0, ents[i % size], observer, 0,
+                                  Entity::kMinTimes + i, bv));
+
+  unsigned long seen = 0;
+  Timer timer;
+  for(Heartbeat* h : fresh) {
+    observer->Handle(h);
+    seen += observer->ComputeRecentlySeen().bv_->size();
+  }
+  seconds = timer.Elapsed();
+  sink = seen;
+
+  for(Heartbeat* h : beats)
+    delete h;
+  for(Heartbeat* h : fresh)
+    delete h;
+  DeleteControllers(ents);
+  return ops;
+}
+
+/* The observer holds the views of a network that has warmed up after a few
+ * failures: it has heard kMinTimes heartbeats from every entity but one in
+ * 64, which failed, and each of those heartbeats reports every entity but the
+ * failed ones as recently seen.
+ */
+unsigned long BenchComputePartitions(unsigned int size, double& seconds) {
+  Scheduler sched(1, size);
+  Statistics stats(sched);
+  vector<Controller*> ents = MakeControllers(sched, stats, size);
+  Controller* observer = ents[0];
+  observer->EnableLeaderElection();
+  StartClock(sched);
+
+  vector<bool>* view = new vector<bool>(size, true);
+  for(Id id = 0; id < size; ++id)
+    if(id % 64 == 63)
+      (*view)[id] = false;
+  BV bv(view, new unsigned int(1));
+
+  vector<Heartbeat*> beats;
+  for(SequenceNum sn = 0; sn < Entity::kMinTimes; ++sn)
+    for(Id id = 1; id < size; ++id)
+      if(id % 64 != 63)
+        beats.push_back(new Heartbeat(0, ents[id], observer, 0, sn, bv));
+  for(Heartbeat* h : beats)
+    observer->Handle(h);
+
+  Timer timer;
+  sink = observer->ComputePartitions().size();
+  seconds = timer.Elapsed();
+
+  for(Heartbeat* h : beats)
+    delete h;
+  DeleteControllers(ents);
+  return 1;
+}
+
+/* Splits the entities into two halves that each form a ring with a few
+ * random shortcuts, and lets the first half see the second but not the other
+ * way around, as happens while a partition heals.  Every operation resolves
+ * the strongly connected components of the whole graph.
+ */
+unsigned long BenchBitMatrixScc(unsigned int size, double& seconds) {
+  const unsigned int kShortcuts = 4;
+  unsigned int half = max(1U, size / 2);
+
+  BitMatrix sees;
+  sees.Reset(size);
+  default_random_engine entropy_src;
+  for(Id i = 0; i < size; ++i) {
+    Id first = i < half ? 0 : half;
+    unsigned int len = i < half ? half : size - half;
+    uniform_int_distribution<unsigned int> peer_dist(0, len - 1);
+    sees.Set(i, first + (i - first + 1) % len);
+    for(unsigned int s = 0; s < kShortcuts; ++s)
+      sees.Set(i, first + peer_dist(entropy_src));
+  }
+  if(half < size) sees.Set(0, half);
+
+  unsigned long ops = 16;
+  vector<unsigned int> id_to_scc;
+  unsigned long sccs = 0;
+  Timer timer;
+  for(unsigned long i = 0; i < ops; ++i)
+    sccs += sees.StronglyConnectedComponents(id_to_scc);
+  seconds = timer.Elapsed();
+  sink = sccs;
+
+  return ops;
+}
+
+/* Link state advertisements carry this many neighbors, which matches the
+ * degree of a fat tree built from 8 port switches.
+ */
+const unsigned int kBenchDegree = 8;
+
+/* Links every entity to the kBenchDegree entities that follow it on a ring */
+Topology MakeLinkStateTopology(unsigned int size) {
+  unsigned int degree = min(kBenchDegree, size - 1);
+  Topology topo(size);
+
+  for(unsigned int i = 0; i < size; ++i)
+    for(unsigned int d = 1; d <= degree; ++d)
+      topo[i].push_back((i + d) % size);
+
+  return topo;
+}
+
+/* Every entity advertises all of its links in MakeLinkStateTopology */
+vector<LinkStateUpdate*> MakeLinkStateUpdates(vector<Controller*>& ents,
+                                              Time expiration) {
+  Topology topo = MakeLinkStateTopology(ents.size());
+  vector<LinkStateUpdate*> updates;
+
+  for(unsigned int i = 0; i < ents.size(); ++i)
+    updates.push_back(new LinkStateUpdate(0, ents[i], 0, ents[i], 1,
+                                          topo[i], expiration));
+
+  return updates;
+}
+
+unsigned long BenchLinkStateUpdate(unsigned int size, double& seconds) {
+  Scheduler sched(1, size);
+  Statistics stats(sched);
+  vector<Controller*> ents = MakeControllers(sched, stats, size);
+  vector<LinkStateUpdate*> updates = MakeLinkStateUpdates(ents, 100);
+
+  LinkState ls(size);
+  ls.Init(MakeLinkStateTopology(size));
+  Timer timer;
+  for(LinkStateUpdate* u : updates)
+    ls.Update(u);
+  seconds = timer.Elapsed();
+
+  for(LinkStateUpdate* u : updates)
+    delete u;
+  DeleteControllers(ents);
+  return size;
+}
+
+/* Refreshes a fully populated database in which nothing has expired, which
+ * is the common case when a switch receives an update.
+ */
+unsigned long BenchLinkStateRefresh(unsigned int size, double& seconds) {
+  Scheduler sched(1, size);
+  Statistics stats(sched);
+  vector<Controller*> ents = MakeControllers(sched, stats, size);
+  vector<LinkStateUpdate*> updates = MakeLinkStateUpdates(ents, 100);
+
+  LinkState ls(size);
+  ls.Init(MakeLinkStateTopology(size));
+  for(LinkStateUpdate* u : updates)
+    ls.Update(u);
+
+  unsigned long ops = OpsForLinear(size);
+  Timer timer;
+  for(unsigned long i = 0; i < ops; ++i)
+    ls.Refresh(1);
+  seconds = timer.Elapsed();
+
+  for(LinkStateUpdate* u : updates)
+    delete u;
+  DeleteControllers(ents);
+  return ops;
+}
+
+/* Builds a circulant graph in which every entity links to the kBenchDegree
+ * entities nearest to it on a ring, then repeatedly takes a random link down
+ * and back up, folding each change into the routes of entity 0.
+ */
+unsigned long BenchRoutesLinkFlap(unsigned int size, double& seconds) {
+  unsigned int half = min(kBenchDegree / 2, (size - 1) / 2);
+  vector<vector<Id> > rows(size);
+  for(Id i = 0; i < size; ++i) {
+    for(unsigned int d = 1; d <= half; ++d) {
+      rows[i].push_back((i + d) % size);
+      rows[i].push_back((i + size - d) % size);
+    }
+  }
+
+  LinkState ls(size);
+  ls.Init(rows);
+  ls.TrackChanges();
+  for(Id i = 0; i < size; ++i)
+    ls.Update(i, rows[i]);
+  Routes routes(0, size);
+  routes.Recompute(ls);
+
+  unsigned long ops = 256;
+  default_random_engine entropy_src;
+  uniform_int_distribution<unsigned int> id_dist(0, size - 1);
+
+  unsigned long touched = 0;
+  Timer timer;
+  for(unsigned long i = 0; i < ops / 2; ++i) {
+    Id id = id_dist(entropy_src);
+    vector<Id> without(rows[id].begin() + 1, rows[id].end());
+    ls.Update(id, without);
+    touched += routes.Recompute(ls);
+    ls.Update(id, rows[id]);
+    touched += routes.Recompute(ls);
+  }
+  seconds = timer.Elapsed();
+  sink = touched;
+
+  return ops;
+}
+
+/* Splits the circulant graph of BenchRoutesLinkFlap, with random chords
+ * added so that it is not trivially cut along the ring, into kBenchParts
+ * parts.
+ */
+const unsigned int kBenchParts = 8;
+
+unsigned long BenchPartitionTopology(unsigned int size, double& seconds) {
+  unsigned int half = min(kBenchDegree / 2, (size - 1) / 2);
+  default_random_engine entropy_src;
+  uniform_int_distribution<unsigned int> id_dist(0, size - 1);
+
+  Topology topo(size);
+  for(Id i = 0; i < size; ++i) {
+    for(unsigned int d = 1; d <= half; ++d)
+      topo[i].push_back((i + d) % size);
+    if(i % 16 == 0)
+      topo[i].push_back(id_dist(entropy_src));
+  }
+
+  Timer timer;
+  Partitioner partitioner(topo);
+  partitioner.Partition(kBenchParts);
+  seconds = timer.Elapsed();
+  sink = partitioner.cut_links();
+
+  return 1;
+}
+
+/* For Links the size is the number of ports on a single entity. */
+unsigned long BenchLinksGetPortTo(unsigned int size, double& seconds) {
+  Scheduler sched(1, size + 1);
+  Statistics stats(sched);
+  vector<Controller*> ents = MakeControllers(sched, stats, size + 1);
+  Controller* hub = ents[size];
+  hub->InitLinks(ents.begin(), ents.begin() + size,
+                 BandwidthMeter::kDefaultCapacity,
+                 BandwidthMeter::kDefaultRate);
+
+  unsigned long ops = OpsForLinear(size);
+  default_random_engine entropy_src;
+  uniform_int_distribution<unsigned int> port_dist(0, size - 1);
+  vector<Entity*> targets;
+  for(unsigned long i = 0; i < ops; ++i)
+    targets.push_back(ents[port_dist(entropy_src)]);
+
+  unsigned long ports = 0;
+  Timer timer;
+  for(Entity* e : targets)
+    ports += hub->links().GetPortTo(e);
+  seconds = timer.Elapsed();
+  sink = ports;
+
+  DeleteControllers(ents);
+  return ops;
+}
+
+struct BenchmarkInfo {
+  const char* name;
+  Benchmark run;
+  bool is_quadratic;
+};
+
+const BenchmarkInfo kBenchmarks[] = {
+  {"scheduler_enqueue", BenchSchedulerEnqueue, false},
+  {"scheduler_dequeue", BenchSchedulerDequeue, false},
+  {"scheduler_periodic_timers", BenchSchedulerPeriodicTimers, false},
+  {"heartbeat_history_mark_as_seen", BenchHistoryMarkAsSeen, false},
+  {"heartbeat_history_has_been_seen", BenchHistoryHasBeenSeen, false},
+  {"heartbeat_history_sight_and_expire", BenchHistorySightAndExpire, false},
+  {"entity_compute_recently_seen", BenchComputeRecentlySeen, false},
+  {"entity_compute_partitions", BenchComputePartitions, true},
+  {"bit_matrix_scc", BenchBitMatrixScc, true},
+  {"link_state_update", BenchLinkStateUpdate, false},
+  {"link_state_refresh", BenchLinkStateRefresh, false},
+  {"links_get_port_to", BenchLinksGetPortTo, false},
+  {"routes_link_flap", BenchRoutesLinkFlap, false},
+  {"partition_topology", BenchPartitionTopology, false},
+};
+
+bool ParseArgs(int ac, char* av[], vector<unsigned int>& sizes,
+               unsigned int& repetitions, string& filter, string& label,
+               unsigned int& max_quadratic_size) {
+  options_description desc("Allowed options");
+  desc.add_options()
+      ("help",
+       "produce help message")
+      ("sizes,s",
+       value<vector<unsigned int> >(&sizes)->multitoken()->default_value(
+           {16, 64, 256, 1024, 4096, 16384, 100000},
+           "16 64 256 1024 4096 16384 100000"),
+       "fixture sizes (number of entities) to run each benchmark at")
+      ("repetitions,r",
+       value<unsigned int>(&repetitions)->default_value(3),
+       "run each benchmark this many times and report the fastest")
+      ("filter,f",
+       value<string>(&filter)->default_value(""),
+       "only run benchmarks whose name contains this string")
+      ("label,l",
+       value<string>(&label)->default_value(""),
+       "value of the label column, e.g. a version identifier")
+      ("max-quadratic-size,q",
+       value<unsigned int>(&max_quadratic_size)->default_value(4096),
+       "skip benchmarks whose single operation is quadratic above this size");
+
+  variables_map vm;
+  store(command_line_parser(ac, av).options(desc).run(), vm);
+  notify(vm);
+
+  if(vm.count("help")) {
+    cerr << desc << endl;
+    return false;
+  }
+
+  if(repetitions == 0) {
+    cerr << "At least one repetition is required" << endl;
+    return false;
+  }
+
+  for(unsigned int size : sizes) {
+    if(size < 2) {
+      cerr << "Fixture sizes must be at least 2" << endl;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int main(int ac, char* av[]) {
+  vector<unsigned int> sizes;
+  unsigned int repetitions, max_quadratic_size;
+  string filter, label;
+
+  bool valid_args = ParseArgs(ac, av, sizes, repetitions, filter, label,
+                              max_quadratic_size);
+
+  if(!valid_args) return -1;
+
+  google::InitGoogleLogging(av[0]);
+  FLAGS_minloglevel = 2;
+
+  cout << "label,benchmark,size,operations,seconds,ns_per_op" << endl;
+
+  for(const BenchmarkInfo& b : kBenchmarks) {
+    if(string(b.name).find(filter) != string::npos) {
+      for(unsigned int size : sizes) {
+        if(b.is_quadratic && size > max_quadratic_size) continue;
+
+        double best = -1;
+        unsigned long ops = 0;
+        for(unsigned int r = 0; r < repetitions; ++r) {
+          double seconds;
+          ops = b.run(size, seconds);
+          if(best < 0 || seconds < best) best = seconds;
+        }
+
+        cout << label << "," << b.name << "," << size << "," << ops << ","
+             << best << "," << (best * 1e9 / ops) << endl;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,128 @@
+# End-to-end scaling benchmark for the simulator.
+#
+# Generates fat trees for a range of k values (see
+# tests/fat_tree/gen_fat_tree.py), runs a full simulation for every
+# combination of k and end time, and records the wall time, peak resident set
+# size, number of events processed and events per second of each run.  The
+# results are written as CSV, together with the empirical exponent of wall
+# time against the number of switches between consecutive k values, so that
+# changes to the asymptotic behaviour of the whole pipeline stand out.
+#
+# Usage (from the root of the project, after "make"):
+#   python bench/scaling.py --ks 4 8 16 24 --end-times 10 30 > scaling.csv
+from __future__ import division, print_function
+
+import argparse
+import math
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+separator = ","
+
+root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+generator = os.path.join(root, "tests", "fat_tree", "gen_fat_tree.py")
+
+events_line = re.compile(r"Processed (\d+) events")
+
+
+def num_switches(k):
+    return 5 * k * k // 4
+
+
+def generate_topology(k, work_dir):
+    path = os.path.join(work_dir, "fat_tree_" + str(k) + "_nohosts.yaml")
+    if not os.path.exists(path):
+        with open(path, "w") as out:
+            subprocess.check_call([sys.executable, generator, str(k)],
+                                  stdout=out)
+    return path
+
+
+def run(pilosim, topo, k, end_time, sim_args, work_dir):
+    """Runs one simulation and returns (wall secs, peak RSS in KB, events)."""
+    out_prefix = tempfile.mkdtemp(dir=work_dir) + os.sep
+    cmd = [pilosim, topo, "-n", str(num_switches(k)), "-t", str(end_time),
+           "-O", out_prefix] + sim_args
+
+    with open(os.path.join(out_prefix, "stderr.txt"), "w+") as err:
+        start = time.time()
+        proc = subprocess.Popen(cmd, stdout=err, stderr=err)
+        # wait4 rather than wait so the rusage covers this child only
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = time.time() - start
+
+        err.seek(0)
+        matches = events_line.findall(err.read())
+
+    shutil.rmtree(out_prefix)
+
+    if not os.WIFEXITED(status) or os.WEXITSTATUS(status) != 0 or \
+            not matches:
+        raise RuntimeError("simulation failed: " + " ".join(cmd))
+
+    return wall, usage.ru_maxrss, int(matches[-1])
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Run full simulations over generated fat trees")
+    parser.add_argument("--pilosim", default=os.path.join(root, "pilosim"),
+                        help="path to the simulator executable")
+    parser.add_argument("--ks", type=int, nargs="+", default=[4, 8, 12, 16],
+                        help="fat tree arities to simulate")
+    parser.add_argument("--end-times", type=float, nargs="+", default=[10],
+                        help="simulated seconds for each run")
+    parser.add_argument("--repetitions", type=int, default=1,
+                        help="run each configuration this many times and "
+                        "report the fastest")
+    parser.add_argument("--label", default="",
+                        help="value of the label column")
+    parser.add_argument("--sim-args", default="",
+                        help="extra arguments passed verbatim to the "
+                        "simulator")
+    args = parser.parse_args()
+
+    for k in args.ks:
+        if k < 2 or k % 2 != 0:
+            parser.error("fat tree arities must be positive and even")
+
+    work_dir = tempfile.mkdtemp(prefix="ddcsim_scaling_")
+    sim_args = args.sim_args.split()
+
+    print(separator.join(["label", "k", "switches", "end_time", "wall_secs",
+                          "peak_rss_kb", "events", "events_per_sec",
+                          "time_exponent"]))
+
+    try:
+        for end_time in args.end_times:
+            last = None
+            for k in sorted(args.ks):
+                topo = generate_topology(k, work_dir)
+                runs = [run(args.pilosim, topo, k, end_time, sim_args,
+                            work_dir) for _ in range(args.repetitions)]
+                wall, rss, events = min(runs)
+
+                # Exponent e in wall ~ switches^e, fit between this k and the
+                # previous one
+                exponent = ""
+                if last is not None and last[1] > 0 and wall > 0:
+                    exponent = "%.2f" % (
+                        math.log(wall / last[1]) /
+                        math.log(num_switches(k) / num_switches(last[0])))
+                last = (k, wall)
+
+                print(separator.join([
+                    args.label, str(k), str(num_switches(k)), str(end_time),
+                    "%.3f" % wall, str(rss), str(events),
+                    "%.0f" % (events / wall if wall > 0 else 0), exponent]))
+                sys.stdout.flush()
+    finally:
+        shutil.rmtree(work_dir)
+
+if __name__ == "__main__":
+    main()
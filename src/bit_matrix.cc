@@ -0,0 +1,183 @@
+#include "bit_matrix.h"
+
+#include <algorithm>
+#include <glog/logging.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+using std::vector;
+
+/* Four words make one 256 bit AVX2 register */
+const unsigned int BitMatrix::kWordsPerBlock = 4;
+
+namespace {
+
+const unsigned int kBitsPerWord = 64;
+
+inline void SetBit(uint64_t* words, Id i) {
+  words[i / kBitsPerWord] |= uint64_t(1) << (i % kBitsPerWord);
+}
+
+inline bool GetBit(const uint64_t* words, Id i) {
+  return (words[i / kBitsPerWord] >> (i % kBitsPerWord)) & 1;
+}
+
+/* Calls f with the index of every bit set in words[0, num_words) */
+template<class F> void ForEachBit(const uint64_t* words,
+                                  unsigned int num_words, F f) {
+  for(unsigned int w = 0; w < num_words; ++w)
+    for(uint64_t bits = words[w]; bits != 0; bits &= bits - 1)
+      f(Id(w * kBitsPerWord + __builtin_ctzll(bits)));
+}
+
+/* Sets dst[w] |= src[w] for every w in [0, num_words), where num_words is a
+ * multiple of BitMatrix::kWordsPerBlock.
+ */
+typedef void (*OrWordsFn)(const uint64_t* src, unsigned int num_words,
+                          uint64_t* dst);
+
+void OrWordsScalar(const uint64_t* src, unsigned int num_words,
+                   uint64_t* dst) {
+  for(unsigned int w = 0; w < num_words; ++w)
+    dst[w] |= src[w];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void OrWordsAvx2(const uint64_t* src, unsigned int num_words, uint64_t* dst) {
+  for(unsigned int w = 0; w < num_words; w += BitMatrix::kWordsPerBlock) {
+    __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + w));
+    __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + w));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + w),
+                        _mm256_or_si256(d, s));
+  }
+}
+#endif
+
+OrWordsFn SelectOrWords() {
+#if defined(__x86_64__) || defined(__i386__)
+  if(HasAvx2()) return OrWordsAvx2;
+#endif
+  return OrWordsScalar;
+}
+
+const OrWordsFn OrWords = SelectOrWords();
+
+} // namespace
+
+BitMatrix::BitMatrix() : size_(0), words_per_row_(0), bits_() {}
+
+/* Makes this an all zero size x size matrix */
+void BitMatrix::Reset(unsigned int size) {
+  unsigned int words = (size + kBitsPerWord - 1) / kBitsPerWord;
+  size_ = size;
+  words_per_row_ =
+      (words + kWordsPerBlock - 1) / kWordsPerBlock * kWordsPerBlock;
+  bits_.assign(uint64_t(size_) * words_per_row_, 0);
+}
+
+unsigned int BitMatrix::size() const { return size_; }
+
+unsigned int BitMatrix::words_per_row() const { return words_per_row_; }
+
+void BitMatrix::Set(Id i, Id j) {
+  SetBit(&bits_[uint64_t(i) * words_per_row_], j);
+}
+
+bool BitMatrix::Get(Id i, Id j) const {
+  return GetBit(Row(i), j);
+}
+
+void BitMatrix::SetRow(Id i, const vector<bool>& row) {
+  CHECK_LE(row.size(), size_);
+  uint64_t* words = &bits_[uint64_t(i) * words_per_row_];
+
+  ClearRow(i);
+  for(Id j = 0; j < Id(row.size()); ++j)
+    if(row[j])
+      SetBit(words, j);
+}
+
+void BitMatrix::ClearRow(Id i) {
+  uint64_t* words = &bits_[uint64_t(i) * words_per_row_];
+  std::fill(words, words + words_per_row_, 0);
+}
+
+const uint64_t* BitMatrix::Row(Id i) const {
+  return &bits_[uint64_t(i) * words_per_row_];
+}
+
+void BitMatrix::Transpose(BitMatrix& t) const {
+  t.Reset(size_);
+
+  for(Id i = 0; i < Id(size_); ++i)
+    ForEachBit(Row(i), words_per_row_, [&](Id j) { t.Set(j, i); });
+}
+
+/* Sets reach to the entities reachable from src, src included.  If mask is
+ * given, the search only enters the entities whose bits are set in it.
+ */
+void BitMatrix::Reach(Id src, const uint64_t* mask,
+                      vector<uint64_t>& reach) const {
+  vector<uint64_t> frontier(words_per_row_, 0), next(words_per_row_);
+
+  reach.assign(words_per_row_, 0);
+  SetBit(reach.data(), src);
+  SetBit(frontier.data(), src);
+
+  for(bool has_frontier = true; has_frontier; ) {
+    std::fill(next.begin(), next.end(), 0);
+    ForEachBit(frontier.data(), words_per_row_,
+               [&](Id i) { OrRow(i, next.data()); });
+
+    has_frontier = false;
+    for(unsigned int w = 0; w < words_per_row_; ++w) {
+      uint64_t fresh = next[w] & ~reach[w];
+      if(mask != nullptr) fresh &= mask[w];
+      frontier[w] = fresh;
+      reach[w] |= fresh;
+      has_frontier |= fresh != 0;
+    }
+  }
+}
+
+/* The strongly connected component of an entity is the set of entities that
+ * it reaches and that reach it.  Components are found in order of their
+ * smallest entity, which is also the order in which they are numbered; each
+ * search is confined to the entities not yet assigned, and the backward one
+ * to those the forward one reached.  Returns the number of components.
+ */
+unsigned int BitMatrix::StronglyConnectedComponents(
+    vector<unsigned int>& id_to_scc) const {
+  BitMatrix reversed;
+  Transpose(reversed);
+
+  vector<uint64_t> remaining(words_per_row_, 0), forward, scc;
+  for(Id i = 0; i < Id(size_); ++i)
+    SetBit(remaining.data(), i);
+
+  id_to_scc.assign(size_, 0);
+  unsigned int num_sccs = 0;
+
+  for(Id i = 0; i < Id(size_); ++i) {
+    if(!GetBit(remaining.data(), i)) continue;
+
+    Reach(i, remaining.data(), forward);
+    reversed.Reach(i, forward.data(), scc);
+
+    ForEachBit(scc.data(), words_per_row_,
+               [&](Id j) { id_to_scc[j] = num_sccs; });
+    for(unsigned int w = 0; w < words_per_row_; ++w)
+      remaining[w] &= ~scc[w];
+
+    ++num_sccs;
+  }
+
+  return num_sccs;
+}
+
+void BitMatrix::OrRow(Id i, uint64_t* dst) const {
+  OrWords(Row(i), words_per_row_, dst);
+}
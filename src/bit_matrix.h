@@ -0,0 +1,43 @@
+#ifndef DDCSIM_BIT_MATRIX_H_
+#define DDCSIM_BIT_MATRIX_H_
+
+#include <inttypes.h>
+#include <vector>
+
+#include "common.h"
+
+/* A square matrix of bits whose rows are packed into 64 bit words, so that
+ * the adjacency of a directed graph over N entities fits in N * N / 8 bytes
+ * and a set of entities is a row-sized run of words.  Reachability is
+ * computed a whole frontier at a time: the successors of every entity in the
+ * frontier are ORed together, so one pass over a row handles 64 entities per
+ * word operation (256 per instruction where AVX2 is available).
+ *
+ * Rows are padded to a multiple of kWordsPerBlock words so that the word
+ * loops can be vectorized without a scalar tail.
+ */
+class BitMatrix {
+ public:
+  BitMatrix();
+  void Reset(unsigned int);
+  unsigned int size() const;
+  unsigned int words_per_row() const;
+  void Set(Id, Id);
+  bool Get(Id, Id) const;
+  void SetRow(Id, const std::vector<bool>&);
+  void ClearRow(Id);
+  const uint64_t* Row(Id) const;
+  void Transpose(BitMatrix&) const;
+  void Reach(Id, const uint64_t*, std::vector<uint64_t>&) const;
+  unsigned int StronglyConnectedComponents(std::vector<unsigned int>&) const;
+  void OrRow(Id, uint64_t*) const;
+  static const unsigned int kWordsPerBlock;
+
+ private:
+  unsigned int size_;
+  unsigned int words_per_row_;
+  std::vector<uint64_t> bits_;
+  DISALLOW_COPY_AND_ASSIGN(BitMatrix);
+};
+
+#endif
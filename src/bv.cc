@@ -2,10 +2,122 @@
 
 #include <glog/logging.h>
 
+#include <cmath>
+
+using std::ceil;
+using std::string;
 using std::vector;
 
+namespace {
+
+/* Every encoding starts with a byte saying which one it is */
+const Size kEncodingTagSize = 1;
+
+/* Ids, run lengths and gaps are written as LEB128 varints */
+Size VarintSize(unsigned long v) {
+  Size bytes = 1;
+
+  for( ; v >= 128; v >>= 7)
+    ++bytes;
+
+  return bytes;
+}
+
+/* Size of the gaps between successive positions i at which pick(i) holds,
+ * preceded by the number of such positions.
+ */
+template<class Predicate> Size PositionListSize(unsigned long n,
+                                                Predicate pick) {
+  Size size = 0;
+  unsigned long count = 0, next = 0;
+
+  for(unsigned long i = 0; i < n; ++i) {
+    if(pick(i)) {
+      size += VarintSize(i - next);
+      next = i + 1;
+      ++count;
+    }
+  }
+
+  return VarintSize(count) + size;
+}
+
+} // namespace
+
 BV::BV(std::vector<bool>* bv, unsigned int* ref_count)
-    : bv_(bv), ref_count_(ref_count) {}
+    : bv_(bv), ref_count_(ref_count), encoding_(DENSE),
+      encoded_size_(bv == NULL ? 0 : EncodedSize(DENSE, *bv, NULL)) {}
+
+/* Picks the smallest encoding of this vector.  last is the vector advertised
+ * by the sender's previous heartbeat, or null if there was none.  A delta
+ * against it assumes that receivers still hold that vector, which is how the
+ * sizes are accounted for rather than something the simulator checks.
+ */
+void BV::Encode(const vector<bool>* last) {
+  encoding_ = DENSE;
+  encoded_size_ = EncodedSize(DENSE, *bv_, last);
+
+  for(Encoding e : {SPARSE, RUN_LENGTH, DELTA}) {
+    Size size = EncodedSize(e, *bv_, last);
+    if(size < encoded_size_) {
+      encoding_ = e;
+      encoded_size_ = size;
+    }
+  }
+}
+
+/* Returns the size in bytes of bits under encoding e, which is infinite for a
+ * delta that has nothing to be taken against.
+ */
+Size BV::EncodedSize(Encoding e, const vector<bool>& bits,
+                     const vector<bool>* last) {
+  unsigned long n = bits.size();
+
+  switch(e) {
+    case DENSE:
+      return kEncodingTagSize + ceil(n / 8.0);
+    case SPARSE:
+      return kEncodingTagSize +
+          PositionListSize(n, [&](unsigned long i) { return bits[i]; });
+    case RUN_LENGTH: {
+      /* Runs alternate between unset and set bits, starting with a possibly
+       * empty run of unset bits
+       */
+      Size size = kEncodingTagSize;
+      unsigned long run = 0;
+      bool value = false;
+      for(unsigned long i = 0; i < n; ++i) {
+        if(bits[i] != value) {
+          size += VarintSize(run);
+          run = 0;
+          value = bits[i];
+        }
+        ++run;
+      }
+      return size + VarintSize(run);
+    }
+    case DELTA:
+      if(last == NULL || last->size() != n)
+        return HUGE_VAL;
+      return kEncodingTagSize +
+          PositionListSize(n, [&](unsigned long i) {
+              return bits[i] != (*last)[i];
+            });
+    default:
+      LOG(ERROR) << "Unknown encoding " << int(e);
+      return HUGE_VAL;
+  }
+}
+
+string BV::EncodingName(Encoding e) {
+  switch(e) {
+    case DENSE: return "dense";
+    case SPARSE: return "sparse";
+    case RUN_LENGTH: return "run length";
+    case DELTA: return "delta";
+    default: return "unknown";
+  }
+}
 
 // BV::BV(const BV& that) : bv_(new vector<bool>(*that.bv_)), ref_count_() {}
 // BV::BV(const BV& that) : bv_(that.bv_), ref_count_(that.ref_count_) {
@@ -3,10 +3,17 @@
 
 #include "common.h"
 
+#include <string>
 #include <vector>
 
+/* A handle on a reference counted recently seen vector, along with the
+ * encoding that the heartbeats carrying it use on the wire.  Handles to the
+ * same vector may use different encodings, since a delta is only small for
+ * the heartbeat that follows the one it is taken against.
+ */
 class BV {
  public:
+  enum Encoding : unsigned char { DENSE, SPARSE, RUN_LENGTH, DELTA };
  //  BV(std::vector<bool>* bv);
  //  BV(const BV&);
  //  BV(BV&&);
@@ -15,8 +22,14 @@ class BV {
  //  ~BV();
  // private:
   BV(std::vector<bool>*, unsigned int*);
+  void Encode(const std::vector<bool>*);
+  static Size EncodedSize(Encoding, const std::vector<bool>&,
+                          const std::vector<bool>*);
+  static std::string EncodingName(Encoding);
   std::vector<bool>* bv_;
   unsigned int* ref_count_;
+  Encoding encoding_;
+  Size encoded_size_;
 };
 
 #endif
@@ -0,0 +1,370 @@
+#include "checkpoint.h"
+#include "entities.h"
+#include "events.h"
+#include "scheduler.h"
+#include "statistics.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+using std::ifstream;
+using std::ofstream;
+using std::sort;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+const string Checkpoint::kMagic = "PILOSIMCKPT";
+const uint32_t Checkpoint::kVersion = 12;
+const uint32_t Checkpoint::kNoIndex = 0xffffffff;
+
+Checkpoint::Checkpoint(unordered_map<Id, Entity*>& id_to_entity)
+    : id_to_entity_(id_to_entity), out_(), in_(), in_size_(0),
+      num_entities_(0), failed_(false),
+      bv_to_index_(), index_to_bv_(), ad_to_index_(), index_to_ad_(),
+      batch_to_index_(), index_to_batch_() {}
+
+/* Entities are written in order of id so that a checkpoint does not depend on
+ * the iteration order of id_to_entity_.
+ */
+bool Checkpoint::Save(string path, Scheduler& sched, Statistics& stats) {
+  out_.open(path, ofstream::out | ofstream::binary | ofstream::trunc);
+
+  if(!out_.is_open()) {
+    LOG(ERROR) << "Could not open checkpoint " << path << " for writing";
+    return false;
+  }
+
+  vector<Id> ids;
+  for(auto it : id_to_entity_)
+    ids.push_back(it.first);
+  sort(ids.begin(), ids.end());
+
+  WriteString(kMagic);
+  Write(kVersion);
+  Write<uint32_t>(sched.num_entities());
+  Write<uint32_t>(ids.size());
+
+  for(Id id : ids) {
+    Entity* e = id_to_entity_[id];
+    Write(id);
+    WriteString(e->Name());
+    e->Save(*this);
+  }
+
+  sched.Save(*this);
+  stats.Save(*this);
+
+  out_.close();
+
+  if(out_.fail()) {
+    LOG(ERROR) << "Failed to write checkpoint " << path;
+    return false;
+  }
+
+  return true;
+}
+
+bool Checkpoint::Restore(string path, Scheduler& sched, Statistics& stats) {
+  in_.open(path, ifstream::in | ifstream::binary);
+
+  if(!in_.is_open()) {
+    LOG(ERROR) << "Could not open checkpoint " << path << " for reading";
+    return false;
+  }
+
+  in_.seekg(0, ifstream::end);
+  in_size_ = in_.tellg();
+  in_.seekg(0, ifstream::beg);
+
+  string magic;
+  uint32_t version = 0, num_entities = 0, num_saved = 0;
+
+  ReadString(magic);
+  Read(version);
+
+  if(failed_ || magic != kMagic || version != kVersion) {
+    LOG(ERROR) << path << " is not a version " << kVersion << " checkpoint";
+    return false;
+  }
+
+  Read(num_entities);
+  Read(num_saved);
+  num_entities_ = sched.num_entities();
+
+  if(num_entities != sched.num_entities() ||
+     num_saved != id_to_entity_.size()) {
+    LOG(ERROR) << "Checkpoint " << path << " was taken of a different topology";
+    return false;
+  }
+
+  for(uint32_t i = 0; i < num_saved && !failed_; ++i) {
+    Id id = NONE_ID;
+    string name;
+    Read(id);
+    ReadString(name);
+
+    auto it = id_to_entity_.find(id);
+    if(it == id_to_entity_.end() || it->second->Name() != name) {
+      Fail("checkpoint has " + name + " " + std::to_string(id) +
+           " which is not in the topology");
+      break;
+    }
+
+    it->second->Restore(*this);
+  }
+
+  if(!failed_) sched.Restore(*this);
+  if(!failed_) stats.Restore(*this);
+
+  return !failed_;
+}
+
+/* Only the first failure is logged, since what is read after it is garbage */
+void Checkpoint::Fail(string why) {
+  if(failed_) return;
+  LOG(ERROR) << "Could not restore checkpoint: " << why;
+  failed_ = true;
+}
+
+bool Checkpoint::failed() const { return failed_; }
+
+/* Whether every entry of ids is the id of an entity being restored */
+bool Checkpoint::AreIds(const vector<Id>& ids) const {
+  for(Id id : ids)
+    if(id < 0 || id >= Id(num_entities_)) return false;
+  return true;
+}
+
+uint64_t Checkpoint::BytesLeft() {
+  std::streamoff pos = in_.tellg();
+  if(pos < 0 || uint64_t(pos) > in_size_) return 0;
+  return in_size_ - pos;
+}
+
+void Checkpoint::WriteBits(const vector<bool>& bits) {
+  vector<unsigned char> packed((bits.size() + 7) / 8, 0);
+
+  for(uint64_t i = 0; i < bits.size(); ++i)
+    if(bits[i])
+      packed[i / 8] |= 1 << (i % 8);
+
+  Write<uint64_t>(bits.size());
+  WriteVector(packed);
+}
+
+void Checkpoint::ReadBits(vector<bool>& bits) {
+  uint64_t size = 0;
+  vector<unsigned char> packed;
+
+  Read(size);
+  ReadVector(packed);
+
+  if(failed_) return;
+
+  if(size > packed.size() * 8 || packed.size() != (size + 7) / 8) {
+    Fail("bit vector has the wrong length");
+    return;
+  }
+
+  bits.assign(size, false);
+  for(uint64_t i = 0; i < size; ++i)
+    bits[i] = (packed[i / 8] >> (i % 8)) & 1;
+}
+
+void Checkpoint::WriteString(const string& s) {
+  WriteVector(vector<char>(s.begin(), s.end()));
+}
+
+void Checkpoint::ReadString(string& s) {
+  vector<char> chars;
+  ReadVector(chars);
+  if(failed_) return;
+  s.assign(chars.begin(), chars.end());
+}
+
+void Checkpoint::WriteEntity(const Entity* e) {
+  Write(e == nullptr ? NONE_ID : e->id());
+}
+
+Entity* Checkpoint::ReadEntity() {
+  Id id = NONE_ID;
+  Read(id);
+
+  if(failed_ || id == NONE_ID) return nullptr;
+
+  auto it = id_to_entity_.find(id);
+  if(it == id_to_entity_.end()) {
+    Fail("reference to unknown entity " + std::to_string(id));
+    return nullptr;
+  }
+
+  return it->second;
+}
+
+/* Restored vectors start out with a reference count of zero; each event or
+ * entity that holds one takes its own reference, just as when the vector was
+ * first shared.  The encoding belongs to the handle, so it is written every
+ * time.
+ */
+void Checkpoint::WriteBV(const BV& bv) {
+  if(bv.bv_ == nullptr) {
+    Write(kNoIndex);
+    return;
+  }
+
+  auto it = bv_to_index_.find(bv.bv_);
+  if(it != bv_to_index_.end()) {
+    Write(it->second);
+  } else {
+    uint32_t index = bv_to_index_.size();
+    bv_to_index_.insert({bv.bv_, index});
+    Write(index);
+    WriteBits(*bv.bv_);
+  }
+
+  Write(bv.encoding_);
+  Write(bv.encoded_size_);
+}
+
+BV Checkpoint::ReadBV() {
+  uint32_t index = kNoIndex;
+  Read(index);
+
+  if(failed_ || index == kNoIndex) return BV(nullptr, nullptr);
+
+  if(index == index_to_bv_.size()) {
+    vector<bool>* bits = new vector<bool>();
+    ReadBits(*bits);
+    index_to_bv_.push_back(BV(bits, new unsigned int(0)));
+    if(!failed_ && bits->size() != num_entities_)
+      Fail("recently seen vector has " + std::to_string(bits->size()) +
+           " entries");
+  }
+
+  if(failed_ || index >= index_to_bv_.size()) {
+    Fail("reference to unknown recently seen vector " + std::to_string(index));
+    return BV(nullptr, nullptr);
+  }
+
+  BV bv = index_to_bv_[index];
+  Read(bv.encoding_);
+  Read(bv.encoded_size_);
+  if(!failed_ && bv.encoding_ > BV::DELTA)
+    Fail("recently seen vector has unknown encoding " +
+         std::to_string(int(bv.encoding_)));
+  return bv;
+}
+
+void Checkpoint::WriteAdvertisement(const Advertisement* ad) {
+  auto it = ad_to_index_.find(ad);
+  if(it != ad_to_index_.end()) {
+    Write(it->second);
+    return;
+  }
+
+  uint32_t index = ad_to_index_.size();
+  ad_to_index_.insert({ad, index});
+  Write(index);
+  WriteVector(ad->neighbors_);
+  Write(ad->kind_);
+  Write(ad->base_sn_);
+  WriteVector(ad->added_);
+  WriteVector(ad->removed_);
+}
+
+/* Returns null if the checkpoint is bad */
+Advertisement* Checkpoint::ReadAdvertisement() {
+  uint32_t index = kNoIndex;
+  Read(index);
+
+  if(failed_) return nullptr;
+
+  if(index == index_to_ad_.size()) {
+    Advertisement* ad = Advertisement::Full(vector<Id>(), 0);
+    ReadVector(ad->neighbors_);
+    Read(ad->kind_);
+    Read(ad->base_sn_);
+    ReadVector(ad->added_);
+    ReadVector(ad->removed_);
+    index_to_ad_.push_back(ad);
+    if(!failed_ && ad->kind_ > REFRESH_ADVERTISEMENT)
+      Fail("advertisement of unknown kind " + std::to_string(int(ad->kind_)));
+    if(!failed_ && !(AreIds(ad->neighbors_) && AreIds(ad->added_) &&
+                     AreIds(ad->removed_)))
+      Fail("advertisement names an unknown entity");
+  }
+
+  if(failed_ || index >= index_to_ad_.size()) {
+    Fail("reference to unknown advertisement " + std::to_string(index));
+    return nullptr;
+  }
+
+  return index_to_ad_[index];
+}
+
+/* Restored batches start out with a reference count of zero, like restored
+ * vectors, but each of their entries holds a reference to its vector.
+ */
+void Checkpoint::WriteHeartbeatBatch(const HeartbeatBatch* b) {
+  auto it = batch_to_index_.find(b);
+  if(it != batch_to_index_.end()) {
+    Write(it->second);
+    return;
+  }
+
+  uint32_t index = batch_to_index_.size();
+  batch_to_index_.insert({b, index});
+  Write(index);
+  Write<uint64_t>(b->entries_.size());
+  for(const BatchEntry& entry : b->entries_) {
+    WriteEntity(entry.src_);
+    Write(entry.sn_);
+    WriteBV(entry.recently_seen_);
+    Write(entry.in_port_);
+    Write(entry.current_partition_);
+    Write(entry.leader_);
+  }
+}
+
+/* Returns null if the checkpoint is bad */
+HeartbeatBatch* Checkpoint::ReadHeartbeatBatch() {
+  uint32_t index = kNoIndex;
+  Read(index);
+
+  if(failed_) return nullptr;
+
+  if(index == index_to_batch_.size()) {
+    HeartbeatBatch* b = new HeartbeatBatch{vector<BatchEntry>(), 0};
+    uint64_t size = 0;
+    Read(size);
+    for(uint64_t i = 0; i < size && !failed_; ++i) {
+      const Entity* src = ReadEntity();
+      SequenceNum sn = NONE_SEQNUM;
+      Read(sn);
+      BV bv = ReadBV();
+      Port in = PORT_NOT_FOUND;
+      Read(in);
+      unsigned int partition = 0;
+      Id leader = NONE_ID;
+      Read(partition);
+      Read(leader);
+      if(failed_) break;
+      if(bv.ref_count_ == nullptr) {
+        Fail("heartbeat batch entry has no recently seen vector");
+        break;
+      }
+      ++(*bv.ref_count_);
+      b->entries_.push_back(BatchEntry{src, sn, bv, in, partition, leader});
+    }
+    index_to_batch_.push_back(b);
+  }
+
+  if(failed_ || index >= index_to_batch_.size()) {
+    Fail("reference to unknown heartbeat batch " + std::to_string(index));
+    return nullptr;
+  }
+
+  return index_to_batch_[index];
+}
@@ -0,0 +1,109 @@
+#ifndef DDCSIM_CHECKPOINT_H_
+#define DDCSIM_CHECKPOINT_H_
+
+#include <inttypes.h>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bv.h"
+#include "common.h"
+
+class Entity;
+class Scheduler;
+class Statistics;
+struct Advertisement;
+struct HeartbeatBatch;
+
+/* A checkpoint is a binary snapshot of a paused simulation: the state of every
+ * entity, the scheduler's queue and the statistics' current window.  It does
+ * not describe the topology itself, so a checkpoint is restored into the
+ * entities freshly built from the same topology file, before any events have
+ * been scheduled.  This lets a warm-up phase be simulated once and then
+ * forked into many failure scenarios.
+ *
+ * Each class saves and restores its own members through the Write and Read
+ * methods below.  Pointers to entities are written as their ids, and the
+ * recently seen vectors, advertisements and heartbeat batches that events
+ * share are written
+ * once, the first time they are encountered, and referred to by index after
+ * that.
+ *
+ * A checkpoint that is corrupt or truncated makes Restore fail rather than
+ * the process: the first bad value calls Fail, after which every Read leaves
+ * its argument as it was, so that readers only need to check failed() before
+ * relying on what they read.
+ */
+class Checkpoint {
+ public:
+  Checkpoint(std::unordered_map<Id, Entity*>&);
+  bool Save(std::string, Scheduler&, Statistics&);
+  bool Restore(std::string, Scheduler&, Statistics&);
+  void Fail(std::string);
+  bool failed() const;
+  template<class T> void Write(const T& t) {
+    out_.write(reinterpret_cast<const char*>(&t), sizeof(T));
+  }
+  template<class T> void Read(T& t) {
+    if(failed_) return;
+    if(!in_.read(reinterpret_cast<char*>(&t), sizeof(T)))
+      Fail("checkpoint is truncated");
+  }
+  template<class T> void WriteVector(const std::vector<T>& v) {
+    Write<uint64_t>(v.size());
+    out_.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+  }
+  /* The size is checked against what is left of the file before anything is
+   * allocated for it.
+   */
+  template<class T> void ReadVector(std::vector<T>& v) {
+    uint64_t size = 0;
+    Read(size);
+    if(failed_) return;
+    if(size > BytesLeft() / sizeof(T)) {
+      Fail("vector of " + std::to_string(size) +
+           " elements is longer than the rest of the checkpoint");
+      return;
+    }
+    v.resize(size);
+    if(!in_.read(reinterpret_cast<char*>(v.data()), size * sizeof(T)))
+      Fail("checkpoint is truncated");
+  }
+  void WriteBits(const std::vector<bool>&);
+  void ReadBits(std::vector<bool>&);
+  void WriteString(const std::string&);
+  void ReadString(std::string&);
+  void WriteEntity(const Entity*);
+  Entity* ReadEntity();
+  void WriteBV(const BV&);
+  BV ReadBV();
+  void WriteAdvertisement(const Advertisement*);
+  Advertisement* ReadAdvertisement();
+  void WriteHeartbeatBatch(const HeartbeatBatch*);
+  HeartbeatBatch* ReadHeartbeatBatch();
+  static const std::string kMagic;
+  static const uint32_t kVersion;
+
+ private:
+  uint64_t BytesLeft();
+  bool AreIds(const std::vector<Id>&) const;
+  static const uint32_t kNoIndex;
+  std::unordered_map<Id, Entity*>& id_to_entity_;
+  std::ofstream out_;
+  std::ifstream in_;
+  /* The size of the file being restored */
+  uint64_t in_size_;
+  /* The number of entities in the simulation being restored */
+  unsigned int num_entities_;
+  bool failed_;
+  std::unordered_map<const std::vector<bool>*, uint32_t> bv_to_index_;
+  std::vector<BV> index_to_bv_;
+  std::unordered_map<const Advertisement*, uint32_t> ad_to_index_;
+  std::vector<Advertisement*> index_to_ad_;
+  std::unordered_map<const HeartbeatBatch*, uint32_t> batch_to_index_;
+  std::vector<HeartbeatBatch*> index_to_batch_;
+  DISALLOW_COPY_AND_ASSIGN(Checkpoint);
+};
+
+#endif
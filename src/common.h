@@ -25,6 +25,19 @@ const SequenceNum NONE_SEQNUM = -1;
 
 typedef std::vector< std::vector<Id> > Topology;
 
+/* Whether the processor running the simulation supports AVX2.  Kernels that
+ * have an AVX2 version choose it with this at startup rather than by the
+ * flags they were compiled with, so the same binary runs everywhere.
+ */
+inline bool HasAvx2() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
 #define DISALLOW_COPY_AND_ASSIGN(TypeName) \
   DISALLOW_COPY(TypeName); DISALLOW_ASSIGN(TypeName)
 
@@ -1,4 +1,6 @@
+#include "bit_matrix.h"
 #include "bv.h"
+#include "checkpoint.h"
 #include "entities.h"
 #include "events.h"
 #include "scheduler.h"
@@ -6,19 +8,32 @@
 
 #include <glog/logging.h>
 
-#include <iostream>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-using boost::circular_buffer;
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <sstream>
 
-using boost::clear_vertex;
-using boost::remove_vertex;
+using std::copy;
+using std::find;
+using std::istringstream;
+using std::min;
+using std::numeric_limits;
+using std::ostringstream;
+using std::sort;
 
 using std::default_random_engine;
 using std::discrete_distribution;
 using std::ostream;
 using std::pair;
 using std::string;
+using std::swap;
 using std::to_string;
+using std::uniform_int_distribution;
+using std::uniform_real_distribution;
 using std::unordered_map;
 using std::vector;
 
@@ -63,8 +78,69 @@ string to_string(const std::vector<int>& ints) {
 }
 };
 
-HeartbeatHistory::HeartbeatHistory() : seen_(), last_seen_(),
-                                       id_to_recently_seen_() {}
+namespace {
+
+/* Sets bit i of expired, which has a word for every 64 entries of since, when
+ * now - since[i] >= max_age and clears it otherwise.
+ */
+typedef void (*FindExpiredFn)(const Time* since, unsigned int n, Time now,
+                              Time max_age, uint64_t* expired);
+
+void FindExpiredScalar(const Time* since, unsigned int n, Time now,
+                       Time max_age, uint64_t* expired) {
+  for(unsigned int w = 0; w * 64 < n; ++w) {
+    uint64_t bits = 0;
+    for(unsigned int i = w * 64; i < min(n, w * 64 + 64); ++i)
+      bits |= uint64_t(now - since[i] >= max_age) << (i % 64);
+    expired[w] = bits;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Compares four entries per instruction.  The subtraction is the same IEEE
+ * operation as the scalar one, so both versions agree on every entry.
+ */
+__attribute__((target("avx2")))
+void FindExpiredAvx2(const Time* since, unsigned int n, Time now,
+                     Time max_age, uint64_t* expired) {
+  const __m256d now4 = _mm256_set1_pd(now);
+  const __m256d max_age4 = _mm256_set1_pd(max_age);
+
+  std::fill(expired, expired + (n + 63) / 64, 0);
+  unsigned int i = 0;
+  for( ; i + 4 <= n; i += 4) {
+    __m256d age = _mm256_sub_pd(now4, _mm256_loadu_pd(since + i));
+    uint64_t bits = _mm256_movemask_pd(_mm256_cmp_pd(age, max_age4,
+                                                     _CMP_GE_OQ));
+    expired[i / 64] |= bits << (i % 64);
+  }
+  for( ; i < n; ++i)
+    expired[i / 64] |= uint64_t(now - since[i] >= max_age) << (i % 64);
+}
+#endif
+
+FindExpiredFn SelectFindExpired() {
+#if defined(__x86_64__) || defined(__i386__)
+  if(HasAvx2()) return FindExpiredAvx2;
+#endif
+  return FindExpiredScalar;
+}
+
+const FindExpiredFn FindExpired = SelectFindExpired();
+
+} // namespace
+
+HeartbeatHistory::HeartbeatHistory(unsigned int num_entities)
+    : seen_(), sightings_(num_entities * Entity::kMinTimes, 0),
+      num_sightings_(num_entities, 0), track_views_(false),
+      id_to_recently_seen_(), views_version_(0), changed_views_(),
+      is_view_changed_(num_entities, false),
+      recently_seen_(num_entities, false), recently_seen_version_(0),
+      recent_since_(num_entities, numeric_limits<Time>::infinity()),
+      expired_bits_((num_entities + 63) / 64, 0), expiring_(),
+      deadline_(num_entities, -numeric_limits<Time>::infinity()),
+      on_time_(num_entities, 0), deadlines_(),
+      latest_(num_entities, NONE_SEQNUM) {}
 
 void HeartbeatHistory::MarkAsSeen(const Heartbeat* b, Time time_seen) {
   // TODO this can throw an exception if seen's allocator fails.  Should I just
@@ -72,14 +148,57 @@ void HeartbeatHistory::MarkAsSeen(const Heartbeat* b, Time time_seen) {
   seen_.insert(MakeHeartbeatId(b));
 
   Id id = b->src_->id();
+  latest_[id] = std::max(latest_[id], b->sn_);
+  Sight(id, time_seen, b->period_);
+
+  if(track_views_) {
+    vector<bool>& view = id_to_recently_seen_[id];
+    if(view != *b->recently_seen_.bv_) {
+      view = *b->recently_seen_.bv_;
+      ++views_version_;
+      if(!is_view_changed_[id]) {
+        is_view_changed_[id] = true;
+        changed_views_.push_back(id);
+      }
+    }
+  }
+}
 
-  if(!HasBeenSeen(id))
-    last_seen_.insert({id, circular_buffer<Time>(Entity::kMinTimes)});
-  circular_buffer<Time>& times = last_seen_[id];
-  times.push_back(time_seen);
+/* Records that id's heartbeat sn was heard of through gossip at time now.
+ * Returns whether sn is newer than any heartbeat of id known before, which
+ * is the only case that counts as a sighting.
+ */
+bool HeartbeatHistory::Merge(Id id, SequenceNum sn, Time now) {
+  if(sn <= latest_[id]) return false;
+
+  latest_[id] = sn;
+  Sight(id, now);
+  return true;
+}
 
-  id_to_recently_seen_.erase(id);
-  //  id_to_recently_seen_.insert({id, b->recently_seen()});
+/* period is the one the heartbeat advertised, or 0 if it had none */
+void HeartbeatHistory::Sight(Id id, Time time_seen, Time period) {
+  Time* times = &sightings_[id * Entity::kMinTimes];
+  unsigned int& num = num_sightings_[id];
+  if(num == Entity::kMinTimes) {
+    copy(times + 1, times + num, times);
+    --num;
+  }
+  times[num++] = time_seen;
+
+  bool recent;
+  if(period > 0) {
+    on_time_[id] = time_seen <= deadline_[id] ? on_time_[id] + 1 : 1;
+    deadline_[id] = time_seen + Entity::kMaxRecentPeriods * period;
+    recent = on_time_[id] >= Entity::kMinTimes;
+    if(recent)
+      deadlines_.emplace(deadline_[id], id);
+    recent_since_[id] = numeric_limits<Time>::infinity();
+  } else {
+    recent = IsRecent(times[0], time_seen);
+    recent_since_[id] = recent ? times[0] : numeric_limits<Time>::infinity();
+  }
+  SetRecentlySeen(id, recent);
 }
 
 bool HeartbeatHistory::HasBeenSeen(const Heartbeat* b) const {
@@ -87,65 +206,508 @@ bool HeartbeatHistory::HasBeenSeen(const Heartbeat* b) const {
 }
 
 bool HeartbeatHistory::HasBeenSeen(Id id) const {
-  return last_seen_.count(id) > 0;
+  return num_sightings_[id] > 0;
+}
+
+vector<Time> HeartbeatHistory::LastSeen(Id id) const {
+  const Time* times = &sightings_[id * Entity::kMinTimes];
+  return vector<Time>(times, times + num_sightings_[id]);
 }
 
-circular_buffer<Time> HeartbeatHistory::LastSeen(Id id) const {
-  return last_seen_.at(id);
+/* The time at which a heartbeat of id was last seen, or -infinity if none
+ * has been
+ */
+Time HeartbeatHistory::LastSighting(Id id) const {
+  if(!HasBeenSeen(id)) return -numeric_limits<Time>::infinity();
+  return sightings_[id * Entity::kMinTimes + num_sightings_[id] - 1];
 }
 
-unordered_map<Id, vector<bool> > HeartbeatHistory::id_to_recently_seen() const {
+/* Clears the bits of the entities whose oldest recent sighting is no longer
+ * recent at time now.  The ids whose bits were cleared are appended to expired
+ * if it is given, in the order in which their sightings expired; an entity
+ * whose bit was already clear is not.
+ */
+void HeartbeatHistory::ExpireRecentlySeen(Time now, vector<Id>* expired) {
+  FindExpired(recent_since_.data(), recent_since_.size(), now,
+              Entity::kMaxRecent, expired_bits_.data());
+
+  expiring_.clear();
+  for(unsigned int w = 0; w < expired_bits_.size(); ++w) {
+    for(uint64_t bits = expired_bits_[w]; bits != 0; bits &= bits - 1) {
+      Id id = w * 64 + __builtin_ctzll(bits);
+      expiring_.emplace_back(recent_since_[id], id);
+    }
+  }
+  sort(expiring_.begin(), expiring_.end());
+
+  for(const Sighting& s : expiring_) {
+    recent_since_[s.second] = numeric_limits<Time>::infinity();
+    if(SetRecentlySeen(s.second, false) && expired != nullptr)
+      expired->push_back(s.second);
+  }
+
+  while(!deadlines_.empty() && deadlines_.top().first < now) {
+    Sighting s = deadlines_.top();
+    deadlines_.pop();
+
+    if(deadline_[s.second] == s.first &&
+       SetRecentlySeen(s.second, false) && expired != nullptr)
+      expired->push_back(s.second);
+  }
+}
+
+const vector<bool>& HeartbeatHistory::recently_seen() const {
+  return recently_seen_;
+}
+
+const vector<SequenceNum>& HeartbeatHistory::latest() const {
+  return latest_;
+}
+
+unsigned long HeartbeatHistory::recently_seen_version() const {
+  return recently_seen_version_;
+}
+
+void HeartbeatHistory::TrackViews() { track_views_ = true; }
+
+unsigned long HeartbeatHistory::views_version() const {
+  return views_version_;
+}
+
+/* Replaces changed with the entities whose views changed since the last call
+ * and starts the list over.
+ */
+void HeartbeatHistory::TakeChangedViews(vector<Id>& changed) {
+  changed.clear();
+  changed.swap(changed_views_);
+  for(Id id : changed)
+    is_view_changed_[id] = false;
+}
+
+const unordered_map<Id, vector<bool> >&
+HeartbeatHistory::id_to_recently_seen() const {
   return id_to_recently_seen_;
 }
 
+void HeartbeatHistory::Save(Checkpoint& c) const {
+  c.Write<uint64_t>(seen_.size());
+  for(const HeartbeatId& h : seen_) {
+    c.Write(h.first);
+    c.WriteEntity(h.second);
+  }
+
+  c.WriteVector(sightings_);
+  c.WriteVector(num_sightings_);
+
+  c.Write<uint64_t>(id_to_recently_seen_.size());
+  for(auto& it : id_to_recently_seen_) {
+    c.Write(it.first);
+    c.WriteBits(it.second);
+  }
+  c.Write(views_version_);
+
+  c.WriteBits(recently_seen_);
+  c.Write(recently_seen_version_);
+  c.WriteVector(recent_since_);
+  c.WriteVector(latest_);
+
+  c.WriteVector(deadline_);
+  c.WriteVector(on_time_);
+  vector<Time> sighting_times;
+  vector<Id> sighting_ids;
+  for(auto pending = deadlines_; !pending.empty(); pending.pop()) {
+    sighting_times.push_back(pending.top().first);
+    sighting_ids.push_back(pending.top().second);
+  }
+  c.WriteVector(sighting_times);
+  c.WriteVector(sighting_ids);
+}
+
+void HeartbeatHistory::Restore(Checkpoint& c) {
+  uint64_t size = 0;
+  Id id = NONE_ID;
+  unsigned int num_entities = recently_seen_.size();
+
+  seen_.clear();
+  c.Read(size);
+  for(uint64_t i = 0; i < size; ++i) {
+    SequenceNum sn = NONE_SEQNUM;
+    c.Read(sn);
+    seen_.insert({sn, c.ReadEntity()});
+  }
+
+  c.ReadVector(sightings_);
+  c.ReadVector(num_sightings_);
+
+  id_to_recently_seen_.clear();
+  changed_views_.clear();
+  is_view_changed_.assign(num_entities, false);
+  c.Read(size);
+  for(uint64_t i = 0; i < size && !c.failed(); ++i) {
+    vector<bool> view;
+    c.Read(id);
+    c.ReadBits(view);
+    if(c.failed()) return;
+    if(id < 0 || id >= Id(num_entities) || view.size() != num_entities) {
+      c.Fail("heartbeat history holds a view of the wrong size");
+      return;
+    }
+    id_to_recently_seen_[id].swap(view);
+  }
+  c.Read(views_version_);
+
+  vector<Time> sighting_times;
+  vector<Id> sighting_ids;
+
+  c.ReadBits(recently_seen_);
+  c.Read(recently_seen_version_);
+  c.ReadVector(recent_since_);
+  c.ReadVector(latest_);
+
+  if(c.failed()) return;
+
+  if(sightings_.size() != num_entities * Entity::kMinTimes ||
+     num_sightings_.size() != num_entities ||
+     recently_seen_.size() != num_entities ||
+     recent_since_.size() != num_entities || latest_.size() != num_entities) {
+    c.Fail("heartbeat history is inconsistent");
+    return;
+  }
+
+  c.ReadVector(deadline_);
+  c.ReadVector(on_time_);
+  c.ReadVector(sighting_times);
+  c.ReadVector(sighting_ids);
+
+  if(c.failed()) return;
+
+  bool valid = deadline_.size() == num_entities &&
+      on_time_.size() == num_entities &&
+      sighting_times.size() == sighting_ids.size();
+  for(unsigned int i = 0; valid && i < num_entities; ++i)
+    valid = num_sightings_[i] <= Entity::kMinTimes;
+  for(unsigned int i = 0; valid && i < sighting_ids.size(); ++i)
+    valid = sighting_ids[i] >= 0 && sighting_ids[i] < Id(num_entities);
+
+  if(!valid) {
+    c.Fail("heartbeat history is inconsistent");
+    return;
+  }
+
+  while(!deadlines_.empty())
+    deadlines_.pop();
+  for(unsigned int i = 0; i < sighting_times.size(); ++i)
+    deadlines_.emplace(sighting_times[i], sighting_ids[i]);
+}
+
 HeartbeatHistory::HeartbeatId HeartbeatHistory::MakeHeartbeatId(const Heartbeat* b) {
   return {b->sn_, b->src_};
 }
 
+/* Sighting times only grow, so the oldest of an entity's last kMinTimes
+ * sightings decides whether all of them are recent.
+ */
+bool HeartbeatHistory::IsRecent(Time sighting, Time now) {
+  return now - sighting < Entity::kMaxRecent;
+}
+
+/* Returns whether the bit flipped */
+bool HeartbeatHistory::SetRecentlySeen(Id id, bool recent) {
+  if(recently_seen_[id] == recent) return false;
+
+  recently_seen_[id] = recent;
+  ++recently_seen_version_;
+  return true;
+}
+
 LinkState::LinkState(unsigned int num_entities)
     : id_to_last_seq_num_(num_entities, NONE_SEQNUM),
+      id_to_applied_seq_num_(num_entities, NONE_SEQNUM),
+      id_to_expired_seq_num_(num_entities, NONE_SEQNUM),
+      expired_rows_(num_entities),
       id_to_exp_(num_entities, 0),
-      topology_(num_entities) {}
+      deadlines_(),
+      row_offsets_(num_entities + 1, 0),
+      neighbors_(),
+      id_to_degree_(num_entities, 0),
+      track_changes_(false),
+      changed_links_() {}
+
+/* Sizes the row of every entity to its number of ports in topo */
+void LinkState::Init(const Topology& topo) {
+  CHECK_EQ(topo.size() + 1, row_offsets_.size());
+
+  for(Id id = 0; id < Id(topo.size()); ++id)
+    row_offsets_[id + 1] = row_offsets_[id] + topo[id].size();
+  neighbors_.assign(row_offsets_.back(), NONE_ID);
+}
 
 string LinkState::Description() const {
+  string topology = "";
+
+  for(Id i = 0; i < id_to_degree_.size(); ++i) {
+    if(id_to_degree_[i] > 0) {
+      topology += to_string(i) + " --> ";
+      for(unsigned int j = 0; j < id_to_degree_[i]; ++j)
+        topology += to_string(Neighbor(i, j)) + " ";
+      topology += "\n";
+    }
+  }
+
   return "id_to_last_seq_num_=" + to_string(id_to_last_seq_num_) +
-      " id_to_exp_=" + to_string(id_to_exp_) + " topology_=" + to_string(topology_);
+      " id_to_exp_=" + to_string(id_to_exp_) + " topology_=" + topology;
 }
 
 bool LinkState::IsStaleUpdate(LinkStateUpdate* ls) {
   return id_to_last_seq_num_[ls->src_->id()] >= ls->sn_;
 }
 
-void LinkState::Update(LinkStateUpdate* ls) {
+/* Returns whether the update could be applied.  A delta whose base is not
+ * what the row reflects, or an advertisement that does not fit in its
+ * source's row, still counts as seen, so that it is flooded only once, but
+ * leaves the expiration as it was.
+ */
+bool LinkState::Update(LinkStateUpdate* ls) {
   Id src = ls->src_->id();
+  const Advertisement* ad = ls->advertisement_;
 
-  topology_[src] = ls->neighbors_;
   id_to_last_seq_num_[src] = ls->sn_;
+
+  if(ad->kind_ == FULL_ADVERTISEMENT) {
+    if(!SetNeighbors(src, ad->neighbors_)) return false;
+  } else if(id_to_applied_seq_num_[src] == ad->base_sn_) {
+    if(!ApplyDelta(src, ad->added_, ad->removed_)) return false;
+  } else if(id_to_expired_seq_num_[src] == ad->base_sn_) {
+    SetNeighbors(src, expired_rows_[src]);
+    if(!ApplyDelta(src, ad->added_, ad->removed_)) return false;
+  } else {
+    return false;
+  }
+
+  id_to_applied_seq_num_[src] = ls->sn_;
+  id_to_expired_seq_num_[src] = NONE_SEQNUM;
+  expired_rows_[src].clear();
   id_to_exp_[src] = ls->expiration_;
+  deadlines_.emplace(ls->expiration_, src);
+  return true;
 }
 
-void LinkState::Update(Id self, vector<Id> up_neighbors) {
-  topology_[self] = up_neighbors;
+void LinkState::Update(Id self, const vector<Id>& up_neighbors) {
+  SetNeighbors(self, up_neighbors);
 }
 
 void LinkState::Refresh(Time cur_time) {
-  for(int id = 0; id < id_to_exp_.size(); ++id) {
-    if(id_to_last_seq_num_[id] != NONE_SEQNUM && cur_time > id_to_exp_[id]) {
+  while(!deadlines_.empty() && cur_time > deadlines_.top().first) {
+    Deadline d = deadlines_.top();
+    deadlines_.pop();
+
+    Id id = d.second;
+    /* Skip deadlines that were superseded by a later update */
+    if(id_to_applied_seq_num_[id] != NONE_SEQNUM &&
+       id_to_exp_[id] == d.first) {
+      auto row = neighbors_.begin() + row_offsets_[id];
+      expired_rows_[id].assign(row, row + id_to_degree_[id]);
+      id_to_expired_seq_num_[id] = id_to_applied_seq_num_[id];
       id_to_last_seq_num_[id] = NONE_SEQNUM;
-      clear_vertex(id, topology_);
+      id_to_applied_seq_num_[id] = NONE_SEQNUM;
+      ClearNeighbors(id);
     }
   }
 }
 
+unsigned int LinkState::Degree(Id id) const { return id_to_degree_[id]; }
+
+Id LinkState::Neighbor(Id id, unsigned int i) const {
+  return neighbors_[row_offsets_[id] + i];
+}
+
+bool LinkState::Advertises(Id src, Id neighbor) const {
+  auto row = neighbors_.begin() + row_offsets_[src];
+  return find(row, row + id_to_degree_[src], neighbor) !=
+      row + id_to_degree_[src];
+}
+
+bool LinkState::HasLink(Id a, Id b) const {
+  return Advertises(a, b) && Advertises(b, a);
+}
+
+void LinkState::TrackChanges() { track_changes_ = true; }
+
+bool LinkState::HasChangedLinks() const { return !changed_links_.empty(); }
+
+void LinkState::TakeChangedLinks(vector<pair<Id, Id> >& changed) {
+  changed.swap(changed_links_);
+  changed_links_.clear();
+}
+
+/* Whether changes are tracked is part of the switch's configuration rather
+ * than its state, so it is left as the command line set it.
+ */
+void LinkState::Save(Checkpoint& c) const {
+  c.WriteVector(id_to_last_seq_num_);
+  c.WriteVector(id_to_applied_seq_num_);
+  c.WriteVector(id_to_expired_seq_num_);
+  for(Id id = 0; id < expired_rows_.size(); ++id)
+    if(id_to_expired_seq_num_[id] != NONE_SEQNUM)
+      c.WriteVector(expired_rows_[id]);
+  c.WriteVector(id_to_exp_);
+
+  /* Written as two vectors since a Deadline has padding bytes */
+  vector<Time> deadline_times;
+  vector<Id> deadline_ids;
+  for(auto pending = deadlines_; !pending.empty(); pending.pop()) {
+    deadline_times.push_back(pending.top().first);
+    deadline_ids.push_back(pending.top().second);
+  }
+  c.WriteVector(deadline_times);
+  c.WriteVector(deadline_ids);
+
+  c.WriteVector(neighbors_);
+  c.WriteVector(id_to_degree_);
+  c.WriteVector(changed_links_);
+}
+
+void LinkState::Restore(Checkpoint& c) {
+  vector<Time> deadline_times;
+  vector<Id> deadline_ids;
+
+  c.ReadVector(id_to_last_seq_num_);
+  c.ReadVector(id_to_applied_seq_num_);
+  c.ReadVector(id_to_expired_seq_num_);
+
+  if(id_to_expired_seq_num_.size() != expired_rows_.size()) {
+    c.Fail("link state database has the wrong number of entities");
+    return;
+  }
+
+  for(Id id = 0; id < expired_rows_.size() && !c.failed(); ++id) {
+    expired_rows_[id].clear();
+    if(id_to_expired_seq_num_[id] != NONE_SEQNUM)
+      c.ReadVector(expired_rows_[id]);
+  }
+
+  c.ReadVector(id_to_exp_);
+  c.ReadVector(deadline_times);
+  c.ReadVector(deadline_ids);
+  c.ReadVector(neighbors_);
+  c.ReadVector(id_to_degree_);
+  c.ReadVector(changed_links_);
+
+  if(c.failed()) return;
+
+  unsigned int num_entities = expired_rows_.size();
+  auto is_id = [num_entities](Id id) {
+    return id >= 0 && id < Id(num_entities);
+  };
+
+  bool valid = id_to_last_seq_num_.size() == num_entities &&
+      id_to_applied_seq_num_.size() == num_entities &&
+      id_to_exp_.size() == num_entities &&
+      id_to_degree_.size() == num_entities &&
+      neighbors_.size() == row_offsets_.back() &&
+      deadline_times.size() == deadline_ids.size();
+  for(Id id = 0; valid && id < Id(num_entities); ++id) {
+    valid = id_to_degree_[id] <= row_offsets_[id + 1] - row_offsets_[id];
+    for(unsigned int i = 0; valid && i < id_to_degree_[id]; ++i)
+      valid = is_id(Neighbor(id, i));
+    for(unsigned int i = 0; valid && i < expired_rows_[id].size(); ++i)
+      valid = is_id(expired_rows_[id][i]);
+  }
+  for(unsigned int i = 0; valid && i < deadline_ids.size(); ++i)
+    valid = is_id(deadline_ids[i]);
+  for(unsigned int i = 0; valid && i < changed_links_.size(); ++i)
+    valid = is_id(changed_links_[i].first) && is_id(changed_links_[i].second);
+
+  if(!valid) {
+    c.Fail("link state database is inconsistent");
+    return;
+  }
+
+  while(!deadlines_.empty())
+    deadlines_.pop();
+  for(unsigned int i = 0; i < deadline_times.size(); ++i)
+    deadlines_.emplace(deadline_times[i], deadline_ids[i]);
+}
+
+/* Returns false, leaving the row as it was, when neighbors has more entries
+ * than id has ports
+ */
+bool LinkState::SetNeighbors(Id id, const vector<Id>& neighbors) {
+  if(neighbors.size() > row_offsets_[id + 1] - row_offsets_[id]) {
+    LOG(ERROR) << "Entity " << id << " advertised " << neighbors.size()
+               << " neighbors but has "
+               << row_offsets_[id + 1] - row_offsets_[id] << " ports";
+    return false;
+  }
+
+  if(track_changes_) {
+    auto row = neighbors_.begin() + row_offsets_[id];
+    auto row_end = row + id_to_degree_[id];
+    for(auto it = row; it != row_end; ++it)
+      if(find(neighbors.begin(), neighbors.end(), *it) == neighbors.end())
+        changed_links_.emplace_back(id, *it);
+    for(Id n : neighbors)
+      if(find(row, row_end, n) == row_end)
+        changed_links_.emplace_back(id, n);
+  }
+
+  copy(neighbors.begin(), neighbors.end(),
+       neighbors_.begin() + row_offsets_[id]);
+  id_to_degree_[id] = neighbors.size();
+  return true;
+}
+
+bool LinkState::ApplyDelta(Id id, const vector<Id>& added,
+                           const vector<Id>& removed) {
+  auto row = neighbors_.begin() + row_offsets_[id];
+  vector<Id> neighbors;
+
+  for(auto it = row; it != row + id_to_degree_[id]; ++it)
+    if(find(removed.begin(), removed.end(), *it) == removed.end())
+      neighbors.push_back(*it);
+  neighbors.insert(neighbors.end(), added.begin(), added.end());
+
+  return SetNeighbors(id, neighbors);
+}
+
+/* Only the expired entity's own row is dropped.  Links to it that other
+ * entities still advertise are left alone, unlike boost's clear_vertex which
+ * scans every row to remove them; readers should only trust a link that both
+ * of its endpoints advertise.
+ */
+void LinkState::ClearNeighbors(Id id) {
+  if(track_changes_)
+    for(unsigned int i = 0; i < id_to_degree_[id]; ++i)
+      changed_links_.emplace_back(id, Neighbor(id, i));
+
+  id_to_degree_[id] = 0;
+}
+
 Entity::Entity(Scheduler& sc, Id id, Statistics& st) : links_(), scheduler_(sc),
                                                        is_up_(true), id_(id),
-                                                       heart_history_(),
+                                                       heart_history_(sc.num_entities()),
                                                        next_heartbeat_(0),
                                                        stats_(st),
                                                        entropy_src_(),
                                                        cached_bv_(nullptr, nullptr),
-                                                       is_cache_valid_(false),
-                                                       dist_{1, 999} {
+                                                       cached_bv_version_(0),
+                                                       cached_bv_sn_(NONE_SEQNUM),
+                                                       tree_enabled_(false),
+                                                       tree_(id),
+                                                       gossip_fanout_(0),
+                                                       aggregation_hold_(0),
+                                                       pending_(nullptr),
+                                                       min_heartbeat_period_(0),
+                                                       max_heartbeat_period_(0),
+                                                       heartbeat_period_(0),
+                                                       next_heartbeat_time_(START_TIME),
+                                                       has_neighborhood_changed_(false),
+                                                       adapted_version_(0),
+                                                       dist_{1, 999},
+                                                       sees_(),
+                                                       sees_rows_(),
+                                                       expired_(),
+                                                       changed_views_() {
   CHECK_GE(kMinTimes, 1);
 }
 
@@ -154,7 +716,20 @@ string Entity::Description() const { return ""; }
 
 string Entity::Name() const { return "Entity"; }
 
-void Entity::Handle(Up* u) { is_up_ = true; }
+/* An entity that comes back up starts over from the shortest heartbeat
+ * period, since its heartbeats stopped while it was down.
+ */
+void Entity::Handle(Up* u) {
+  is_up_ = true;
+  if(tree_enabled_) tree_.Reset(scheduler_.cur_time());
+
+  if(max_heartbeat_period_ > 0) {
+    uniform_real_distribution<Time> delay(0, min_heartbeat_period_ / 2);
+    heartbeat_period_ = min_heartbeat_period_;
+    has_neighborhood_changed_ = true;
+    ScheduleHeartbeat(scheduler_.cur_time() + delay(entropy_src_));
+  }
+}
 
 void Entity::Handle(Down* d) { is_up_ = false; }
 
@@ -169,34 +744,202 @@ void Entity::Handle(Heartbeat* h) {
     return;
   }
 
+  Relay(h);
+}
+
+/* Passes on a heartbeat that arrived intact, on its own or in an aggregate */
+void Entity::Relay(Heartbeat* h) {
   if(heart_history_.HasBeenSeen(h)) {
     LOG(INFO) << "Heartbeat has already been seen";
     return;
   }
 
-  is_cache_valid_ = false;
+  if(tree_enabled_) {
+    tree_.Refresh(links_, heart_history_, scheduler_.cur_time());
+    tree_.Observe(h, links_, scheduler_.cur_time());
+    if(tree_.Mode(scheduler_.cur_time()) == TREE_REPAIR)
+      h->dissemination_ = TREE_REPAIR;
+  }
 
-  for(Port p = 0, in = h->in_port_; p < links_.PortCount(); ++p)
-    if(in != p)
-      scheduler_.Forward(this, h, p, stats_);
+  if(aggregation_hold_ > 0)
+    HoldBack(h->src_, h->sn_, h->recently_seen_, h->in_port_,
+             h->current_partition_, h->leader_);
+  else
+    scheduler_.Flood(this, h, h->in_port_, stats_,
+                     h->dissemination_ == TREE ? &tree_.ports() : nullptr);
 
   heart_history_.MarkAsSeen(h, scheduler_.cur_time());
+  NoteHeartbeat(h);
 }
 
-void Entity::Handle(LinkUp* lu) { links_.SetLinkUp(lu->out_); }
+void Entity::Handle(LinkUp* lu) {
+  links_.SetLinkUp(lu->out_);
+  if(max_heartbeat_period_ > 0) NoteNeighborhoodChange();
+}
 
-void Entity::Handle(LinkDown* ld) { links_.SetLinkDown(ld->out_); }
+void Entity::Handle(LinkDown* ld) {
+  links_.SetLinkDown(ld->out_);
+  if(tree_enabled_) tree_.LinkDown(ld->out_, scheduler_.cur_time());
+  if(max_heartbeat_period_ > 0) NoteNeighborhoodChange();
+}
 
+/* With gossip enabled, the heartbeat is not sent; its sequence number only
+ * advances the entity's own entry in the digests it gossips.
+ */
 void Entity::Handle(InitiateHeartbeat* init) {
+  if(max_heartbeat_period_ > 0 && init->time_ != next_heartbeat_time_) {
+    LOG(INFO) << "Heartbeat was rescheduled";
+    return;
+  }
+
   if(!is_up_) {
     LOG(INFO) << "Entity is down";
     return;
   }
 
-  for(Port p = 0; p < links_.PortCount(); ++p)
-    scheduler_.Forward(this, init, p, stats_);
+  if(gossip_fanout_ > 0) {
+    next_heartbeat_++;
+    return;
+  }
+
+  if(aggregation_hold_ > 0) {
+    HoldBack(this, next_heartbeat_, ComputeRecentlySeen(), PORT_NOT_FOUND,
+             CurrentPartition(), Leader());
+    next_heartbeat_++;
+    return;
+  }
+
+  if(tree_enabled_)
+    tree_.Refresh(links_, heart_history_, scheduler_.cur_time());
+
+  if(max_heartbeat_period_ > 0) AdaptHeartbeatPeriod();
+
+  scheduler_.Flood(this, init, PORT_NOT_FOUND, stats_,
+                   HeartbeatDissemination() == TREE ? &tree_.ports() : nullptr);
 
   next_heartbeat_++;
+
+  if(max_heartbeat_period_ > 0) {
+    uniform_real_distribution<Time> jitter(-heartbeat_period_ / 4,
+                                           heartbeat_period_ / 4);
+    ScheduleHeartbeat(init->time_ + heartbeat_period_ + jitter(entropy_src_));
+  }
+}
+
+/* Sends the entity's digest to gossip_fanout_ distinct neighbors picked at
+ * random among those whose links are up, or to all of them if there are
+ * fewer.  Every copy shares the one digest.
+ */
+void Entity::Handle(InitiateGossip* init) {
+  if(!is_up_) {
+    LOG(INFO) << "Entity is down";
+    return;
+  }
+
+  if(init->time_ + Scheduler::Delay() > scheduler_.end_time()) return;
+
+  ExpireRecentlySeen();
+
+  vector<Port> up_ports;
+  for(Port p = 0; p < Port(links_.PortCount()); ++p)
+    if(links_.IsLinkUp(p))
+      up_ports.push_back(p);
+
+  unsigned int fanout = min<unsigned int>(gossip_fanout_, up_ports.size());
+  if(fanout == 0) return;
+
+  Digest* digest = new Digest{heart_history_.latest(), 0, 1};
+  digest->latest_[id_] = next_heartbeat_ - 1;
+  for(SequenceNum sn : digest->latest_)
+    if(sn != NONE_SEQNUM)
+      ++(digest->num_known_);
+
+  /* A partial Fisher-Yates shuffle leaves the picked ports at the front */
+  for(unsigned int i = 0; i < fanout; ++i) {
+    uniform_int_distribution<unsigned int> pick(i, up_ports.size() - 1);
+    swap(up_ports[i], up_ports[pick(entropy_src_)]);
+
+    Entity* neighbor = links_.GetEndpoint(up_ports[i]);
+    ++(digest->ref_count_);
+    Gossip g(init->time_ + Scheduler::Delay(), neighbor,
+             neighbor->links().GetPortTo(this), this, digest);
+    scheduler_.AddEvent(g);
+    stats_.RecordSend(g);
+  }
+
+  ReleaseDigest(digest);
+}
+
+/* Gossip is not forwarded; what the digest teaches reaches the entity's own
+ * neighbors with the next digest it sends.
+ */
+void Entity::Handle(Gossip* g) {
+  if(dist_(entropy_src_) == 0) {
+    LOG(INFO) << "Packet dropped randomly";
+    return;
+  }
+
+  if(!is_up_) {
+    LOG(INFO) << "Entity is down";
+    return;
+  }
+
+  const vector<SequenceNum>& latest = g->digest_->latest_;
+  for(Id id = 0; id < Id(latest.size()); ++id)
+    if(id != id_ && latest[id] != NONE_SEQNUM)
+      heart_history_.Merge(id, latest[id], scheduler_.cur_time());
+}
+
+/* Sends what was held back during the hold window that just ended.  Each
+ * port that is up gets one aggregate with the entries that did not arrive
+ * on it, if there are any.
+ */
+void Entity::Handle(FlushHeartbeats* flush) {
+  HeartbeatBatch* batch = pending_;
+  pending_ = nullptr;
+  if(batch == nullptr) return;
+
+  if(!is_up_) {
+    LOG(INFO) << "Entity is down";
+  } else if(flush->time_ + Scheduler::Delay() <= scheduler_.end_time()) {
+    for(Port p = 0; p < Port(links_.PortCount()); ++p) {
+      if(!links_.IsLinkUp(p) || batch->CountEntries(p) == 0) continue;
+
+      Entity* neighbor = links_.GetEndpoint(p);
+      HeartbeatAggregate a(flush->time_ + Scheduler::Delay(), neighbor,
+                           neighbor->links().GetPortTo(this), p, batch);
+      scheduler_.AddEvent(a);
+      stats_.RecordSend(a);
+    }
+  }
+
+  ReleaseHeartbeatBatch(batch);
+}
+
+/* An aggregate is dropped or delivered as a whole, after which each of its
+ * entries is handled as the heartbeat it stands for.
+ */
+void Entity::Handle(HeartbeatAggregate* a) {
+  if(dist_(entropy_src_) == 0) {
+    LOG(INFO) << "Packet dropped randomly";
+    return;
+  }
+
+  if(!is_up_) {
+    LOG(INFO) << "Entity is down";
+    return;
+  }
+
+  for(const BatchEntry& entry : a->batch_->entries_) {
+    if(entry.in_port_ == a->out_port_) continue;
+
+    Heartbeat h(a->time_, entry.src_, this, a->in_port_, entry.sn_,
+                entry.recently_seen_);
+    h.current_partition_ = entry.current_partition_;
+    h.leader_ = entry.leader_;
+    Relay(&h);
+    ReleaseRecentlySeen(h.recently_seen_);
+  }
 }
 
 Links& Entity::links() { return links_; }
@@ -205,146 +948,300 @@ Id Entity::id() const { return id_; }
 
 SequenceNum Entity::NextHeartbeatSeqNum() const { return next_heartbeat_; }
 
+/* The snapshot handed out is only copied from the heartbeat history when one
+ * of its bits has changed since the last copy, so entities that originate
+ * heartbeats in a steady state keep sharing the same vector.  Each heartbeat
+ * encodes it against the vector advertised by the one before, which is the
+ * previous snapshot; a heartbeat flooded out of more than kFloodWidth ports
+ * asks more than once but is only encoded the first time.
+ */
 BV Entity::ComputeRecentlySeen() {
-  if(!is_cache_valid_) {
-    vector<bool>* rs = new vector<bool>(scheduler_.num_entities(), false);
-    vector<bool>& recently_seen = *rs;
-
-    for(Id id = 0; id < scheduler_.num_entities(); ++id) {
-      if(heart_history_.HasBeenSeen(id)) {
-        circular_buffer<Time> times_seen = heart_history_.LastSeen(id);
-        recently_seen[id] = true;
-        for(auto t = times_seen.begin(); t != times_seen.end(); ++t)
-          recently_seen[id] = recently_seen[id] &&
-              scheduler_.cur_time() - *t < kMaxRecent;
-      }
-    }
+  if(cached_bv_.bv_ != NULL && cached_bv_sn_ == next_heartbeat_)
+    return cached_bv_;
 
-    if(cached_bv_.ref_count_ != NULL || cached_bv_.bv_ != NULL) {
-      CHECK_NOTNULL(cached_bv_.ref_count_);
-      CHECK_NOTNULL(cached_bv_.bv_);
-      --(*(cached_bv_.ref_count_));
-      if(*(cached_bv_.ref_count_) == 0) {
-        delete cached_bv_.bv_;
-        delete cached_bv_.ref_count_;
-      }
-    }
+  ExpireRecentlySeen();
+
+  BV last = cached_bv_;
 
+  if(cached_bv_.bv_ == NULL ||
+     cached_bv_version_ != heart_history_.recently_seen_version()) {
+    vector<bool>* rs = new vector<bool>(heart_history_.recently_seen());
     cached_bv_ = BV(rs, new unsigned int(1));
-    is_cache_valid_ = true;
+    cached_bv_version_ = heart_history_.recently_seen_version();
+  }
+
+  cached_bv_.Encode(last.bv_);
+  cached_bv_sn_ = next_heartbeat_;
+
+  if(last.bv_ != NULL && last.bv_ != cached_bv_.bv_) {
+    CHECK_NOTNULL(last.ref_count_);
+    --(*(last.ref_count_));
+    if(*(last.ref_count_) == 0) {
+      delete last.bv_;
+      delete last.ref_count_;
+    }
   }
 
   return cached_bv_;
 }
 
-class Visitor {
- public:
-  // TODO fix this style of abstract base class
-  Visitor() {}
-  virtual void previsit(Id) {}
-  virtual void postvisit(Id) {}
-  virtual void preexplore(Id) {}
-  virtual void postexplore(Id) {}
- private:
-  DISALLOW_COPY_AND_ASSIGN(Visitor);
-};
+/* How the heartbeat this entity is about to send should be forwarded */
+Dissemination Entity::HeartbeatDissemination() const {
+  return tree_enabled_ ? tree_.Mode(scheduler_.cur_time()) : FLOOD;
+}
 
-class PostOrder : public Visitor {
- public:
-  PostOrder() : ascending_post_order_() {}
-  void postvisit(Id id) { ascending_post_order_.push_back(id); }
-  vector<Id> ascending_post_order() { return ascending_post_order_; }
- private:
-  vector<Id> ascending_post_order_;
-  DISALLOW_COPY_AND_ASSIGN(PostOrder);
-};
+Id Entity::TreeParent() const {
+  return tree_.AnnouncedParent(scheduler_.cur_time());
+}
 
-class ResolveSCC : public Visitor {
- public:
-  ResolveSCC(unsigned int num_entities) : cur_scc_(0), id_to_scc_(num_entities) {}
-  void previsit(Id i) { id_to_scc_[i] = cur_scc_; }
-  void postexplore(Id i) { ++cur_scc_; }
-  vector<unsigned int> id_to_scc() { return id_to_scc_; }
- private:
-  unsigned int cur_scc_;
-  vector<unsigned int> id_to_scc_;
-  DISALLOW_COPY_AND_ASSIGN(ResolveSCC);
-};
+void Entity::EnableSpanningTree() { tree_enabled_ = true; }
 
-void dfs(Id root, unordered_map<Id, vector<bool> >& graph, unsigned int num_entities,
-         vector<bool>& seen, Visitor& v, bool rev) {
-  seen[root] = true;
+void Entity::EnableGossip(unsigned int fanout) { gossip_fanout_ = fanout; }
 
-  v.previsit(root);
+void Entity::EnableHeartbeatAggregation(Time hold) { aggregation_hold_ = hold; }
 
-  for (Id i = 0; i < num_entities; ++i) {
-    bool edge_exists = rev ? graph.count(i) > 0 && graph[i][root] :
-        graph.count(root) > 0 && graph[root][i];
-    if(edge_exists && !seen[i]) {
-      dfs(i, graph, num_entities, seen, v, rev);
-    }
-  }
+/* Only the first heartbeat is scheduled up front; each later one is
+ * scheduled by the heartbeat before it.
+ */
+void Entity::EnableAdaptiveHeartbeats(Time min_period, Time max_period) {
+  min_heartbeat_period_ = min_period;
+  max_heartbeat_period_ = max_period;
+  heartbeat_period_ = min_period;
+}
 
-  v.postvisit(root);
+void Entity::ScheduleHeartbeat(Time t) {
+  next_heartbeat_time_ = t;
+  if(t <= scheduler_.end_time())
+    scheduler_.AddEvent(InitiateHeartbeat(t, this));
 }
 
-void explore1(unordered_map<Id, vector<bool> >& graph, unsigned int num_entities,
-              Visitor& v) {
-  vector<bool> seen(num_entities, false);
+Time Entity::AdvertisedPeriod() const {
+  return max_heartbeat_period_ > 0 ? heartbeat_period_ : 0;
+}
 
-  for(Id i = 0; i < num_entities; ++i) {
-    if(!seen[i]) {
-      v.preexplore(i);
-      dfs(i, graph, num_entities, seen, v, true);
-      v.postexplore(i);
-    }
-  }
+/* Only controllers take part in leader election */
+unsigned int Entity::CurrentPartition() const { return 0; }
+
+Id Entity::Leader() const { return NONE_ID; }
+
+/* Decides the period that the heartbeat about to be sent advertises */
+void Entity::AdaptHeartbeatPeriod() {
+  ExpireRecentlySeen();
+
+  bool is_stable = !has_neighborhood_changed_ &&
+      adapted_version_ == heart_history_.recently_seen_version();
+
+  heartbeat_period_ = is_stable ?
+      min(2 * heartbeat_period_, max_heartbeat_period_) : min_heartbeat_period_;
+  has_neighborhood_changed_ = false;
+  adapted_version_ = heart_history_.recently_seen_version();
 }
 
-template<class Iter>
-void explore2(unordered_map<Id, vector<bool> >& graph, Visitor& v, unsigned int num_entities,
-              Iter next, Iter beyond) {
-  vector<bool> seen(num_entities, false);
+/* The next heartbeat is brought forward to within the shortest period */
+void Entity::NoteNeighborhoodChange() {
+  has_neighborhood_changed_ = true;
 
-  for( ; next < beyond; ++next) {
-    Id i = *next;
-    if(!seen[i]) {
-      v.preexplore(i);
-      dfs(i, graph, num_entities, seen, v, false);
-      v.postexplore(i);
-    }
+  Time now = scheduler_.cur_time();
+  if(is_up_ && next_heartbeat_time_ > now + min_heartbeat_period_)
+    ScheduleHeartbeat(now + min_heartbeat_period_);
+}
+
+/* The first heartbeat held back starts the hold window */
+void Entity::HoldBack(const Entity* src, SequenceNum sn, BV recently_seen,
+                      Port in, unsigned int partition, Id leader) {
+  if(pending_ == nullptr) {
+    pending_ = new HeartbeatBatch{vector<BatchEntry>(), 1};
+    scheduler_.AddEvent(FlushHeartbeats(scheduler_.cur_time() +
+                                        aggregation_hold_, this));
   }
+
+  ++(*recently_seen.ref_count_);
+  pending_->entries_.push_back(BatchEntry{src, sn, recently_seen, in,
+                                          partition, leader});
 }
 
-vector<unsigned int> Entity::ComputePartitions() const {
-  unordered_map<Id, vector<bool> > recently_seen =
-      heart_history_.id_to_recently_seen();
+/* Called with every heartbeat that the entity relays for the first time,
+ * whether it arrived on its own or in an aggregate
+ */
+void Entity::NoteHeartbeat(const Heartbeat* h) {}
+
+/* Every entity that stops being recently seen is a failure detected by this
+ * one.
+ */
+void Entity::ExpireRecentlySeen() {
+  expired_.clear();
+  heart_history_.ExpireRecentlySeen(scheduler_.cur_time(), &expired_);
+
+  for(Id id : expired_)
+    stats_.RecordDetection(this, id);
+}
+
+/* Entity i is taken to see entity j when i is recently seen by this entity
+ * and the latest heartbeat of i reported j as recently seen.  The partitions
+ * are the strongly connected components of that graph, and this entity's own
+ * recently seen vector stands for its view of the others.
+ */
+vector<unsigned int> Entity::ComputePartitions() {
+  UpdateSees();
 
+  vector<unsigned int> id_to_scc;
+  sees_.StronglyConnectedComponents(id_to_scc);
+  return id_to_scc;
+}
+
+/* Brings sees_ up to date by rewriting the rows of the entities whose views
+ * changed and of those that became or stopped being recently seen.
+ */
+void Entity::UpdateSees() {
+  const vector<bool>& own = heart_history_.recently_seen();
+  const unordered_map<Id, vector<bool> >& views =
+      heart_history_.id_to_recently_seen();
   unsigned int num_entities = scheduler_.num_entities();
 
-  // TODO change to explicit stack
-  // TODO how to avoid iterating through bitvectors?
-  // TODO combine explore1 and explore2
-  PostOrder po;
-  explore1(recently_seen, num_entities, po);
-  auto visit_order = po.ascending_post_order();
+  heart_history_.TakeChangedViews(changed_views_);
+  if(sees_.size() != num_entities) {
+    sees_.Reset(num_entities);
+    sees_rows_.assign(num_entities, false);
+  }
 
-  ResolveSCC rscc(num_entities);
-  explore2(recently_seen, rscc, num_entities, visit_order.rbegin(), visit_order.rend());
+  for(Id i : changed_views_)
+    if(i != id_ && sees_rows_[i])
+      sees_.SetRow(i, views.find(i)->second);
+
+  for(Id i = 0; i < Id(num_entities); ++i) {
+    if(i == id_ || own[i] == sees_rows_[i]) continue;
+    auto it = views.find(i);
+    if(own[i] && it != views.end())
+      sees_.SetRow(i, it->second);
+    else
+      sees_.ClearRow(i);
+    sees_rows_[i] = own[i];
+  }
 
-  return rscc.id_to_scc();
+  sees_.SetRow(id_, own);
 }
 
 void Entity::UpdateLinkCapacities(Time passed) {
   links_.UpdateCapacities(passed);
 }
 
+/* The random engine is saved in its textual form, the only portable way the
+ * standard offers to capture its state.
+ */
+void Entity::Save(Checkpoint& c) const {
+  c.Write(next_heartbeat_);
+  heart_history_.Save(c);
+  links_.Save(c);
+  c.Write(is_up_);
+  c.WriteBV(cached_bv_);
+  c.Write(cached_bv_version_);
+  c.Write(cached_bv_sn_);
+  c.Write(tree_enabled_);
+  if(tree_enabled_) tree_.Save(c);
+  c.Write(gossip_fanout_ > 0);
+  c.Write(aggregation_hold_ > 0);
+  c.Write(pending_ != nullptr);
+  if(pending_ != nullptr) c.WriteHeartbeatBatch(pending_);
+  c.Write(max_heartbeat_period_ > 0);
+  c.Write(heartbeat_period_);
+  c.Write(next_heartbeat_time_);
+  c.Write(has_neighborhood_changed_);
+  c.Write(adapted_version_);
+
+  ostringstream engine;
+  engine << entropy_src_;
+  c.WriteString(engine.str());
+}
+
+void Entity::Restore(Checkpoint& c) {
+  c.Read(next_heartbeat_);
+  heart_history_.Restore(c);
+  sees_.Reset(0);
+  links_.Restore(c);
+  c.Read(is_up_);
+
+  CHECK(cached_bv_.bv_ == nullptr);
+  cached_bv_ = c.ReadBV();
+  if(cached_bv_.ref_count_ != nullptr)
+    ++(*cached_bv_.ref_count_);
+  c.Read(cached_bv_version_);
+  c.Read(cached_bv_sn_);
+
+  bool tree_enabled = false;
+  c.Read(tree_enabled);
+  if(tree_enabled != tree_enabled_) {
+    c.Fail("heartbeat spanning trees were " +
+           string(tree_enabled ? "enabled" : "disabled") +
+           " when the checkpoint was taken");
+    return;
+  }
+  if(tree_enabled_) tree_.Restore(c);
+
+  bool gossip_enabled = false;
+  c.Read(gossip_enabled);
+  if(gossip_enabled != (gossip_fanout_ > 0)) {
+    c.Fail("gossip was " +
+           string(gossip_enabled ? "enabled" : "disabled") +
+           " when the checkpoint was taken");
+    return;
+  }
+
+  bool aggregation_enabled = false, has_pending = false;
+  c.Read(aggregation_enabled);
+  if(aggregation_enabled != (aggregation_hold_ > 0)) {
+    c.Fail("heartbeat aggregation was " +
+           string(aggregation_enabled ? "enabled" : "disabled") +
+           " when the checkpoint was taken");
+    return;
+  }
+  CHECK(pending_ == nullptr);
+  c.Read(has_pending);
+  if(has_pending) {
+    pending_ = c.ReadHeartbeatBatch();
+    if(pending_ == nullptr) return;
+    ++pending_->ref_count_;
+  }
+
+  bool adaptive = false;
+  c.Read(adaptive);
+  if(adaptive != (max_heartbeat_period_ > 0)) {
+    c.Fail("adaptive heartbeats were " +
+           string(adaptive ? "enabled" : "disabled") +
+           " when the checkpoint was taken");
+    return;
+  }
+  c.Read(heartbeat_period_);
+  c.Read(next_heartbeat_time_);
+  c.Read(has_neighborhood_changed_);
+  c.Read(adapted_version_);
+
+  string engine;
+  c.ReadString(engine);
+  istringstream(engine) >> entropy_src_;
+}
+
 const Time Entity::kMaxRecent = 3;
 const unsigned int Entity::kMinTimes = 2;
 
+/* Adaptive periods are jittered by up to a quarter either way, which leaves
+ * another quarter period for the heartbeat to cross the network.
+ */
+const double Entity::kMaxRecentPeriods = 1.5;
+
+const Time Switch::kDefaultSPFHoldDown = 0;
+
 Switch::Switch(Scheduler& sc, Id id, Statistics& st) : Entity(sc, id, st),
                                                        next_link_state_(0),
-                                                       link_state_(sc.num_entities()) {}
+                                                       advertisement_(nullptr),
+                                                       advertisement_sn_(NONE_SEQNUM),
+                                                       have_links_changed_(false),
+                                                       ls_full_every_(1),
+                                                       deltas_since_full_(0),
+                                                       link_state_(sc.num_entities()),
+                                                       routes_(id, sc.num_entities()),
+                                                       routes_enabled_(false),
+                                                       spf_hold_down_(kDefaultSPFHoldDown),
+                                                       is_route_computation_pending_(false) {}
 
 string Switch::Description() const {
   return Entity::Description() + "next_link_state_=" +
@@ -353,15 +1250,16 @@ string Switch::Description() const {
 
 string Switch::Name() const { return "Switch"; }
 
-void Switch::Handle(Event* e) { LOG_HANDLE_EVENT(ERROR, Switch, e) }
-
 void Switch::Handle(Up* u) {
   LOG_HANDLE_EVENT(INFO, Switch, u)
 
-  scheduler_.AddEvent(new InitiateLinkState(u->time_, this));
+  scheduler_.AddEvent(InitiateLinkState(u->time_, this));
 
   Entity::Handle(u);
 
+  /* Catch up on the link state changes that arrived while it was down */
+  ScheduleRouteComputation();
+
   LOG_HANDLE_ENTITY
 }
 
@@ -373,8 +1271,6 @@ void Switch::Handle(Down* d) {
   LOG_HANDLE_ENTITY
 }
 
-void Switch::Handle(Broadcast* b) { LOG_HANDLE_EVENT(ERROR, Switch, b); }
-
 void Switch::Handle(Heartbeat* h) {
   LOG_HANDLE_EVENT(INFO, Switch, h)
 
@@ -388,10 +1284,12 @@ void Switch::Handle(LinkUp* lu) {
 
   Entity::Handle(lu);
 
+  have_links_changed_ = true;
+
   // TODO fix hack with factories
   // TODO allow setting in commandline?
   scheduler_.AddEvent(
-      new InitiateLinkState(lu->time_ + Scheduler::kDefaultHelloDelay, this));
+      InitiateLinkState(lu->time_ + Scheduler::kDefaultHelloDelay, this));
 
   LOG_HANDLE_ENTITY
 }
@@ -401,8 +1299,10 @@ void Switch::Handle(LinkDown* ld) {
 
   Entity::Handle(ld);
 
+  have_links_changed_ = true;
+
   scheduler_.AddEvent(
-      new InitiateLinkState(ld->time_ + Scheduler::kDefaultHelloDelay, this));
+      InitiateLinkState(ld->time_ + Scheduler::kDefaultHelloDelay, this));
 
   LOG_HANDLE_ENTITY
 }
@@ -415,6 +1315,38 @@ void Switch::Handle(InitiateHeartbeat* init) {
   LOG_HANDLE_ENTITY
 }
 
+void Switch::Handle(InitiateGossip* init) {
+  LOG_HANDLE_EVENT(INFO, Switch, init)
+
+  Entity::Handle(init);
+
+  LOG_HANDLE_ENTITY
+}
+
+void Switch::Handle(Gossip* g) {
+  LOG_HANDLE_EVENT(INFO, Switch, g)
+
+  Entity::Handle(g);
+
+  LOG_HANDLE_ENTITY
+}
+
+void Switch::Handle(FlushHeartbeats* flush) {
+  LOG_HANDLE_EVENT(INFO, Switch, flush)
+
+  Entity::Handle(flush);
+
+  LOG_HANDLE_ENTITY
+}
+
+void Switch::Handle(HeartbeatAggregate* a) {
+  LOG_HANDLE_EVENT(INFO, Switch, a)
+
+  Entity::Handle(a);
+
+  LOG_HANDLE_ENTITY
+}
+
 void Switch::Handle(LinkStateUpdate* ls) {
   LOG_HANDLE_EVENT(INFO, Switch, ls);
 
@@ -433,14 +1365,16 @@ void Switch::Handle(LinkStateUpdate* ls) {
   if(link_state_.IsStaleUpdate(ls)) {
     // TODO forward newer entry
     LOG(INFO) << "Link state update has already been seen";
+    ScheduleRouteComputation();
     return;
   }
 
-  for(Port p = 0, in = ls->in_port_; p < links_.PortCount(); ++p)
-    if(in != p)
-      scheduler_.Forward(this, ls, p, stats_);
+  scheduler_.Flood(this, ls, ls->in_port_, stats_);
 
-  link_state_.Update(ls);
+  if(!link_state_.Update(ls))
+    LOG(INFO) << "Link state update is a delta against an unknown base";
+
+  ScheduleRouteComputation();
 
   LOG_HANDLE_ENTITY
 }
@@ -453,11 +1387,11 @@ void Switch::Handle(InitiateLinkState* ls) {
     return;
   }
 
-  for(Port p = 0; p < links_.PortCount(); ++p)
-    scheduler_.Forward(this, ls, p, stats_);
+  scheduler_.Flood(this, ls, PORT_NOT_FOUND, stats_);
+
+  link_state_.Update(id_, links_.UpNeighbors());
 
-  // TODO cache UpNeighbors
-  link_state_.Update(id_, ComputeUpNeighbors());
+  ScheduleRouteComputation();
 
   // TODO delete this variable and just go by link_state db
   next_link_state_++;
@@ -465,26 +1399,172 @@ void Switch::Handle(InitiateLinkState* ls) {
   LOG_HANDLE_ENTITY
 }
 
+/* A switch that is down keeps its changed links, and the computation is
+ * scheduled again when it comes back up.
+ */
+void Switch::Handle(ComputeRoutes* cr) {
+  LOG_HANDLE_EVENT(INFO, Switch, cr);
+
+  is_route_computation_pending_ = false;
+
+  if(!is_up_) {
+    LOG(INFO) << "Switch is down";
+    return;
+  }
+
+  UpdateRoutes();
+
+  LOG_HANDLE_ENTITY
+}
+
+void Switch::Save(Checkpoint& c) const {
+  Entity::Save(c);
+  c.Write(next_link_state_);
+  c.Write(advertisement_ != nullptr);
+  if(advertisement_ != nullptr) c.WriteAdvertisement(advertisement_);
+  c.Write(advertisement_sn_);
+  c.Write(have_links_changed_);
+  c.Write(deltas_since_full_);
+  link_state_.Save(c);
+  c.Write(routes_enabled_);
+  routes_.Save(c);
+  c.Write(is_route_computation_pending_);
+}
+
+/* Routes have to be enabled both when the checkpoint is taken and when it is
+ * restored, since the link state database only tracks its changes for a
+ * switch that computes routes.  The hold down may differ between the two, as
+ * may how often complete advertisements are sent.
+ */
+void Switch::Restore(Checkpoint& c) {
+  bool routes_enabled = false, has_advertisement = false;
+
+  Entity::Restore(c);
+  c.Read(next_link_state_);
+
+  if(advertisement_ != nullptr) ReleaseAdvertisement(advertisement_);
+  advertisement_ = nullptr;
+  c.Read(has_advertisement);
+  if(has_advertisement) {
+    advertisement_ = c.ReadAdvertisement();
+    if(advertisement_ == nullptr) return;
+    ++advertisement_->ref_count_;
+  }
+  c.Read(advertisement_sn_);
+  c.Read(have_links_changed_);
+  c.Read(deltas_since_full_);
+
+  link_state_.Restore(c);
+  c.Read(routes_enabled);
+
+  if(routes_enabled != routes_enabled_) {
+    c.Fail("route computation was " +
+           string(routes_enabled ? "enabled" : "disabled") +
+           " when the checkpoint was taken");
+    return;
+  }
+
+  routes_.Restore(c);
+  c.Read(is_route_computation_pending_);
+}
+
 SequenceNum Switch::NextLSSeqNum() const { return next_link_state_; }
 
-vector<Id> Switch::ComputeUpNeighbors() const {
-  vector<Id> up;
+void Switch::InitLinkState(const Topology& topo) { link_state_.Init(topo); }
 
-  for(Port p = 0; p < links_.PortCount(); ++p)
-    if(links_.IsLinkUp(p))
-      up.push_back(links_.GetEndpoint(p)->id());
+void Switch::EnableRoutes(Time spf_hold_down) {
+  routes_enabled_ = true;
+  spf_hold_down_ = spf_hold_down;
+  link_state_.TrackChanges();
+}
+
+/* Advertisements are sent as deltas against the previous origination, with
+ * a complete one every full_every originations; 1 sends only complete ones.
+ */
+void Switch::EnableLSDeltas(unsigned int full_every) {
+  CHECK_GT(full_every, 0);
+  ls_full_every_ = full_every;
+}
+
+const Routes& Switch::routes() const { return routes_; }
+
+void Switch::ScheduleRouteComputation() {
+  if(!routes_enabled_ || is_route_computation_pending_ ||
+     !link_state_.HasChangedLinks())
+    return;
+
+  if(spf_hold_down_ <= 0) {
+    UpdateRoutes();
+  } else {
+    is_route_computation_pending_ = true;
+    scheduler_.AddEvent(
+        ComputeRoutes(scheduler_.cur_time() + spf_hold_down_, this));
+  }
+}
+
+void Switch::UpdateRoutes() {
+  unsigned int touched = routes_.Recompute(link_state_);
+  stats_.RecordRouteComputation(this, touched);
+}
+
+/* The advertisement for the origination with sequence number
+ * next_link_state_, which every window of its flood asks for.
+ */
+Advertisement* Switch::CurrentAdvertisement() {
+  if(advertisement_ != nullptr && advertisement_sn_ == next_link_state_)
+    return advertisement_;
+
+  Advertisement* last = advertisement_;
+  const vector<Id>& up_neighbors = links_.UpNeighbors();
+
+  if(last != nullptr && deltas_since_full_ + 1 < ls_full_every_) {
+    advertisement_ = MakeDelta(up_neighbors);
+    ++deltas_since_full_;
+  } else {
+    if(last == nullptr || have_links_changed_ ||
+       last->kind_ != FULL_ADVERTISEMENT)
+      advertisement_ = Advertisement::Full(up_neighbors, 1);
+    deltas_since_full_ = 0;
+  }
+
+  if(last != nullptr && last != advertisement_)
+    ReleaseAdvertisement(last);
+
+  advertisement_sn_ = next_link_state_;
+  have_links_changed_ = false;
+  return advertisement_;
+}
+
+Advertisement* Switch::MakeDelta(const vector<Id>& up_neighbors) const {
+  const vector<Id>& last = advertisement_->neighbors_;
+  Advertisement* delta = Advertisement::Delta(up_neighbors, 1,
+                                              advertisement_sn_);
+
+  if(have_links_changed_) {
+    for(Id n : up_neighbors)
+      if(find(last.begin(), last.end(), n) == last.end())
+        delta->added_.push_back(n);
+    for(Id n : last)
+      if(find(up_neighbors.begin(), up_neighbors.end(), n) ==
+         up_neighbors.end())
+        delta->removed_.push_back(n);
+  }
 
-  return up;
+  if(delta->added_.empty() && delta->removed_.empty())
+    delta->kind_ = REFRESH_ADVERTISEMENT;
+
+  return delta;
 }
 
-Controller::Controller(Scheduler& sc, Id id, Statistics& st) : Entity(sc, id, st) {}
+Controller::Controller(Scheduler& sc, Id id, Statistics& st)
+    : Entity(sc, id, st), elect_leaders_(false), partitions_rs_version_(0),
+      partitions_views_version_(0), num_partitions_(0), current_partition_(0),
+      leader_(NONE_ID), is_controller_(sc.num_entities(), false) {}
 
 string Controller::Description() const { return Entity::Description(); }
 
 string Controller::Name() const { return "Controller"; }
 
-void Controller::Handle(Event* e) { LOG_HANDLE_EVENT(ERROR, Controller, e) }
-
 void Controller::Handle(Up* u) {
   LOG_HANDLE_EVENT(INFO, Controller, u)
 
@@ -501,8 +1581,6 @@ void Controller::Handle(Down* d) {
   LOG_HANDLE_ENTITY
 }
 
-void Controller::Handle(Broadcast* b) { LOG_HANDLE_EVENT(ERROR, Controller, b) }
-
 void Controller::Handle(Heartbeat* h) {
   LOG_HANDLE_EVENT(INFO, Controller, h)
 
@@ -530,15 +1608,160 @@ void Controller::Handle(LinkDown* ld) {
 void Controller::Handle(InitiateHeartbeat* init) {
   LOG_HANDLE_EVENT(INFO, Controller, init)
 
+  if(elect_leaders_ && is_up_) UpdatePartitions();
+
   Entity::Handle(init);
 
   LOG_HANDLE_ENTITY
 }
 
+void Controller::Handle(InitiateGossip* init) {
+  LOG_HANDLE_EVENT(INFO, Controller, init)
+
+  Entity::Handle(init);
+
+  LOG_HANDLE_ENTITY
+}
+
+void Controller::Handle(Gossip* g) {
+  LOG_HANDLE_EVENT(INFO, Controller, g)
+
+  Entity::Handle(g);
+
+  LOG_HANDLE_ENTITY
+}
+
+void Controller::Handle(FlushHeartbeats* flush) {
+  LOG_HANDLE_EVENT(INFO, Controller, flush)
+
+  Entity::Handle(flush);
+
+  LOG_HANDLE_ENTITY
+}
+
+void Controller::Handle(HeartbeatAggregate* a) {
+  LOG_HANDLE_EVENT(INFO, Controller, a)
+
+  Entity::Handle(a);
+
+  LOG_HANDLE_ENTITY
+}
+
 void Controller::Handle(LinkStateUpdate* ls) { LOG_HANDLE_EVENT(ERROR, Controller, ls) }
 
 void Controller::Handle(InitiateLinkState* ls) { LOG_HANDLE_EVENT(ERROR, Controller, ls) }
 
+void Controller::Handle(ComputeRoutes* cr) { LOG_HANDLE_EVENT(ERROR, Controller, cr) }
+
+void Controller::EnableLeaderElection() {
+  elect_leaders_ = true;
+  heart_history_.TrackViews();
+  is_controller_[id_] = true;
+  leader_ = id_;
+  current_partition_ = id_;
+}
+
+unsigned int Controller::CurrentPartition() const { return current_partition_; }
+
+/* Only controllers that take part in the election name a leader in their
+ * heartbeats, so the heartbeat itself tells what its source is.
+ */
+void Controller::NoteHeartbeat(const Heartbeat* h) {
+  if(elect_leaders_ && h->leader_ != NONE_ID)
+    is_controller_[h->src_->id()] = true;
+}
+
+Id Controller::Leader() const { return elect_leaders_ ? leader_ : NONE_ID; }
+
+/* Only the entities that this controller or one of the entities it sees
+ * reports as recently seen are counted, so that entities that were never
+ * heard of do not each make a partition of their own.  A partition is named
+ * after the smallest id in it.
+ */
+void Controller::UpdatePartitions() {
+  ExpireRecentlySeen();
+
+  if(num_partitions_ > 0 &&
+     partitions_rs_version_ == heart_history_.recently_seen_version() &&
+     partitions_views_version_ == heart_history_.views_version())
+    return;
+
+  partitions_rs_version_ = heart_history_.recently_seen_version();
+  partitions_views_version_ = heart_history_.views_version();
+
+  vector<unsigned int> id_to_scc = ComputePartitions();
+  const vector<bool>& own = heart_history_.recently_seen();
+  unsigned int num_entities = id_to_scc.size();
+
+  /* The own row of sees_ holds the entities this controller sees, and the
+   * row of each of them the entities it sees in turn
+   */
+  vector<uint64_t> is_counted(sees_.words_per_row(), 0);
+  is_counted[id_ / 64] |= uint64_t(1) << (id_ % 64);
+  sees_.OrRow(id_, is_counted.data());
+  for(Id i = 0; i < Id(num_entities); ++i)
+    if(own[i] && i != id_)
+      sees_.OrRow(i, is_counted.data());
+
+  vector<Id> scc_to_smallest(num_entities, NONE_ID);
+  unsigned int num_partitions = 0;
+  Id leader = id_;
+  for(Id i = 0; i < Id(num_entities); ++i) {
+    if(!((is_counted[i / 64] >> (i % 64)) & 1)) continue;
+    unsigned int scc = id_to_scc[i];
+    if(scc_to_smallest[scc] == NONE_ID) {
+      scc_to_smallest[scc] = i;
+      ++num_partitions;
+    }
+    if(scc == id_to_scc[id_] && is_controller_[i] && i < leader)
+      leader = i;
+  }
+
+  unsigned int current_partition = scc_to_smallest[id_to_scc[id_]];
+
+  if(num_partitions != num_partitions_ || leader != leader_ ||
+     current_partition != current_partition_)
+    stats_.RecordPartitions(this, num_partitions, current_partition, leader);
+
+  num_partitions_ = num_partitions;
+  current_partition_ = current_partition;
+  leader_ = leader;
+}
+
+void Controller::Save(Checkpoint& c) const {
+  Entity::Save(c);
+  c.Write(elect_leaders_);
+  c.Write(partitions_rs_version_);
+  c.Write(partitions_views_version_);
+  c.Write(num_partitions_);
+  c.Write(current_partition_);
+  c.Write(leader_);
+  c.WriteBits(is_controller_);
+}
+
+void Controller::Restore(Checkpoint& c) {
+  Entity::Restore(c);
+
+  bool elect_leaders = false;
+  c.Read(elect_leaders);
+  if(elect_leaders != elect_leaders_) {
+    c.Fail("leader election was " +
+           string(elect_leaders ? "enabled" : "disabled") +
+           " when the checkpoint was taken");
+    return;
+  }
+  c.Read(partitions_rs_version_);
+  c.Read(partitions_views_version_);
+  c.Read(num_partitions_);
+  c.Read(current_partition_);
+  c.Read(leader_);
+
+  unsigned int num_entities = is_controller_.size();
+  c.ReadBits(is_controller_);
+  if(!c.failed() && is_controller_.size() != num_entities)
+    c.Fail("controller has the wrong number of entities");
+}
+
 OVERLOAD_ENTITY_OSTREAM_IMPL(Entity)
 OVERLOAD_ENTITY_OSTREAM_IMPL(Switch)
 OVERLOAD_ENTITY_OSTREAM_IMPL(Controller)
@@ -1,10 +1,11 @@
 #ifndef DDCSIM_ROUTERS_H_
 #define DDCSIM_ROUTERS_H_
 
-#include <boost/circular_buffer.hpp>
 #include <boost/graph/graph_traits.hpp>
+#include <functional>
 #include <iterator>
 #include <inttypes.h>
+#include <queue>
 #include <random>
 #include <string>
 #include <tuple>
@@ -13,20 +14,29 @@
 #include <utility>
 #include <vector>
 
+#include "bit_matrix.h"
 #include "bv.h"
 #include "common.h"
 #include "links.h"
+#include "routes.h"
+#include "spanning_tree.h"
 
-class Event;
-class Up;
-class Down;
-class LinkUp;
-class LinkDown;
-class Broadcast;
-class Heartbeat;
-class InitiateHeartbeat;
-class LinkStateUpdate;
-class InitiateLinkState;
+struct Up;
+struct Down;
+struct LinkUp;
+struct LinkDown;
+struct Heartbeat;
+struct InitiateHeartbeat;
+struct LinkStateUpdate;
+struct InitiateLinkState;
+struct ComputeRoutes;
+struct InitiateGossip;
+struct Gossip;
+struct FlushHeartbeats;
+struct HeartbeatAggregate;
+struct HeartbeatBatch;
+struct Advertisement;
+class Checkpoint;
 class Statistics;
 
 #define OVERLOAD_ENTITY_OSTREAM_IMPL(entity_type)               \
@@ -56,39 +66,138 @@ std::string to_string(const std::vector<int>& ints);
 // TODO move into entity?
 class HeartbeatHistory {
  public:
-  HeartbeatHistory();
+  HeartbeatHistory(unsigned int);
   void MarkAsSeen(const Heartbeat*, Time);
+  bool Merge(Id, SequenceNum, Time);
   bool HasBeenSeen(const Heartbeat*) const;
-  boost::circular_buffer<Time> LastSeen(Id) const;
+  std::vector<Time> LastSeen(Id) const;
   bool HasBeenSeen(Id) const;
-  std::unordered_map<Id, std::vector<bool> > id_to_recently_seen() const;
+  Time LastSighting(Id) const;
+  void ExpireRecentlySeen(Time, std::vector<Id>* = nullptr);
+  const std::vector<bool>& recently_seen() const;
+  const std::vector<SequenceNum>& latest() const;
+  unsigned long recently_seen_version() const;
+  void TrackViews();
+  unsigned long views_version() const;
+  void TakeChangedViews(std::vector<Id>&);
+  const std::unordered_map<Id, std::vector<bool> >& id_to_recently_seen() const;
+  void Save(Checkpoint&) const;
+  void Restore(Checkpoint&);
 
  private:
   // TODO combine the set and map?
   // TODO make into a pair of sequence number and id?
   typedef std::pair<SequenceNum, const Entity*> HeartbeatId;
+  typedef std::pair<Time, Id> Sighting;
   // TODO what does the style guide say about static methods?
   static HeartbeatId MakeHeartbeatId(const Heartbeat* b);
+  static bool IsRecent(Time, Time);
+  void Sight(Id, Time, Time = 0);
+  bool SetRecentlySeen(Id, bool);
   std::unordered_set<HeartbeatId> seen_;
-  // TODO make into array-type mapping for better efficiency/style?
-  std::unordered_map<Id, boost::circular_buffer<Time> > last_seen_;
+  /* Row i of sightings_ holds the last kMinTimes sightings of entity i's
+   * heartbeats, oldest first, of which the first num_sightings_[i] are used.
+   */
+  std::vector<Time> sightings_;
+  std::vector<unsigned int> num_sightings_;
+  /* When views are tracked, the recently seen vector carried by the latest
+   * heartbeat of each entity.  The version counts the changes to them, and
+   * changed_views_ lists the entities whose views changed since they were
+   * last taken, each once.
+   */
+  bool track_views_;
   std::unordered_map<Id, std::vector<bool> > id_to_recently_seen_;
+  unsigned long views_version_;
+  std::vector<Id> changed_views_;
+  std::vector<bool> is_view_changed_;
+  /* Bit i is set while every one of the last kMinTimes sightings of entity
+   * i's heartbeats is less than kMaxRecent old.  Each new sighting updates
+   * its bit directly; the version counts the times any bit has flipped so
+   * that snapshots of the vector can tell whether they are stale.
+   */
+  std::vector<bool> recently_seen_;
+  unsigned long recently_seen_version_;
+  /* The oldest of the last kMinTimes sightings of each entity whose bit they
+   * set, and infinity for every other entity, so that the entities that fell
+   * out of the window are found in a single pass over a dense array.
+   * expired_bits_ and expiring_ are scratch space for that pass.
+   */
+  std::vector<Time> recent_since_;
+  std::vector<uint64_t> expired_bits_;
+  std::vector<Sighting> expiring_;
+  /* Entities that advertise their heartbeat period are instead recently
+   * seen once kMinTimes of their heartbeats in a row have each arrived by
+   * the deadline set by the one before, and stop being so when the deadline
+   * of the latest passes.  deadlines_ holds the deadline of every entity
+   * whose bit is set, superseded ones being skipped as above.
+   */
+  std::vector<Time> deadline_;
+  std::vector<unsigned int> on_time_;
+  std::priority_queue<Sighting, std::vector<Sighting>,
+                      std::greater<Sighting> > deadlines_;
+  /* The sequence number of the latest heartbeat of entity i that is known,
+   * whether it was seen or learned from a neighbor's digest
+   */
+  std::vector<SequenceNum> latest_;
   DISALLOW_COPY_AND_ASSIGN(HeartbeatHistory);
 };
 
 class LinkState {
  public:
   LinkState(unsigned int);
+  void Init(const Topology&);
   std::string Description() const;
   bool IsStaleUpdate(LinkStateUpdate*);
-  void Update(LinkStateUpdate*);
-  void Update(Id, std::vector<Id>);
+  bool Update(LinkStateUpdate*);
+  void Update(Id, const std::vector<Id>&);
   void Refresh(Time);
+  unsigned int Degree(Id) const;
+  Id Neighbor(Id, unsigned int) const;
+  bool Advertises(Id, Id) const;
+  bool HasLink(Id, Id) const;
+  void TrackChanges();
+  bool HasChangedLinks() const;
+  void TakeChangedLinks(std::vector<std::pair<Id, Id> >&);
+  void Save(Checkpoint&) const;
+  void Restore(Checkpoint&);
 
  private:
+  typedef std::pair<Time, Id> Deadline;
+  bool SetNeighbors(Id, const std::vector<Id>&);
+  bool ApplyDelta(Id, const std::vector<Id>&, const std::vector<Id>&);
+  void ClearNeighbors(Id);
   std::vector<SequenceNum> id_to_last_seq_num_;
+  /* The sequence number of the advertisement that entity i's row reflects.
+   * It falls behind id_to_last_seq_num_ when a delta arrives whose base was
+   * missed, and catches up again with the next complete advertisement.
+   */
+  std::vector<SequenceNum> id_to_applied_seq_num_;
+  /* An expired row is no longer part of the topology, but what it held is
+   * kept here, along with the sequence number it reflected, so that a delta
+   * against it can still be applied when the source turns out to be alive.
+   */
+  std::vector<SequenceNum> id_to_expired_seq_num_;
+  std::vector<std::vector<Id> > expired_rows_;
   std::vector<Time> id_to_exp_;
-  Topology topology_;
+  /* Every accepted update pushes its expiration here so that Refresh only
+   * looks at entries that are due.  Superseded deadlines are not removed
+   * eagerly; Refresh discards them when they reach the top.
+   */
+  std::priority_queue<Deadline, std::vector<Deadline>,
+                      std::greater<Deadline> > deadlines_;
+  /* The advertised neighbors of entity i live in
+   * neighbors_[row_offsets_[i], row_offsets_[i] + id_to_degree_[i]).  Row i
+   * holds as many neighbors as entity i has ports in the physical topology,
+   * which no advertisement of it can exceed, so updates copy in place.
+   */
+  std::vector<uint64_t> row_offsets_;
+  std::vector<Id> neighbors_;
+  std::vector<unsigned int> id_to_degree_;
+  /* When tracking is on, every (source, neighbor) pair added to or removed
+   * from a row is appended here until it is taken by a route computation.
+   */
+  bool track_changes_;
+  std::vector<std::pair<Id, Id> > changed_links_;
   DISALLOW_COPY_AND_ASSIGN(LinkState);
 };
 
@@ -101,28 +210,47 @@ class Entity {
   }
   virtual std::string Description() const;
   virtual std::string Name() const;
-  virtual void Handle(Event*) = 0;
   virtual void Handle(Up*);
   virtual void Handle(Down*);
-  virtual void Handle(Broadcast*) = 0;
   virtual void Handle(Heartbeat*);
   virtual void Handle(LinkUp*);
   virtual void Handle(LinkDown*);
   virtual void Handle(InitiateHeartbeat*);
+  virtual void Handle(InitiateGossip*);
+  virtual void Handle(Gossip*);
+  virtual void Handle(FlushHeartbeats*);
+  virtual void Handle(HeartbeatAggregate*);
   virtual void Handle(LinkStateUpdate*) = 0;
   virtual void Handle(InitiateLinkState*) = 0;
+  virtual void Handle(ComputeRoutes*) = 0;
   Links& links(); // TODO didn't want to do it...
   Id id() const;
   SequenceNum NextHeartbeatSeqNum() const;
   BV ComputeRecentlySeen();
-  std::vector<unsigned int> ComputePartitions() const;
+  Dissemination HeartbeatDissemination() const;
+  Id TreeParent() const;
+  void EnableSpanningTree();
+  void EnableGossip(unsigned int);
+  void EnableHeartbeatAggregation(Time);
+  void EnableAdaptiveHeartbeats(Time, Time);
+  void ScheduleHeartbeat(Time);
+  Time AdvertisedPeriod() const;
+  virtual unsigned int CurrentPartition() const;
+  virtual Id Leader() const;
+  std::vector<unsigned int> ComputePartitions();
   void UpdateLinkCapacities(Time);
+  virtual void Save(Checkpoint&) const;
+  virtual void Restore(Checkpoint&);
   /* An entity is considered "recently seen" if its hearbeats have been seen
    * kMinTimes times in the last kMaxRecent seconds.
    */
   // TODO should these be command line args?
   static const Time kMaxRecent;
   static const unsigned int kMinTimes;
+  /* An entity that advertises its heartbeat period P is expected to send its
+   * next heartbeat within kMaxRecentPeriods * P.
+   */
+  static const double kMaxRecentPeriods;
 
  protected:
   SequenceNum next_heartbeat_;
@@ -133,13 +261,63 @@ class Entity {
   bool is_up_;
   Statistics& stats_;
   BV cached_bv_;
-  bool is_cache_valid_;
+  /* The version of heart_history_'s recently seen vector that cached_bv_
+   * copied
+   */
+  unsigned long cached_bv_version_;
+  /* The sequence number of the heartbeat that cached_bv_ was encoded for */
+  SequenceNum cached_bv_sn_;
+  bool tree_enabled_;
+  SpanningTree tree_;
+  /* With gossip enabled, heartbeats are not flooded.  Instead every gossip
+   * period the entity sends its digest to gossip_fanout_ random neighbors.
+   */
+  unsigned int gossip_fanout_;
+  /* With aggregation enabled, heartbeats to be sent are held back for up to
+   * aggregation_hold_ in pending_ and then sent together, one aggregate per
+   * port.  pending_ is null while nothing is held back.
+   */
+  Time aggregation_hold_;
+  HeartbeatBatch* pending_;
+  /* With adaptive heartbeats, each heartbeat schedules the next one after
+   * heartbeat_period_, which doubles up to max_heartbeat_period_ while the
+   * neighborhood is stable.  It drops back to min_heartbeat_period_ after a
+   * link of this entity goes up or down, or after the recently seen vector
+   * changes.  Only the InitiateHeartbeat due at next_heartbeat_time_ is
+   * acted on, so that rescheduling one earlier supersedes the queued one.
+   * max_heartbeat_period_ is 0 when heartbeats follow the fixed schedule.
+   */
+  Time min_heartbeat_period_;
+  Time max_heartbeat_period_;
+  Time heartbeat_period_;
+  Time next_heartbeat_time_;
+  bool has_neighborhood_changed_;
+  /* The version of the recently seen vector when the period last adapted */
+  unsigned long adapted_version_;
   // TODO should be using the same entropy source as in sim.cc?
   // TODO clean this up
   std::default_random_engine entropy_src_;
   std::discrete_distribution<unsigned char> dist_;
+  /* The graph that ComputePartitions works on, kept between calls so that
+   * only the rows whose views changed are rewritten.  Bit i of sees_rows_ is
+   * set while row i holds entity i's view, i.e. while i is recently seen.
+   * The matrix is empty until the first call and again after a restore.
+   */
+  BitMatrix sees_;
+  std::vector<bool> sees_rows_;
+  void ExpireRecentlySeen();
+  virtual void NoteHeartbeat(const Heartbeat*);
 
  private:
+  void Relay(Heartbeat*);
+  void HoldBack(const Entity*, SequenceNum, BV, Port, unsigned int, Id);
+  void AdaptHeartbeatPeriod();
+  void NoteNeighborhoodChange();
+  void UpdateSees();
+  /* Scratch space for the entities that ExpireRecentlySeen finds expired */
+  std::vector<Id> expired_;
+  /* Scratch space for the entities whose views UpdateSees rewrites */
+  std::vector<Id> changed_views_;
   DISALLOW_COPY_AND_ASSIGN(Entity);
 };
 
@@ -148,22 +326,55 @@ class Switch : public Entity {
   Switch(Scheduler&, Id, Statistics&);
   std::string Description() const;
   std::string Name() const;
-  void Handle(Event*);
   void Handle(Up*);
   void Handle(Down*);
-  void Handle(Broadcast*);
   void Handle(Heartbeat*);
   void Handle(LinkUp*);
   void Handle(LinkDown*);
   void Handle(InitiateHeartbeat*);
+  void Handle(InitiateGossip*);
+  void Handle(Gossip*);
+  void Handle(FlushHeartbeats*);
+  void Handle(HeartbeatAggregate*);
   void Handle(LinkStateUpdate*);
   void Handle(InitiateLinkState*);
+  void Handle(ComputeRoutes*);
   SequenceNum NextLSSeqNum() const;
-  std::vector<Id> ComputeUpNeighbors() const;
+  Advertisement* CurrentAdvertisement();
+  void InitLinkState(const Topology&);
+  void EnableRoutes(Time);
+  void EnableLSDeltas(unsigned int);
+  const Routes& routes() const;
+  void Save(Checkpoint&) const;
+  void Restore(Checkpoint&);
+  static const Time kDefaultSPFHoldDown;
 
  private:
+  void ScheduleRouteComputation();
+  void UpdateRoutes();
+  Advertisement* MakeDelta(const std::vector<Id>&) const;
   SequenceNum next_link_state_;
+  /* The advertisement last originated, which has sequence number
+   * advertisement_sn_.  A complete advertisement is shared by every
+   * origination until a link goes up or down.  The switch holds one
+   * reference to it.
+   */
+  Advertisement* advertisement_;
+  SequenceNum advertisement_sn_;
+  bool have_links_changed_;
+  /* With deltas enabled, every ls_full_every_-th origination is complete so
+   * that receivers which missed a delta or let the entry expire catch up.
+   */
+  unsigned int ls_full_every_;
+  unsigned int deltas_since_full_;
   LinkState link_state_;
+  Routes routes_;
+  bool routes_enabled_;
+  /* Route computations are deferred by this long after the first link state
+   * change so that further changes arriving in the meantime are batched.
+   */
+  Time spf_hold_down_;
+  bool is_route_computation_pending_;
   DISALLOW_COPY_AND_ASSIGN(Switch);
 };
 
@@ -172,18 +383,43 @@ class Controller : public Entity {
   Controller(Scheduler&, Id, Statistics&);
   std::string Description() const;
   std::string Name() const;
-  void Handle(Event*);
   void Handle(Up*);
   void Handle(Down*);
-  void Handle(Broadcast*);
   void Handle(Heartbeat*);
   void Handle(LinkUp*);
   void Handle(LinkDown*);
   void Handle(InitiateHeartbeat*);
+  void Handle(InitiateGossip*);
+  void Handle(Gossip*);
+  void Handle(FlushHeartbeats*);
+  void Handle(HeartbeatAggregate*);
   void Handle(LinkStateUpdate*);
   void Handle(InitiateLinkState*);
+  void Handle(ComputeRoutes*);
+  void EnableLeaderElection();
+  unsigned int CurrentPartition() const;
+  Id Leader() const;
+  void Save(Checkpoint&) const;
+  void Restore(Checkpoint&);
 
  private:
+  void NoteHeartbeat(const Heartbeat*);
+  void UpdatePartitions();
+  /* With leader election enabled, the controller recomputes the partitions
+   * before each of its heartbeats, but only when its recently seen vector
+   * or the views of other entities have changed since the last time.  The
+   * leader of a partition is the controller with the smallest id in it.
+   */
+  bool elect_leaders_;
+  unsigned long partitions_rs_version_;
+  unsigned long partitions_views_version_;
+  unsigned int num_partitions_;
+  unsigned int current_partition_;
+  Id leader_;
+  /* Bit i is set once entity i is known to be a controller, which is when
+   * one of its heartbeats names a leader
+   */
+  std::vector<bool> is_controller_;
   DISALLOW_COPY_AND_ASSIGN(Controller);
 };
 
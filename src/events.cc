@@ -1,4 +1,5 @@
 #include "bv.h"
+#include "checkpoint.h"
 #include "entities.h"
 #include "events.h"
 
@@ -25,111 +26,100 @@ std::string to_string(const std::vector<bool>& vb) {
 }
 };
 
-Event::Event(Time t, Entity* e) : time_(t), affected_entities_({e}) {}
+/* 20 bytes for a header with no options */
+const Size kBroadcastHeaderSize = 20;
 
-Event::Event(Time t, Entity* e1, Entity* e2) : time_(t),
-                                               affected_entities_({e1, e2}) {}
-
-void Event::Handle(Entity* e) { e->Handle(this); }
-
-string Event::Description() const {
-  string ids = "";
-
-  for(auto it = affected_entities_.begin(); it != affected_entities_.end(); ++it)
-    ids += to_string((*it)->id()) + " ";
-
-  return "time_=" + to_string(time_) + " affected_entities=" + ids;
+string DescribeHeader(Time t, const Entity* affected_entity) {
+  return "time_=" + to_string(t) + " affected_entities=" +
+      to_string(affected_entity->id()) + " ";
 }
 
-string Event::Name() const { return "Event"; }
-
-Size Event::size() const { return 0; }
+Up::Up(Time t, Entity* e) : type_(UP), time_(t), affected_entity_(e) {}
 
-Up::Up(Time t, Entity* e) : Event(t, e) {}
-
-void Up::Handle(Entity* e) { e->Handle(this); }
-
-string Up::Description() const { return Event::Description(); }
+string Up::Description() const {
+  return DescribeHeader(time_, affected_entity_);
+}
 
 string Up::Name() const { return "Up"; }
 
-Down::Down(Time t, Entity* e) : Event(t, e) {}
+Down::Down(Time t, Entity* e) : type_(DOWN), time_(t), affected_entity_(e) {}
 
-void Down::Handle(Entity* e) { e->Handle(this); }
-
-string Down::Description() const { return Event::Description(); }
+string Down::Description() const {
+  return DescribeHeader(time_, affected_entity_);
+}
 
 string Down::Name() const { return "Down"; }
 
-LinkUp::LinkUp(Time t, Entity* e, Port p) : Event(t, e), out_(p) {}
-
-void LinkUp::Handle(Entity* e) { e->Handle(this); }
+LinkUp::LinkUp(Time t, Entity* e, Port p) : type_(LINK_UP), time_(t),
+                                            affected_entity_(e), out_(p) {}
 
 string LinkUp::Description() const {
-  return Event::Description() + " out_=" + to_string(out_);
+  return DescribeHeader(time_, affected_entity_) + " out_=" + to_string(out_);
 }
 
 string LinkUp::Name() const { return "Link Up"; }
 
-LinkDown::LinkDown(Time t, Entity* e, Port p) : Event(t, e), out_(p) {}
-
-void LinkDown::Handle(Entity* e) { e->Handle(this); }
+LinkDown::LinkDown(Time t, Entity* e, Port p) : type_(LINK_DOWN), time_(t),
+                                                affected_entity_(e), out_(p) {}
 
 string LinkDown::Description() const {
-  return Event::Description() + " out_=" + to_string(out_);
+  return DescribeHeader(time_, affected_entity_) + " out_=" + to_string(out_);
 }
 
 string LinkDown::Name() const { return "Link Down"; }
 
 InitiateHeartbeat::InitiateHeartbeat(Time t, Entity* affected_entity) :
-    Event(t, affected_entity) {}
-
-void InitiateHeartbeat::Handle(Entity* e) { return e->Handle(this); }
+    type_(INITIATE_HEARTBEAT), time_(t), affected_entity_(affected_entity) {}
 
-string InitiateHeartbeat::Description() const { return Event::Description(); }
+string InitiateHeartbeat::Description() const {
+  return DescribeHeader(time_, affected_entity_);
+}
 
 string InitiateHeartbeat::Name() const { return "Initiate Heartbeat"; }
 
-Broadcast::Broadcast(Time t, Entity* affected_entity, Port in) :
-    Event(t, affected_entity), in_port_(in) {}
+/* Heartbeats only carry the tree fields when a spanning tree is kept */
+Size TreeFieldsSize(Dissemination d) {
+  return d == FLOOD ? 0 : sizeof(Dissemination) + sizeof(Id);
+}
 
-void Broadcast::Handle(Entity* e) { e->Handle(this); }
+/* Only heartbeats that name a leader carry the partition fields */
+Size PartitionFieldsSize(Id leader) {
+  return leader == NONE_ID ? 0 : sizeof(unsigned int) + sizeof(Id);
+}
 
-string Broadcast::Description() const {
-  return Event::Description() + " in_port_=" + to_string(in_port_);
+/* An advertised period is sent in milliseconds */
+Size PeriodFieldSize(Time period) {
+  return period > 0 ? sizeof(uint32_t) : 0;
 }
 
-string Broadcast::Name() const { return "Broadcast"; }
+string DescribePeriod(Time period) {
+  return period > 0 ? " period_=" + to_string(period) : "";
+}
 
-Size Broadcast::size() const {
-  /* 20 bytes for a header with no options */
-  return 20;
+string DescribeTree(Dissemination d, Id parent) {
+  if(d == FLOOD) return "";
+  return string(" dissemination_=") + (d == TREE ? "TREE" : "TREE_REPAIR") +
+      " tree_parent_=" + to_string(parent);
 }
 
 Heartbeat::Heartbeat(Time t, const Entity* src, Entity* affected_entity,
                      Port in, SequenceNum sn, BV r) :
-    Broadcast(t, affected_entity, in), src_(src), sn_(sn), recently_seen_(r),
-    leader_(NONE_ID), current_partition_(0) {
+    type_(HEARTBEAT), time_(t), affected_entity_(affected_entity),
+    in_port_(in), sn_(sn), src_(src), recently_seen_(r),
+    current_partition_(0), leader_(NONE_ID), dissemination_(FLOOD),
+    tree_parent_(NONE_ID), period_(0) {
   ++(*recently_seen_.ref_count_);
 }
 
-Heartbeat::~Heartbeat() {
-  --(*(recently_seen_.ref_count_));
-
-  if(*(recently_seen_.ref_count_) == 0) {
-    delete recently_seen_.bv_;
-    delete recently_seen_.ref_count_;
-  }
-}
-
-void Heartbeat::Handle(Entity* e) { e->Handle(this); }
-
 string Heartbeat::Description() const {
-  return Broadcast::Description() +
+  return DescribeHeader(time_, affected_entity_) +
+    " in_port_=" + to_string(in_port_) +
     " sn_=" + to_string(sn_) +
     " src_=" + to_string(src_->id()) +
     " current_parition_=" + to_string(current_partition_) +
-      " leader_=" + to_string(leader_);
+      " leader_=" + to_string(leader_) +
+      " encoding_=" + BV::EncodingName(recently_seen_.encoding_) +
+      DescribeTree(dissemination_, tree_parent_) + DescribePeriod(period_);
     // " recently_seen_=" + to_string(*recently_seen_.bv_);
 }
 
@@ -137,43 +127,705 @@ string Heartbeat::Name() const { return "Heartbeat"; }
 
 Size Heartbeat::size() const {
   // TODO how to automate this?
-  return Broadcast::size() + sizeof(sn_) + sizeof(src_);
-      //      ceil(recently_seen_.bv_->size() / 8.0) + sizeof(leader_) + sizeof(current_partition_);
+  return kBroadcastHeaderSize + sizeof(sn_) + sizeof(src_) +
+      recently_seen_.encoded_size_ + TreeFieldsSize(dissemination_) +
+      PeriodFieldSize(period_) + PartitionFieldsSize(leader_);
 }
 
 LinkStateUpdate::LinkStateUpdate(Time t, Entity* e, Port i, const Entity* s,
-                                 SequenceNum sn, const vector<Id> v, Time exp)
-    : Broadcast(t, e, i), src_(s), sn_(sn), neighbors_(v), expiration_(exp) {}
+                                 SequenceNum sn, const vector<Id>& v, Time exp)
+    : type_(LINK_STATE_UPDATE), time_(t), affected_entity_(e), in_port_(i),
+      sn_(sn), src_(s), advertisement_(Advertisement::Full(v, 1)),
+      expiration_(exp) {}
 
-void LinkStateUpdate::Handle(Entity* e) { e->Handle(this); }
+LinkStateUpdate::LinkStateUpdate(Time t, Entity* e, Port i, const Entity* s,
+                                 SequenceNum sn, Advertisement* ad, Time exp)
+    : type_(LINK_STATE_UPDATE), time_(t), affected_entity_(e), in_port_(i),
+      sn_(sn), src_(s), advertisement_(ad), expiration_(exp) {
+  ++advertisement_->ref_count_;
+}
 
 string LinkStateUpdate::Description() const {
-  return Broadcast::Description()  +
+  return DescribeHeader(time_, affected_entity_) +
+      " in_port_=" + to_string(in_port_) +
       " sn_=" + to_string(sn_) +
       " src_=" + to_string(src_->id()) +
-      " neighbors_=" + to_string(neighbors_) +
+      advertisement_->Description() +
       " expiration_=" + to_string(expiration_);
 }
 
 string LinkStateUpdate::Name() const { return "Link State Update"; }
 
-Size LinkStateUpdate::size() const { return Broadcast::size() + 50; }
+Size LinkStateUpdate::size() const {
+  return kBroadcastHeaderSize + sizeof(sn_) + sizeof(src_) +
+      sizeof(expiration_) + advertisement_->size();
+}
 
-InitiateLinkState::InitiateLinkState(Time t, Entity* e) : Event(t, e) {}
+/* A complete advertisement of neighbors, with ref_count references */
+Advertisement* Advertisement::Full(const vector<Id>& neighbors,
+                                   unsigned int ref_count) {
+  return new Advertisement{neighbors, ref_count, FULL_ADVERTISEMENT,
+                           NONE_SEQNUM, vector<Id>(), vector<Id>()};
+}
 
-void InitiateLinkState::Handle(Entity* e) { e->Handle(this); }
+/* A delta against base_sn that does not list any change yet; neighbors is the
+ * source's complete list
+ */
+Advertisement* Advertisement::Delta(const vector<Id>& neighbors,
+                                    unsigned int ref_count,
+                                    SequenceNum base_sn) {
+  return new Advertisement{neighbors, ref_count, DELTA_ADVERTISEMENT, base_sn,
+                           vector<Id>(), vector<Id>()};
+}
 
-string InitiateLinkState::Description() const { return Event::Description(); }
+/* One byte tells the kinds apart and lists are prefixed with a two byte
+ * count.  A refresh only has to name the advertisement it renews.
+ */
+Size Advertisement::size() const {
+  switch(kind_) {
+    case FULL_ADVERTISEMENT:
+      return 1 + sizeof(uint16_t) + neighbors_.size() * sizeof(Id);
+    case DELTA_ADVERTISEMENT:
+      return 1 + sizeof(base_sn_) + 2 * sizeof(uint16_t) +
+          (added_.size() + removed_.size()) * sizeof(Id);
+    case REFRESH_ADVERTISEMENT:
+      return 1 + sizeof(base_sn_);
+  }
+
+  LOG(FATAL) << "Advertisement of unknown kind " << int(kind_);
+  return 0;
+}
+
+string Advertisement::Description() const {
+  switch(kind_) {
+    case FULL_ADVERTISEMENT:
+      return " neighbors_=" + to_string(neighbors_);
+    case DELTA_ADVERTISEMENT:
+      return " base_sn_=" + to_string(base_sn_) +
+          " added_=" + to_string(added_) + " removed_=" + to_string(removed_);
+    case REFRESH_ADVERTISEMENT:
+      return " base_sn_=" + to_string(base_sn_);
+  }
+
+  return "";
+}
+
+InitiateLinkState::InitiateLinkState(Time t, Entity* e) :
+    type_(INITIATE_LINK_STATE), time_(t), affected_entity_(e) {}
+
+string InitiateLinkState::Description() const {
+  return DescribeHeader(time_, affected_entity_);
+}
 
 string InitiateLinkState::Name() const { return "Initiate Link State Update"; }
 
+ComputeRoutes::ComputeRoutes(Time t, Entity* e) :
+    type_(COMPUTE_ROUTES), time_(t), affected_entity_(e) {}
+
+string ComputeRoutes::Description() const {
+  return DescribeHeader(time_, affected_entity_);
+}
+
+string ComputeRoutes::Name() const { return "Compute Routes"; }
+
+unsigned int CountPorts(PortMask ports) {
+  unsigned int count = 0;
+
+  for( ; ports != 0; ports &= ports - 1)
+    ++count;
+
+  return count;
+}
+
+string DescribePorts(Port first, PortMask ports) {
+  string rtn = "";
+
+  for(Port i = 0; i < kFloodWidth; ++i)
+    if((ports >> i) & 1)
+      rtn += to_string(first + i) + " ";
+
+  return rtn;
+}
+
+HeartbeatFlood::HeartbeatFlood(Time t, Entity* sender, Port first,
+                               PortMask ports, const Entity* src,
+                               SequenceNum sn, BV r) :
+    type_(HEARTBEAT_FLOOD), time_(t), affected_entity_(sender),
+    first_port_(first), ports_(ports), sn_(sn), src_(src), recently_seen_(r),
+    current_partition_(0), leader_(NONE_ID), dissemination_(FLOOD),
+    tree_parent_(NONE_ID), period_(0) {
+  ++(*recently_seen_.ref_count_);
+}
+
+string HeartbeatFlood::Description() const {
+  return DescribeHeader(time_, affected_entity_) +
+      " ports_=" + DescribePorts(first_port_, ports_) +
+      " sn_=" + to_string(sn_) +
+      " src_=" + to_string(src_->id()) +
+      " current_partition_=" + to_string(current_partition_) +
+      " leader_=" + to_string(leader_) +
+      " encoding_=" + BV::EncodingName(recently_seen_.encoding_) +
+      DescribeTree(dissemination_, tree_parent_) + DescribePeriod(period_);
+}
+
+string HeartbeatFlood::Name() const { return "Heartbeat Flood"; }
+
+Size HeartbeatFlood::size() const {
+  return CountPorts(ports_) * (kBroadcastHeaderSize + sizeof(sn_) +
+                               sizeof(src_) + recently_seen_.encoded_size_ +
+                               TreeFieldsSize(dissemination_) +
+                               PeriodFieldSize(period_) +
+                               PartitionFieldsSize(leader_));
+}
+
+unsigned int HeartbeatFlood::Deliver() const {
+  unsigned int delivered = 0;
+
+  for(Port i = 0; i < kFloodWidth; ++i) {
+    if((ports_ >> i) & 1) {
+      Entity* receiver = affected_entity_->links().GetEndpoint(first_port_ + i);
+      Port in = receiver->links().GetPortTo(affected_entity_);
+      CHECK_NE(in, PORT_NOT_FOUND);
+
+      Heartbeat h(time_, src_, receiver, in, sn_, recently_seen_);
+      h.dissemination_ = dissemination_;
+      h.tree_parent_ = tree_parent_;
+      h.period_ = period_;
+      h.current_partition_ = current_partition_;
+      h.leader_ = leader_;
+      Event copy = h;
+      delivered += copy.Handle();
+      copy.Release();
+    }
+  }
+
+  return delivered;
+}
+
+LinkStateFlood::LinkStateFlood(Time t, Entity* sender, Port first,
+                               PortMask ports, const Entity* src,
+                               SequenceNum sn, Advertisement* ad, Time exp) :
+    type_(LINK_STATE_FLOOD), time_(t), affected_entity_(sender),
+    first_port_(first), ports_(ports), sn_(sn), src_(src), advertisement_(ad),
+    expiration_(exp) {
+  ++advertisement_->ref_count_;
+}
+
+string LinkStateFlood::Description() const {
+  return DescribeHeader(time_, affected_entity_) +
+      " ports_=" + DescribePorts(first_port_, ports_) +
+      " sn_=" + to_string(sn_) +
+      " src_=" + to_string(src_->id()) +
+      advertisement_->Description() +
+      " expiration_=" + to_string(expiration_);
+}
+
+string LinkStateFlood::Name() const { return "Link State Flood"; }
+
+Size LinkStateFlood::size() const {
+  return CountPorts(ports_) * (kBroadcastHeaderSize + sizeof(sn_) +
+                               sizeof(src_) + sizeof(expiration_) +
+                               advertisement_->size());
+}
+
+unsigned int LinkStateFlood::Deliver() const {
+  unsigned int delivered = 0;
+
+  for(Port i = 0; i < kFloodWidth; ++i) {
+    if((ports_ >> i) & 1) {
+      Entity* receiver = affected_entity_->links().GetEndpoint(first_port_ + i);
+      Port in = receiver->links().GetPortTo(affected_entity_);
+      CHECK_NE(in, PORT_NOT_FOUND);
+
+      Event copy = LinkStateUpdate(time_, receiver, in, src_, sn_,
+                                   advertisement_, expiration_);
+      delivered += copy.Handle();
+      copy.Release();
+    }
+  }
+
+  return delivered;
+}
+
+InitiateGossip::InitiateGossip(Time t, Entity* e) :
+    type_(INITIATE_GOSSIP), time_(t), affected_entity_(e) {}
+
+string InitiateGossip::Description() const {
+  return DescribeHeader(time_, affected_entity_);
+}
+
+string InitiateGossip::Name() const { return "Initiate Gossip"; }
+
+Gossip::Gossip(Time t, Entity* e, Port in, const Entity* src, Digest* d) :
+    type_(GOSSIP), time_(t), affected_entity_(e), in_port_(in), src_(src),
+    digest_(d) {
+  ++digest_->ref_count_;
+}
+
+string Gossip::Description() const {
+  return DescribeHeader(time_, affected_entity_) +
+      " in_port_=" + to_string(in_port_) +
+      " src_=" + to_string(src_->id()) +
+      " num_known_=" + to_string(digest_->num_known_);
+}
+
+string Gossip::Name() const { return "Gossip"; }
+
+/* Only the entities the digest knows of are sent, each as an id and a
+ * sequence number, after a four byte count.
+ */
+Size Gossip::size() const {
+  return kBroadcastHeaderSize + sizeof(src_) + sizeof(uint32_t) +
+      digest_->num_known_ * (sizeof(Id) + sizeof(SequenceNum));
+}
+
+FlushHeartbeats::FlushHeartbeats(Time t, Entity* e) :
+    type_(FLUSH_HEARTBEATS), time_(t), affected_entity_(e) {}
+
+string FlushHeartbeats::Description() const {
+  return DescribeHeader(time_, affected_entity_);
+}
+
+string FlushHeartbeats::Name() const { return "Flush Heartbeats"; }
+
+/* Each entry is what a heartbeat carries besides its header */
+Size HeartbeatBatch::EntriesSize(Port out) const {
+  Size size = 0;
+
+  for(const BatchEntry& entry : entries_)
+    if(entry.in_port_ != out)
+      size += sizeof(entry.sn_) + sizeof(entry.src_) +
+          entry.recently_seen_.encoded_size_ +
+          PartitionFieldsSize(entry.leader_);
+
+  return size;
+}
+
+unsigned int HeartbeatBatch::CountEntries(Port out) const {
+  unsigned int count = 0;
+
+  for(const BatchEntry& entry : entries_)
+    if(entry.in_port_ != out)
+      ++count;
+
+  return count;
+}
+
+HeartbeatAggregate::HeartbeatAggregate(Time t, Entity* e, Port in, Port out,
+                                       HeartbeatBatch* b) :
+    type_(HEARTBEAT_AGGREGATE), time_(t), affected_entity_(e), in_port_(in),
+    out_port_(out), batch_(b) {
+  ++batch_->ref_count_;
+}
+
+string HeartbeatAggregate::Description() const {
+  return DescribeHeader(time_, affected_entity_) +
+      " in_port_=" + to_string(in_port_) +
+      " out_port_=" + to_string(out_port_) +
+      " entries=" + to_string(batch_->CountEntries(out_port_));
+}
+
+string HeartbeatAggregate::Name() const { return "Heartbeat Aggregate"; }
+
+/* The entries follow a single header and a four byte count */
+Size HeartbeatAggregate::size() const {
+  return kBroadcastHeaderSize + sizeof(uint32_t) +
+      batch_->EntriesSize(out_port_);
+}
+
+Event::Event(const Up& e) : up_(e) {}
+
+Event::Event(const Down& e) : down_(e) {}
+
+Event::Event(const LinkUp& e) : link_up_(e) {}
+
+Event::Event(const LinkDown& e) : link_down_(e) {}
+
+Event::Event(const InitiateHeartbeat& e) : initiate_heartbeat_(e) {}
+
+Event::Event(const Heartbeat& e) : heartbeat_(e) {}
+
+Event::Event(const LinkStateUpdate& e) : link_state_update_(e) {}
+
+Event::Event(const InitiateLinkState& e) : initiate_link_state_(e) {}
+
+Event::Event(const ComputeRoutes& e) : compute_routes_(e) {}
+
+Event::Event(const HeartbeatFlood& e) : heartbeat_flood_(e) {}
+
+Event::Event(const LinkStateFlood& e) : link_state_flood_(e) {}
+
+Event::Event(const InitiateGossip& e) : initiate_gossip_(e) {}
+
+Event::Event(const Gossip& e) : gossip_(e) {}
+
+Event::Event(const FlushHeartbeats& e) : flush_heartbeats_(e) {}
+
+Event::Event(const HeartbeatAggregate& e) : heartbeat_aggregate_(e) {}
+
+/* Returns the number of deliveries made, which is one unless this is a
+ * flood.
+ */
+unsigned int Event::Handle() {
+  Entity* e = header_.affected_entity_;
+
+  switch(header_.type_) {
+    case UP: e->Handle(&up_); break;
+    case DOWN: e->Handle(&down_); break;
+    case LINK_UP: e->Handle(&link_up_); break;
+    case LINK_DOWN: e->Handle(&link_down_); break;
+    case INITIATE_HEARTBEAT: e->Handle(&initiate_heartbeat_); break;
+    case HEARTBEAT: e->Handle(&heartbeat_); break;
+    case LINK_STATE_UPDATE: e->Handle(&link_state_update_); break;
+    case INITIATE_LINK_STATE: e->Handle(&initiate_link_state_); break;
+    case COMPUTE_ROUTES: e->Handle(&compute_routes_); break;
+    case HEARTBEAT_FLOOD: return heartbeat_flood_.Deliver();
+    case LINK_STATE_FLOOD: return link_state_flood_.Deliver();
+    case INITIATE_GOSSIP: e->Handle(&initiate_gossip_); break;
+    case GOSSIP: e->Handle(&gossip_); break;
+    case FLUSH_HEARTBEATS: e->Handle(&flush_heartbeats_); break;
+    case HEARTBEAT_AGGREGATE: e->Handle(&heartbeat_aggregate_); break;
+    default: LOG(ERROR) << "Handled event of unknown type " << header_.type_;
+  }
+
+  return 1;
+}
+
+void ReleaseRecentlySeen(BV& bv) {
+  if(--(*bv.ref_count_) == 0) {
+    delete bv.bv_;
+    delete bv.ref_count_;
+  }
+}
+
+void ReleaseAdvertisement(Advertisement* ad) {
+  if(--ad->ref_count_ == 0)
+    delete ad;
+}
+
+void ReleaseDigest(Digest* d) {
+  if(--d->ref_count_ == 0)
+    delete d;
+}
+
+void ReleaseHeartbeatBatch(HeartbeatBatch* b) {
+  if(--b->ref_count_ > 0) return;
+
+  for(BatchEntry& entry : b->entries_)
+    ReleaseRecentlySeen(entry.recently_seen_);
+  delete b;
+}
+
+/* Drops this event's references to data shared with other events.  Must be
+ * called exactly once per constructed event, after it has been handled or
+ * when it is discarded.
+ */
+void Event::Release() {
+  switch(header_.type_) {
+    case HEARTBEAT:
+      ReleaseRecentlySeen(heartbeat_.recently_seen_);
+      break;
+    case LINK_STATE_UPDATE:
+      ReleaseAdvertisement(link_state_update_.advertisement_);
+      break;
+    case HEARTBEAT_FLOOD:
+      ReleaseRecentlySeen(heartbeat_flood_.recently_seen_);
+      break;
+    case LINK_STATE_FLOOD:
+      ReleaseAdvertisement(link_state_flood_.advertisement_);
+      break;
+    case GOSSIP:
+      ReleaseDigest(gossip_.digest_);
+      break;
+    case HEARTBEAT_AGGREGATE:
+      ReleaseHeartbeatBatch(heartbeat_aggregate_.batch_);
+      break;
+    default:
+      break;
+  }
+}
+
+void Event::Save(Checkpoint& c) const {
+  c.Write(header_.type_);
+  c.Write(header_.time_);
+  c.WriteEntity(header_.affected_entity_);
+
+  switch(header_.type_) {
+    case LINK_UP:
+      c.Write(link_up_.out_);
+      break;
+    case LINK_DOWN:
+      c.Write(link_down_.out_);
+      break;
+    case HEARTBEAT:
+      c.Write(heartbeat_.in_port_);
+      c.Write(heartbeat_.sn_);
+      c.WriteEntity(heartbeat_.src_);
+      c.WriteBV(heartbeat_.recently_seen_);
+      c.Write(heartbeat_.current_partition_);
+      c.Write(heartbeat_.leader_);
+      c.Write(heartbeat_.dissemination_);
+      c.Write(heartbeat_.tree_parent_);
+      c.Write(heartbeat_.period_);
+      break;
+    case LINK_STATE_UPDATE:
+      c.Write(link_state_update_.in_port_);
+      c.Write(link_state_update_.sn_);
+      c.WriteEntity(link_state_update_.src_);
+      c.WriteAdvertisement(link_state_update_.advertisement_);
+      c.Write(link_state_update_.expiration_);
+      break;
+    case HEARTBEAT_FLOOD:
+      c.Write(heartbeat_flood_.first_port_);
+      c.Write(heartbeat_flood_.ports_);
+      c.Write(heartbeat_flood_.sn_);
+      c.WriteEntity(heartbeat_flood_.src_);
+      c.WriteBV(heartbeat_flood_.recently_seen_);
+      c.Write(heartbeat_flood_.dissemination_);
+      c.Write(heartbeat_flood_.tree_parent_);
+      c.Write(heartbeat_flood_.period_);
+      c.Write(heartbeat_flood_.current_partition_);
+      c.Write(heartbeat_flood_.leader_);
+      break;
+    case LINK_STATE_FLOOD:
+      c.Write(link_state_flood_.first_port_);
+      c.Write(link_state_flood_.ports_);
+      c.Write(link_state_flood_.sn_);
+      c.WriteEntity(link_state_flood_.src_);
+      c.WriteAdvertisement(link_state_flood_.advertisement_);
+      c.Write(link_state_flood_.expiration_);
+      break;
+    case GOSSIP:
+      /* Digests are small and short lived, so each copy writes its own */
+      c.Write(gossip_.in_port_);
+      c.WriteEntity(gossip_.src_);
+      c.WriteVector(gossip_.digest_->latest_);
+      c.Write(gossip_.digest_->num_known_);
+      break;
+    case HEARTBEAT_AGGREGATE:
+      c.Write(heartbeat_aggregate_.in_port_);
+      c.Write(heartbeat_aggregate_.out_port_);
+      c.WriteHeartbeatBatch(heartbeat_aggregate_.batch_);
+      break;
+    default:
+      break;
+  }
+}
+
+/* Whether port is one of e's */
+bool IsValidPort(Entity* e, Port port) {
+  return port >= 0 && port < Port(e->links().PortCount());
+}
+
+/* Whether the ports a flood is sent out of are all e's */
+bool AreValidPorts(Entity* e, Port first, PortMask ports) {
+  if(ports == 0 || !IsValidPort(e, first)) return false;
+  return IsValidPort(e, first + 63 - __builtin_clzll(ports));
+}
+
+/* The inverse of Save.  Constructing the event takes its references to the
+ * shared data it points to.  If the checkpoint turns out to be bad, the event
+ * returned is a placeholder that the caller must drop.
+ */
+Event Event::Restore(Checkpoint& c) {
+  EventType type = UP;
+  Time t = START_TIME;
+  Port p = PORT_NOT_FOUND, first = PORT_NOT_FOUND;
+  PortMask ports = 0;
+  SequenceNum sn = NONE_SEQNUM;
+  Time exp = START_TIME;
+
+  c.Read(type);
+  c.Read(t);
+  Entity* e = c.ReadEntity();
+
+  if(c.failed()) return Up(t, e);
+
+  if(e == nullptr || !(t >= START_TIME)) {
+    c.Fail("event has no entity or an invalid time");
+    return Up(t, e);
+  }
+
+  switch(type) {
+    case UP: return Up(t, e);
+    case DOWN: return Down(t, e);
+    case LINK_UP:
+    case LINK_DOWN:
+      c.Read(p);
+      if(!c.failed() && !IsValidPort(e, p))
+        c.Fail("link event for unknown port " + to_string(p));
+      if(c.failed()) return Up(t, e);
+      if(type == LINK_UP) return LinkUp(t, e, p);
+      return LinkDown(t, e, p);
+    case INITIATE_HEARTBEAT: return InitiateHeartbeat(t, e);
+    case INITIATE_LINK_STATE: return InitiateLinkState(t, e);
+    case COMPUTE_ROUTES: return ComputeRoutes(t, e);
+    case INITIATE_GOSSIP: return InitiateGossip(t, e);
+    case FLUSH_HEARTBEATS: return FlushHeartbeats(t, e);
+    case HEARTBEAT: {
+      c.Read(p);
+      c.Read(sn);
+      const Entity* src = c.ReadEntity();
+      BV bv = c.ReadBV();
+      if(!c.failed() && (src == nullptr || bv.bv_ == nullptr))
+        c.Fail("heartbeat has no source or recently seen vector");
+      if(!c.failed() && !IsValidPort(e, p))
+        c.Fail("heartbeat arrived on unknown port " + to_string(p));
+      if(c.failed()) return Up(t, e);
+      Heartbeat h(t, src, e, p, sn, bv);
+      c.Read(h.current_partition_);
+      c.Read(h.leader_);
+      c.Read(h.dissemination_);
+      c.Read(h.tree_parent_);
+      c.Read(h.period_);
+      return h;
+    }
+    case LINK_STATE_UPDATE: {
+      c.Read(p);
+      c.Read(sn);
+      const Entity* src = c.ReadEntity();
+      Advertisement* ad = c.ReadAdvertisement();
+      c.Read(exp);
+      if(!c.failed() && src == nullptr)
+        c.Fail("link state update has no source");
+      if(c.failed()) return Up(t, e);
+      return LinkStateUpdate(t, e, p, src, sn, ad, exp);
+    }
+    case HEARTBEAT_FLOOD: {
+      c.Read(first);
+      c.Read(ports);
+      c.Read(sn);
+      const Entity* src = c.ReadEntity();
+      BV bv = c.ReadBV();
+      if(!c.failed() && (!AreValidPorts(e, first, ports) || src == nullptr ||
+                         bv.bv_ == nullptr))
+        c.Fail("heartbeat flood is inconsistent");
+      if(c.failed()) return Up(t, e);
+      HeartbeatFlood f(t, e, first, ports, src, sn, bv);
+      c.Read(f.dissemination_);
+      c.Read(f.tree_parent_);
+      c.Read(f.period_);
+      c.Read(f.current_partition_);
+      c.Read(f.leader_);
+      return f;
+    }
+    case LINK_STATE_FLOOD: {
+      c.Read(first);
+      c.Read(ports);
+      c.Read(sn);
+      const Entity* src = c.ReadEntity();
+      Advertisement* ad = c.ReadAdvertisement();
+      c.Read(exp);
+      if(!c.failed() && (!AreValidPorts(e, first, ports) || src == nullptr))
+        c.Fail("link state flood is inconsistent");
+      if(c.failed()) return Up(t, e);
+      return LinkStateFlood(t, e, first, ports, src, sn, ad, exp);
+    }
+    case GOSSIP: {
+      vector<SequenceNum> latest;
+      unsigned int num_known = 0;
+      c.Read(p);
+      const Entity* src = c.ReadEntity();
+      c.ReadVector(latest);
+      c.Read(num_known);
+      if(!c.failed() && src == nullptr)
+        c.Fail("gossip has no source");
+      if(c.failed()) return Up(t, e);
+      return Gossip(t, e, p, src, new Digest{latest, num_known, 0});
+    }
+    case HEARTBEAT_AGGREGATE: {
+      Port out = PORT_NOT_FOUND;
+      c.Read(p);
+      c.Read(out);
+      HeartbeatBatch* batch = c.ReadHeartbeatBatch();
+      if(c.failed()) return Up(t, e);
+      return HeartbeatAggregate(t, e, p, out, batch);
+    }
+    default:
+      c.Fail("event of unknown type " + to_string(int(type)));
+      return Up(t, e);
+  }
+}
+
+string Event::Description() const {
+  switch(header_.type_) {
+    case UP: return up_.Description();
+    case DOWN: return down_.Description();
+    case LINK_UP: return link_up_.Description();
+    case LINK_DOWN: return link_down_.Description();
+    case INITIATE_HEARTBEAT: return initiate_heartbeat_.Description();
+    case HEARTBEAT: return heartbeat_.Description();
+    case LINK_STATE_UPDATE: return link_state_update_.Description();
+    case INITIATE_LINK_STATE: return initiate_link_state_.Description();
+    case COMPUTE_ROUTES: return compute_routes_.Description();
+    case HEARTBEAT_FLOOD: return heartbeat_flood_.Description();
+    case LINK_STATE_FLOOD: return link_state_flood_.Description();
+    case INITIATE_GOSSIP: return initiate_gossip_.Description();
+    case GOSSIP: return gossip_.Description();
+    case FLUSH_HEARTBEATS: return flush_heartbeats_.Description();
+    case HEARTBEAT_AGGREGATE: return heartbeat_aggregate_.Description();
+    default: return DescribeHeader(header_.time_, header_.affected_entity_);
+  }
+}
+
+string Event::Name() const {
+  switch(header_.type_) {
+    case UP: return up_.Name();
+    case DOWN: return down_.Name();
+    case LINK_UP: return link_up_.Name();
+    case LINK_DOWN: return link_down_.Name();
+    case INITIATE_HEARTBEAT: return initiate_heartbeat_.Name();
+    case HEARTBEAT: return heartbeat_.Name();
+    case LINK_STATE_UPDATE: return link_state_update_.Name();
+    case INITIATE_LINK_STATE: return initiate_link_state_.Name();
+    case COMPUTE_ROUTES: return compute_routes_.Name();
+    case HEARTBEAT_FLOOD: return heartbeat_flood_.Name();
+    case LINK_STATE_FLOOD: return link_state_flood_.Name();
+    case INITIATE_GOSSIP: return initiate_gossip_.Name();
+    case GOSSIP: return gossip_.Name();
+    case FLUSH_HEARTBEATS: return flush_heartbeats_.Name();
+    case HEARTBEAT_AGGREGATE: return heartbeat_aggregate_.Name();
+    default: return "Event";
+  }
+}
+
+Size Event::size() const {
+  switch(header_.type_) {
+    case HEARTBEAT: return heartbeat_.size();
+    case LINK_STATE_UPDATE: return link_state_update_.size();
+    case HEARTBEAT_FLOOD: return heartbeat_flood_.size();
+    case LINK_STATE_FLOOD: return link_state_flood_.size();
+    case GOSSIP: return gossip_.size();
+    case HEARTBEAT_AGGREGATE: return heartbeat_aggregate_.size();
+    default: return 0;
+  }
+}
+
+/* The number of messages the event puts on links */
+unsigned int Event::Copies() const {
+  switch(header_.type_) {
+    case HEARTBEAT: case LINK_STATE_UPDATE: case GOSSIP:
+    case HEARTBEAT_AGGREGATE:
+      return 1;
+    case HEARTBEAT_FLOOD: return CountPorts(heartbeat_flood_.ports_);
+    case LINK_STATE_FLOOD: return CountPorts(link_state_flood_.ports_);
+    default: return 0;
+  }
+}
+
 OVERLOAD_EVENT_OSTREAM_IMPL(Event)
 OVERLOAD_EVENT_OSTREAM_IMPL(Up)
 OVERLOAD_EVENT_OSTREAM_IMPL(Down)
 OVERLOAD_EVENT_OSTREAM_IMPL(LinkUp)
 OVERLOAD_EVENT_OSTREAM_IMPL(LinkDown)
 OVERLOAD_EVENT_OSTREAM_IMPL(InitiateHeartbeat)
-OVERLOAD_EVENT_OSTREAM_IMPL(Broadcast)
 OVERLOAD_EVENT_OSTREAM_IMPL(Heartbeat)
 OVERLOAD_EVENT_OSTREAM_IMPL(LinkStateUpdate)
 OVERLOAD_EVENT_OSTREAM_IMPL(InitiateLinkState)
+OVERLOAD_EVENT_OSTREAM_IMPL(ComputeRoutes)
+OVERLOAD_EVENT_OSTREAM_IMPL(HeartbeatFlood)
+OVERLOAD_EVENT_OSTREAM_IMPL(LinkStateFlood)
+OVERLOAD_EVENT_OSTREAM_IMPL(InitiateGossip)
+OVERLOAD_EVENT_OSTREAM_IMPL(Gossip)
+OVERLOAD_EVENT_OSTREAM_IMPL(FlushHeartbeats)
+OVERLOAD_EVENT_OSTREAM_IMPL(HeartbeatAggregate)
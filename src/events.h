@@ -1,10 +1,12 @@
 #ifndef DDCSIM_EVENTS_H_
 #define DDCSIM_EVENTS_H_
 
+#include <inttypes.h>
 #include <iostream>
 #include <string>
 #include <vector>
 
+#include "bv.h"
 #include "common.h"
 
 // TODO do this with templates as we are essentially attempting to generate
@@ -17,145 +19,375 @@
 #define OVERLOAD_EVENT_OSTREAM_DECL(event_type)                 \
   std::ostream& operator<<(std::ostream&, const event_type &);
 
+class Checkpoint;
 class Entity;
 
-class Event {
- public:
-  Event(Time, Entity*);
-  Event(Time, Entity*, Entity*);
-  /* The following Handle method, and the Handle methods in all descendants
-   * of Event, implement the pattern outlined here:
-   * http://en.wikipedia.org/wiki/Double_dispatch#Double_dispatch_in_C.2B.2B
-   * in order to implement double dispatch.
-   */
-  virtual void Handle(Entity*);
-  virtual std::string Description() const;
-  virtual std::string Name() const;
-  // TODO remove this eventually and factor into a packettx superclass
-  virtual Size size() const;
-  const Time time_;
-  const std::vector<Entity*> affected_entities_;
+/* Events are plain values rather than a class hierarchy so that the
+ * scheduler can store them directly in its queue without allocating each one
+ * on the heap.  Every kind of event is a struct that begins with the members
+ * of EventHeader, in the same order, and Event is the union of all of them.
+ * The common initial sequence lets the header (and in particular the type_
+ * tag) be read through any member, so Event::Handle can dispatch on the tag
+ * with a single switch instead of the two virtual calls that double dispatch
+ * needed.
+ */
+enum EventType : unsigned char {
+  UP,
+  DOWN,
+  LINK_UP,
+  LINK_DOWN,
+  INITIATE_HEARTBEAT,
+  HEARTBEAT,
+  LINK_STATE_UPDATE,
+  INITIATE_LINK_STATE,
+  COMPUTE_ROUTES,
+  HEARTBEAT_FLOOD,
+  LINK_STATE_FLOOD,
+  INITIATE_GOSSIP,
+  GOSSIP,
+  FLUSH_HEARTBEATS,
+  HEARTBEAT_AGGREGATE
+};
+
+/* Bit i of a PortMask stands for port first_port_ + i of the sending entity */
+typedef uint64_t PortMask;
+const Port kFloodWidth = 64;
 
- private:
-  DISALLOW_COPY_AND_ASSIGN(Event);
+struct EventHeader {
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
 };
 
-class Up : public Event {
- public:
+struct Up {
   Up(Time, Entity*);
-  virtual void Handle(Entity*);
-  // TODO is virtual here redundant?
-  virtual std::string Description() const;
-  virtual std::string Name() const;
-
- private:
-  // TODO need disallow in derived classes?
-  DISALLOW_COPY_AND_ASSIGN(Up);
+  std::string Description() const;
+  std::string Name() const;
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
 };
 
-class Down : public Event {
- public:
+struct Down {
   Down(Time, Entity*);
-  virtual void Handle(Entity*);
-  virtual std::string Description() const;
-  virtual std::string Name() const;
-
- private:
-  DISALLOW_COPY_AND_ASSIGN(Down);
+  std::string Description() const;
+  std::string Name() const;
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
 };
 
-class LinkUp : public Event {
- public:
+struct LinkUp {
   LinkUp(Time, Entity*, Port);
-  virtual void Handle(Entity*);
-  virtual std::string Description() const;
-  virtual std::string Name() const;
-  const Port out_;
-
- private:
-  DISALLOW_COPY_AND_ASSIGN(LinkUp);
+  std::string Description() const;
+  std::string Name() const;
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
+  Port out_;
 };
 
-class LinkDown : public Event {
- public:
+struct LinkDown {
   LinkDown(Time, Entity*, Port);
-  virtual void Handle(Entity*);
-  virtual std::string Description() const;
-  virtual std::string Name() const;
-  const Port out_;
-
- private:
-  DISALLOW_COPY_AND_ASSIGN(LinkDown);
+  std::string Description() const;
+  std::string Name() const;
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
+  Port out_;
 };
 
-class InitiateHeartbeat : public Event {
- public:
+struct InitiateHeartbeat {
   InitiateHeartbeat(Time, Entity*);
-  virtual void Handle(Entity*);
-  virtual std::string Description() const;
-  virtual std::string Name() const;
-
- private:
-  DISALLOW_COPY_AND_ASSIGN(InitiateHeartbeat);
+  std::string Description() const;
+  std::string Name() const;
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
 };
 
-class Broadcast : public Event {
- public:
-  Broadcast(Time, Entity*, Port);
-  virtual void Handle(Entity*);
-  virtual std::string Description() const;
-  virtual std::string Name() const;
-  virtual Size size() const;
-  const Port in_port_;
-
- private:
-  DISALLOW_COPY_AND_ASSIGN(Broadcast);
+/* How a heartbeat is forwarded.  FLOOD sends it out of every port, as when
+ * no spanning tree is kept.  TREE only sends it along the spanning tree, and
+ * TREE_REPAIR marks a heartbeat that passed an entity whose part of the tree
+ * was broken, which every entity after it floods out of every port again.
+ */
+enum Dissemination : unsigned char {
+  FLOOD,
+  TREE,
+  TREE_REPAIR
 };
 
-class Heartbeat : public Broadcast {
- public:
+/* Every copy of a heartbeat holds a reference to its recently seen vector,
+ * which is released by Event::Release once the copy has been handled.
+ * tree_parent_ is the source's parent in the spanning tree, through which
+ * the source's neighbors learn whether they are its parent.  period_ is the
+ * time until the source's next heartbeat when the source adapts its period,
+ * and 0 when it keeps the fixed one.  A controller that elects leaders puts
+ * the partition it is in, named by the smallest id in it, and that
+ * partition's leader in its heartbeats; other heartbeats have no leader_.
+ */
+struct Heartbeat {
   Heartbeat(Time, const Entity*, Entity*, Port, SequenceNum, BV);
-  ~Heartbeat();
-  virtual void Handle(Entity*);
-  virtual std::string Description() const;
-  virtual std::string Name() const;
-  virtual Size size() const;
-  const SequenceNum sn_;
+  std::string Description() const;
+  std::string Name() const;
+  Size size() const;
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
+  Port in_port_;
+  SequenceNum sn_;
   const Entity* src_; // TODO better to change to a ref?
-  const BV recently_seen_;
-  const unsigned int current_partition_;
-  const Id leader_;
+  BV recently_seen_;
+  unsigned int current_partition_;
+  Id leader_;
+  Dissemination dissemination_;
+  Id tree_parent_;
+  Time period_;
+};
+
+/* A complete advertisement lists every up neighbor of its source.  A delta
+ * only lists the neighbors added and removed since the source's advertisement
+ * with sequence number base_sn_, and a refresh is a delta without changes.
+ * Receivers can only apply a delta to a row that reflects its base.
+ */
+enum AdvertisementKind : unsigned char {
+  FULL_ADVERTISEMENT,
+  DELTA_ADVERTISEMENT,
+  REFRESH_ADVERTISEMENT
+};
 
- private:
-  DISALLOW_COPY_AND_ASSIGN(Heartbeat);
+/* Link state advertisements are flooded unchanged, so all of the copies of
+ * one share a single reference counted advertisement.  Every kind keeps the
+ * source's complete neighbor list so that the source can compute its next
+ * delta from it; only the complete kind puts that list on the wire.
+ */
+struct Advertisement {
+  static Advertisement* Full(const std::vector<Id>&, unsigned int);
+  static Advertisement* Delta(const std::vector<Id>&, unsigned int,
+                              SequenceNum);
+  Size size() const;
+  std::string Description() const;
+  std::vector<Id> neighbors_;
+  unsigned int ref_count_;
+  AdvertisementKind kind_;
+  SequenceNum base_sn_;
+  std::vector<Id> added_;
+  std::vector<Id> removed_;
 };
 
-class LinkStateUpdate : public Broadcast {
- public:
+void ReleaseAdvertisement(Advertisement*);
+
+struct LinkStateUpdate {
+  LinkStateUpdate(Time, Entity*, Port, const Entity*, SequenceNum,
+                  const std::vector<Id>&, Time);
   LinkStateUpdate(Time, Entity*, Port, const Entity*, SequenceNum,
-                  std::vector<Id>, Time);
-  virtual void Handle(Entity*);
-  virtual std::string Description() const;
-  virtual std::string Name() const;
-  virtual Size size() const;
-  const SequenceNum sn_;
+                  Advertisement*, Time);
+  std::string Description() const;
+  std::string Name() const;
+  Size size() const;
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
+  Port in_port_;
+  SequenceNum sn_;
   const Entity* src_;
-  const std::vector<Id> neighbors_;
-  const Time expiration_;
-
- private:
-  DISALLOW_COPY_AND_ASSIGN(LinkStateUpdate);
+  Advertisement* advertisement_;
+  Time expiration_;
 };
 
-class InitiateLinkState : public Event {
- public:
+struct InitiateLinkState {
   InitiateLinkState(Time, Entity*);
-  virtual void Handle(Entity*);
-  virtual std::string Description() const;
-  virtual std::string Name() const;
+  std::string Description() const;
+  std::string Name() const;
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
+};
+
+struct ComputeRoutes {
+  ComputeRoutes(Time, Entity*);
+  std::string Description() const;
+  std::string Name() const;
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
+};
+
+struct InitiateGossip {
+  InitiateGossip(Time, Entity*);
+  std::string Description() const;
+  std::string Name() const;
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
+};
+
+/* A digest is an entity's summary of liveness: the sequence number of the
+ * latest heartbeat it knows of for every entity, or NONE_SEQNUM for those it
+ * has not heard of.  The copies sent to the neighbors picked in one gossip
+ * round share a single reference counted digest.
+ */
+struct Digest {
+  std::vector<SequenceNum> latest_;
+  unsigned int num_known_;
+  unsigned int ref_count_;
+};
 
- private:
-  DISALLOW_COPY_AND_ASSIGN(InitiateLinkState);
+void ReleaseDigest(Digest*);
+
+struct Gossip {
+  Gossip(Time, Entity*, Port, const Entity*, Digest*);
+  std::string Description() const;
+  std::string Name() const;
+  Size size() const;
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
+  Port in_port_;
+  const Entity* src_;
+  Digest* digest_;
+};
+
+struct FlushHeartbeats {
+  FlushHeartbeats(Time, Entity*);
+  std::string Description() const;
+  std::string Name() const;
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
+};
+
+/* One of the heartbeats a switch has held back to send along with others.
+ * in_port_ is the switch's port it arrived on, or PORT_NOT_FOUND for the
+ * switch's own.  The entry holds a reference to the recently seen vector.
+ */
+struct BatchEntry {
+  const Entity* src_;
+  SequenceNum sn_;
+  BV recently_seen_;
+  Port in_port_;
+  unsigned int current_partition_;
+  Id leader_;
+};
+
+/* The heartbeats a switch held back during one hold window.  The aggregate
+ * sent out of each port shares the batch and leaves out the entries that
+ * arrived on that port.
+ */
+struct HeartbeatBatch {
+  Size EntriesSize(Port) const;
+  unsigned int CountEntries(Port) const;
+  std::vector<BatchEntry> entries_;
+  unsigned int ref_count_;
+};
+
+void ReleaseRecentlySeen(BV&);
+void ReleaseHeartbeatBatch(HeartbeatBatch*);
+
+/* out_port_ is the sender's port the aggregate was sent out of */
+struct HeartbeatAggregate {
+  HeartbeatAggregate(Time, Entity*, Port, Port, HeartbeatBatch*);
+  std::string Description() const;
+  std::string Name() const;
+  Size size() const;
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
+  Port in_port_;
+  Port out_port_;
+  HeartbeatBatch* batch_;
+};
+
+/* A flood stands for the copies of a heartbeat or link state update that an
+ * entity sends out of several ports at once.  Since every copy is delivered
+ * at the same time, the scheduler queues a single flood and expands it into
+ * the individual deliveries when it is dequeued.  The ports are those that
+ * were up when the flood was sent; affected_entity_ is the sender.
+ */
+struct HeartbeatFlood {
+  HeartbeatFlood(Time, Entity*, Port, PortMask, const Entity*, SequenceNum,
+                 BV);
+  std::string Description() const;
+  std::string Name() const;
+  Size size() const;
+  unsigned int Deliver() const;
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
+  Port first_port_;
+  PortMask ports_;
+  SequenceNum sn_;
+  const Entity* src_;
+  BV recently_seen_;
+  unsigned int current_partition_;
+  Id leader_;
+  Dissemination dissemination_;
+  Id tree_parent_;
+  Time period_;
+};
+
+struct LinkStateFlood {
+  LinkStateFlood(Time, Entity*, Port, PortMask, const Entity*, SequenceNum,
+                 Advertisement*, Time);
+  std::string Description() const;
+  std::string Name() const;
+  Size size() const;
+  unsigned int Deliver() const;
+  EventType type_;
+  Time time_;
+  Entity* affected_entity_;
+  Port first_port_;
+  PortMask ports_;
+  SequenceNum sn_;
+  const Entity* src_;
+  Advertisement* advertisement_;
+  Time expiration_;
+};
+
+union Event {
+  Event(const Up&);
+  Event(const Down&);
+  Event(const LinkUp&);
+  Event(const LinkDown&);
+  Event(const InitiateHeartbeat&);
+  Event(const Heartbeat&);
+  Event(const LinkStateUpdate&);
+  Event(const InitiateLinkState&);
+  Event(const ComputeRoutes&);
+  Event(const HeartbeatFlood&);
+  Event(const LinkStateFlood&);
+  Event(const InitiateGossip&);
+  Event(const Gossip&);
+  Event(const FlushHeartbeats&);
+  Event(const HeartbeatAggregate&);
+  unsigned int Handle();
+  void Release();
+  void Save(Checkpoint&) const;
+  static Event Restore(Checkpoint&);
+  std::string Description() const;
+  std::string Name() const;
+  // TODO remove this eventually and factor into a packettx superclass
+  Size size() const;
+  unsigned int Copies() const;
+  EventType type() const { return header_.type_; }
+  Time time() const { return header_.time_; }
+  Entity* affected_entity() const { return header_.affected_entity_; }
+  EventHeader header_;
+  Up up_;
+  Down down_;
+  LinkUp link_up_;
+  LinkDown link_down_;
+  InitiateHeartbeat initiate_heartbeat_;
+  Heartbeat heartbeat_;
+  LinkStateUpdate link_state_update_;
+  InitiateLinkState initiate_link_state_;
+  ComputeRoutes compute_routes_;
+  HeartbeatFlood heartbeat_flood_;
+  LinkStateFlood link_state_flood_;
+  InitiateGossip initiate_gossip_;
+  Gossip gossip_;
+  FlushHeartbeats flush_heartbeats_;
+  HeartbeatAggregate heartbeat_aggregate_;
 };
 
 OVERLOAD_EVENT_OSTREAM_DECL(Event)
@@ -164,9 +396,15 @@ OVERLOAD_EVENT_OSTREAM_DECL(Down)
 OVERLOAD_EVENT_OSTREAM_DECL(LinkUp)
 OVERLOAD_EVENT_OSTREAM_DECL(LinkDown)
 OVERLOAD_EVENT_OSTREAM_DECL(InitiateHeartbeat)
-OVERLOAD_EVENT_OSTREAM_DECL(Broadcast)
 OVERLOAD_EVENT_OSTREAM_DECL(Heartbeat)
 OVERLOAD_EVENT_OSTREAM_DECL(LinkStateUpdate)
 OVERLOAD_EVENT_OSTREAM_DECL(InitiateLinkState)
+OVERLOAD_EVENT_OSTREAM_DECL(ComputeRoutes)
+OVERLOAD_EVENT_OSTREAM_DECL(HeartbeatFlood)
+OVERLOAD_EVENT_OSTREAM_DECL(LinkStateFlood)
+OVERLOAD_EVENT_OSTREAM_DECL(InitiateGossip)
+OVERLOAD_EVENT_OSTREAM_DECL(Gossip)
+OVERLOAD_EVENT_OSTREAM_DECL(FlushHeartbeats)
+OVERLOAD_EVENT_OSTREAM_DECL(HeartbeatAggregate)
 
 #endif
@@ -0,0 +1,231 @@
+#include "job_pool.h"
+
+#include <glog/logging.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <numeric>
+
+using std::iota;
+using std::max;
+using std::stable_sort;
+using std::string;
+using std::vector;
+
+const int JobPool::kParent = -1;
+
+/* The progress of all jobs is logged every time another 5% of it is done */
+const Time JobPool::kProgressGranularity = 0.05;
+
+/* The memory limit is in bytes and applies to the whole address space of a
+ * child, including the state that it is forked with; 0 leaves it unlimited.
+ */
+JobPool::JobPool(unsigned int num_workers, unsigned long memory_limit)
+    : num_workers_(num_workers), memory_limit_(memory_limit), jobs_(),
+      queue_(), running_(num_workers, -1), next_milestone_(1), progress_fd_(-1) {
+  CHECK_GT(num_workers_, 0);
+}
+
+/* Jobs are numbered in the order in which they are added.  The cost of a job
+ * only needs to be proportional to the time that it is expected to take.
+ */
+unsigned int JobPool::Add(const string& name, double cost) {
+  CHECK_GE(cost, 0);
+  jobs_.push_back(Job(name, cost));
+  return jobs_.size() - 1;
+}
+
+/* Returns the number of the job that a child should go on to run.  The pool
+ * gets kParent back once every child has exited, along with whether they all
+ * succeeded.
+ */
+int JobPool::Run(bool& all_succeeded) {
+  all_succeeded = true;
+  Deal();
+
+  while(true) {
+    for(unsigned int worker = 0; worker < num_workers_; ++worker) {
+      while(running_[worker] < 0) {
+        int job = Take();
+        if(job < 0) break;
+        if(Start(worker, job, all_succeeded)) return job;
+      }
+    }
+
+    vector<pollfd> fds;
+    vector<unsigned int> workers;
+    for(unsigned int worker = 0; worker < num_workers_; ++worker) {
+      if(running_[worker] < 0) continue;
+      fds.push_back({jobs_[running_[worker]].fd_, POLLIN, 0});
+      workers.push_back(worker);
+    }
+    if(fds.empty()) break;
+
+    if(poll(fds.data(), fds.size(), -1) < 0) {
+      if(errno == EINTR) continue;
+      LOG(ERROR) << "Could not wait for the running jobs";
+      all_succeeded = false;
+      break;
+    }
+
+    for(unsigned int i = 0; i < fds.size(); ++i) {
+      if(fds[i].revents == 0) continue;
+      if(!ReadProgress(jobs_[running_[workers[i]]]))
+        Collect(workers[i], all_succeeded);
+    }
+
+    LogProgress();
+  }
+
+  return kParent;
+}
+
+/* Called by a child at each milestone of its job, with the fraction of the
+ * job done.  A report that cannot be written is only lost.
+ */
+void JobPool::ReportProgress(Time fraction) const {
+  if(progress_fd_ < 0) return;
+  ssize_t written = write(progress_fd_, &fraction, sizeof(fraction));
+  (void) written;
+}
+
+/* Queues the jobs longest first, keeping the order in which they were added
+ * among jobs of the same cost.
+ */
+void JobPool::Deal() {
+  vector<unsigned int> order(jobs_.size());
+  iota(order.begin(), order.end(), 0);
+  stable_sort(order.begin(), order.end(),
+              [&](unsigned int lhs, unsigned int rhs) {
+                return jobs_[lhs].cost_ > jobs_[rhs].cost_;
+              });
+
+  for(unsigned int job : order)
+    queue_.push(job);
+}
+
+/* Returns the next job to run, or -1 once the queue is empty */
+int JobPool::Take() {
+  if(queue_.empty()) return -1;
+  unsigned int job = queue_.front();
+  queue_.pop();
+  return job;
+}
+
+/* Forks a child for the job on the worker.  Returns true in the child, which
+ * keeps only the write end of its own pipe.
+ */
+bool JobPool::Start(unsigned int worker, unsigned int index,
+                    bool& all_succeeded) {
+  Job& job = jobs_[index];
+  int fds[2];
+
+  if(pipe(fds) != 0) {
+    LOG(ERROR) << "Could not create a pipe for " << job.name_;
+    all_succeeded = false;
+    job.progress_ = 1;
+    return false;
+  }
+
+  pid_t pid = fork();
+
+  if(pid == 0) {
+    close(fds[0]);
+    for(int running : running_)
+      if(running >= 0) close(jobs_[running].fd_);
+    progress_fd_ = fds[1];
+
+    if(memory_limit_ > 0) {
+      rlimit limit = {memory_limit_, memory_limit_};
+      if(setrlimit(RLIMIT_AS, &limit) != 0)
+        LOG(ERROR) << "Could not limit the memory of " << job.name_;
+    }
+
+    return true;
+  }
+
+  close(fds[1]);
+
+  if(pid < 0) {
+    close(fds[0]);
+    LOG(ERROR) << "Could not fork " << job.name_;
+    all_succeeded = false;
+    job.progress_ = 1;
+    return false;
+  }
+
+  job.pid_ = pid;
+  job.fd_ = fds[0];
+  running_[worker] = index;
+  return false;
+}
+
+/* Reaps the child running on the worker, whose pipe has been closed */
+void JobPool::Collect(unsigned int worker, bool& all_succeeded) {
+  Job& job = jobs_[running_[worker]];
+  int status;
+  pid_t pid;
+
+  close(job.fd_);
+  do {
+    pid = waitpid(job.pid_, &status, 0);
+  } while(pid < 0 && errno == EINTR);
+
+  if(pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    LOG(ERROR) << job.name_ << " failed";
+    all_succeeded = false;
+  }
+
+  job.progress_ = 1;
+  job.pid_ = -1;
+  job.fd_ = -1;
+  running_[worker] = -1;
+}
+
+/* Returns false once the child has closed its pipe.  Reports are written
+ * whole, being far shorter than PIPE_BUF, so a read never ends within one.
+ */
+bool JobPool::ReadProgress(Job& job) {
+  Time reports[64];
+  ssize_t num_read;
+
+  do {
+    num_read = read(job.fd_, reports, sizeof(reports));
+  } while(num_read < 0 && errno == EINTR);
+
+  if(num_read <= 0) return false;
+
+  unsigned long num_reports = num_read / sizeof(Time);
+  if(num_reports > 0)
+    job.progress_ = max(job.progress_, reports[num_reports - 1]);
+  return true;
+}
+
+/* Each job counts in proportion to its cost, or equally with the others if
+ * none has any.
+ */
+void JobPool::LogProgress() {
+  double total = 0, done = 0;
+  for(const Job& job : jobs_) {
+    total += job.cost_;
+    done += job.cost_ * job.progress_;
+  }
+  if(total == 0) {
+    for(const Job& job : jobs_) {
+      total += 1;
+      done += job.progress_;
+    }
+  }
+  if(total == 0) return;
+
+  Time progress = done / total;
+  while(next_milestone_ * kProgressGranularity <= progress) {
+    LOG(WARNING) << "Progress of all jobs: "
+                 << (next_milestone_ * kProgressGranularity * 100) << "%";
+    ++next_milestone_;
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef DDCSIM_JOB_POOL_H_
+#define DDCSIM_JOB_POOL_H_
+
+#include <sys/types.h>
+
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+/* Runs independent jobs, such as the scenarios forked from a warmed up
+ * simulation, on a fixed number of workers.  The simulation is not safe to
+ * share between threads, so each job runs in a child process forked from the
+ * caller and starts from its state without copying it up front.  A worker
+ * runs one child at a time, which bounds the number of jobs in flight, and
+ * each child may additionally be held to a limit on its address space.
+ *
+ * Jobs may take very different times, so they wait in a single queue,
+ * longest first, and a worker takes the next one as soon as it is free.  The
+ * pool forks every child itself, so there is nothing for workers to steal
+ * from each other: no worker idles while jobs are left, and the long ones
+ * are never left until last.
+ *
+ * A child reports each milestone of its simulation to the pool through a
+ * pipe of its own, and the pool logs the progress of all its jobs together,
+ * weighted by their expected costs.  The end of the pipe also tells the pool
+ * when the child has exited.
+ */
+class JobPool {
+ public:
+  JobPool(unsigned int, unsigned long);
+  unsigned int Add(const std::string&, double);
+  int Run(bool&);
+  void ReportProgress(Time) const;
+  static const int kParent;
+  static const Time kProgressGranularity;
+
+ private:
+  struct Job {
+    Job(const std::string& name, double cost)
+        : name_(name), cost_(cost), progress_(0), pid_(-1), fd_(-1) {}
+    std::string name_;
+    double cost_;
+    Time progress_;
+    pid_t pid_;
+    int fd_;
+  };
+
+  void Deal();
+  int Take();
+  bool Start(unsigned int, unsigned int, bool&);
+  void Collect(unsigned int, bool&);
+  bool ReadProgress(Job&);
+  void LogProgress();
+  unsigned int num_workers_;
+  unsigned long memory_limit_;
+  std::vector<Job> jobs_;
+  std::queue<unsigned int> queue_;
+  std::vector<int> running_;
+  unsigned int next_milestone_;
+  int progress_fd_;
+  DISALLOW_COPY_AND_ASSIGN(JobPool);
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "links.h"
+#include "checkpoint.h"
 #include "entities.h"
 
 #include <algorithm>
@@ -27,15 +28,33 @@ void BandwidthMeter::UpdateCapacity(Time t) {
 
 void BandwidthMeter::Send(Size s) { cur_capacity_-= s; }
 
+/* The bucket's capacity and fill rate come from the command line, so only its
+ * current level is saved.
+ */
+void BandwidthMeter::Save(Checkpoint& c) const { c.Write(cur_capacity_); }
+
+void BandwidthMeter::Restore(Checkpoint& c) { c.Read(cur_capacity_); }
+
 const Size BandwidthMeter::kDefaultCapacity = numeric_limits<Size>::max();
 
 const Rate BandwidthMeter::kDefaultRate = numeric_limits<Rate>::max();
 
-Links::Links() : port_to_link_() {}
+Links::Links() : port_to_link_(), up_neighbors_() {}
+
+void Links::SetLinkUp(Port p) {
+  if(port_to_link_[p].is_up) return;
 
-void Links::SetLinkUp(Port p) { port_to_link_[p].is_up = true; }
+  up_neighbors_.insert(up_neighbors_.begin() + CountUpBefore(p),
+                       port_to_link_[p].endpoint->id());
+  port_to_link_[p].is_up = true;
+}
+
+void Links::SetLinkDown(Port p) {
+  if(!port_to_link_[p].is_up) return;
 
-void Links::SetLinkDown(Port p) { port_to_link_[p].is_up = false; }
+  up_neighbors_.erase(up_neighbors_.begin() + CountUpBefore(p));
+  port_to_link_[p].is_up = false;
+}
 
 void Links::UpdateCapacities(Time passed) {
   for(auto it = port_to_link_.begin(); it != port_to_link_.end(); ++it)
@@ -46,7 +65,7 @@ bool Links::IsLinkUp(Port p) const { return port_to_link_[p].is_up; }
 
 Entity* Links::GetEndpoint(Port p) const { return port_to_link_[p].endpoint; }
 
-Port Links::GetPortTo(Entity* dst) {
+Port Links::GetPortTo(const Entity* dst) const {
   for(Port p = 0; p < PortCount(); ++p)
     if(port_to_link_[p].endpoint == dst)
       return p;
@@ -54,3 +73,49 @@ Port Links::GetPortTo(Entity* dst) {
 }
 
 unsigned int Links::PortCount() const { return port_to_link_.size(); }
+
+const vector<Id>& Links::UpNeighbors() const { return up_neighbors_; }
+
+/* The index in up_neighbors_ of the link on port p, if it is up */
+unsigned int Links::CountUpBefore(Port p) const {
+  unsigned int count = 0;
+
+  for(Port q = 0; q < p; ++q)
+    if(port_to_link_[q].is_up)
+      ++count;
+
+  return count;
+}
+
+void Links::RebuildUpNeighbors() {
+  up_neighbors_.clear();
+
+  for(const Link& l : port_to_link_)
+    if(l.is_up)
+      up_neighbors_.push_back(l.endpoint->id());
+}
+
+void Links::Save(Checkpoint& c) const {
+  c.Write<uint32_t>(port_to_link_.size());
+  for(const Link& l : port_to_link_) {
+    c.Write(l.is_up);
+    l.meter.Save(c);
+  }
+}
+
+void Links::Restore(Checkpoint& c) {
+  uint32_t num_ports = 0;
+  c.Read(num_ports);
+
+  if(num_ports != port_to_link_.size()) {
+    c.Fail("entity has a different number of ports in the topology");
+    return;
+  }
+
+  for(Link& l : port_to_link_) {
+    c.Read(l.is_up);
+    l.meter.Restore(c);
+  }
+
+  RebuildUpNeighbors();
+}
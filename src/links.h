@@ -8,6 +8,7 @@
 #include "reader.h"
 #include "scheduler.h"
 
+class Checkpoint;
 class Entity;
 class Statistics;
 
@@ -18,6 +19,8 @@ class BandwidthMeter {
   bool CanSend(Size);
   void UpdateCapacity(Time);
   void Send(Size);
+  void Save(Checkpoint&) const;
+  void Restore(Checkpoint&);
   /*
    * Unless the user specifies bandwidth restrictions, bandwidth is
    * "unlimited".
@@ -48,6 +51,7 @@ class Links {
     for ( ; neighbors_begin != neighbors_end; ++neighbors_begin)
       port_to_link_.push_back(
           {true, *neighbors_begin, BandwidthMeter(capacity, fill)});
+    RebuildUpNeighbors();
   }
   void SetLinkUp(Port);
   void SetLinkDown(Port);
@@ -55,13 +59,20 @@ class Links {
   unsigned int PortCount() const;
   bool IsLinkUp(Port) const;
   Entity* GetEndpoint(Port) const;
-
-  template<class E, class M> friend void Scheduler::Forward(E* sender, M* msg_in, Port out, Statistics&);
-  friend bool Reader::ParseEvents();
+  Port GetPortTo(const Entity*) const;
+  const std::vector<Id>& UpNeighbors() const;
+  void Save(Checkpoint&) const;
+  void Restore(Checkpoint&);
 
  private:
-  Port GetPortTo(Entity*);
+  unsigned int CountUpBefore(Port) const;
+  void RebuildUpNeighbors();
   std::vector<Link> port_to_link_;
+  /* The ids of the endpoints of the links that are up, in port order.  It is
+   * kept up to date as links go up and down rather than recomputed by every
+   * link state origination.
+   */
+  std::vector<Id> up_neighbors_;
   DISALLOW_COPY_AND_ASSIGN(Links);
 };
 
@@ -0,0 +1,557 @@
+#include "partitioner.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <queue>
+#include <set>
+#include <sstream>
+#include <utility>
+
+using std::default_random_engine;
+using std::greater;
+using std::max;
+using std::min;
+using std::ofstream;
+using std::ostringstream;
+using std::pair;
+using std::queue;
+using std::set;
+using std::string;
+using std::vector;
+
+const string Partitioner::ASSIGNMENT_FILE_NAME = "assignment.txt";
+
+/* The most that the load of a part may exceed its share by, as a ratio */
+const double Partitioner::kMaxImbalance = 1.03;
+
+namespace {
+
+/* Coarsening stops once a graph has this few vertices, or once merging
+ * removes fewer than kMinShrink of them.
+ */
+const unsigned int kCoarsestSize = 64;
+const double kMinShrink = 0.05;
+
+/* The coarsest graph is split from this many seeds and the best is kept */
+const unsigned int kInitialTries = 4;
+
+/* A refinement pass gives up after this many moves that do not improve the
+ * cut, and refinement after this many passes.
+ */
+const unsigned int kMaxFruitlessMoves = 64;
+const unsigned int kMaxRefinePasses = 8;
+
+/* Vertices stand for sets of entities and edges for the links between them,
+ * weighted by load and by number of links respectively.  sizes_ counts the
+ * entities of each vertex.
+ */
+struct WeightedGraph {
+  unsigned int size() const { return weights_.size(); }
+  unsigned long TotalWeight() const;
+  unsigned long MaxWeight() const;
+  unsigned long TotalSize() const;
+  vector<unsigned long> weights_;
+  vector<unsigned long> sizes_;
+  vector<vector<pair<unsigned int, unsigned long> > > edges_;
+};
+
+unsigned long WeightedGraph::TotalWeight() const {
+  unsigned long total = 0;
+  for(unsigned long w : weights_)
+    total += w;
+  return total;
+}
+
+unsigned long WeightedGraph::MaxWeight() const {
+  unsigned long heaviest = 0;
+  for(unsigned long w : weights_)
+    heaviest = max(heaviest, w);
+  return heaviest;
+}
+
+unsigned long WeightedGraph::TotalSize() const {
+  unsigned long total = 0;
+  for(unsigned long n : sizes_)
+    total += n;
+  return total;
+}
+
+/* Sides are 0 and 1 */
+typedef vector<unsigned char> Sides;
+
+unsigned long CutWeight(const WeightedGraph& g, const Sides& side) {
+  unsigned long cut = 0;
+  for(unsigned int v = 0; v < g.size(); ++v)
+    for(auto& e : g.edges_[v])
+      if(side[v] != side[e.first]) cut += e.second;
+  return cut / 2;
+}
+
+/* Matches every vertex, in random order, with the unmatched neighbor that it
+ * shares the heaviest edge with, preferring lighter neighbors on ties, and
+ * merges each pair into one vertex of coarse.  Pairs that would outweigh a
+ * share of the coarsest graph are not merged, so that it can still be
+ * balanced.
+ */
+void Coarsen(const WeightedGraph& fine, WeightedGraph& coarse,
+             vector<unsigned int>& fine_to_coarse,
+             default_random_engine& entropy_src) {
+  const unsigned int kUnmatched = fine.size();
+  unsigned long max_weight = 1.5 * fine.TotalWeight() / kCoarsestSize + 1;
+
+  vector<unsigned int> order(fine.size());
+  for(unsigned int v = 0; v < fine.size(); ++v)
+    order[v] = v;
+  std::shuffle(order.begin(), order.end(), entropy_src);
+
+  vector<unsigned int> match(fine.size(), kUnmatched);
+  for(unsigned int v : order) {
+    if(match[v] != kUnmatched) continue;
+
+    unsigned int best = v;
+    unsigned long best_edge = 0;
+    for(auto& e : fine.edges_[v]) {
+      unsigned int u = e.first;
+      if(match[u] != kUnmatched ||
+         fine.weights_[u] + fine.weights_[v] > max_weight)
+        continue;
+      if(e.second > best_edge ||
+         (e.second == best_edge && best != v &&
+          fine.weights_[u] < fine.weights_[best])) {
+        best = u;
+        best_edge = e.second;
+      }
+    }
+    match[v] = best;
+    match[best] = v;
+  }
+
+  fine_to_coarse.assign(fine.size(), kUnmatched);
+  unsigned int num_coarse = 0;
+  for(unsigned int v = 0; v < fine.size(); ++v) {
+    if(fine_to_coarse[v] != kUnmatched) continue;
+    fine_to_coarse[v] = fine_to_coarse[match[v]] = num_coarse++;
+  }
+
+  coarse.weights_.assign(num_coarse, 0);
+  coarse.sizes_.assign(num_coarse, 0);
+  coarse.edges_.assign(num_coarse, {});
+  for(unsigned int v = 0; v < fine.size(); ++v) {
+    coarse.weights_[fine_to_coarse[v]] += fine.weights_[v];
+    coarse.sizes_[fine_to_coarse[v]] += fine.sizes_[v];
+  }
+
+  /* The edges of each coarse vertex are summed in a scratch row indexed by
+   * the coarse neighbor, visiting only the entries that were touched.
+   */
+  vector<unsigned long> row(num_coarse, 0);
+  vector<unsigned int> touched;
+  for(unsigned int v = 0; v < fine.size(); ++v) {
+    unsigned int c = fine_to_coarse[v];
+    if(match[v] < v) continue;
+
+    touched.clear();
+    for(unsigned int member : {v, match[v]}) {
+      for(auto& e : fine.edges_[member]) {
+        unsigned int d = fine_to_coarse[e.first];
+        if(d == c) continue;
+        if(row[d] == 0) touched.push_back(d);
+        row[d] += e.second;
+      }
+      if(match[v] == v) break;
+    }
+
+    for(unsigned int d : touched) {
+      coarse.edges_[c].push_back({d, row[d]});
+      row[d] = 0;
+    }
+  }
+}
+
+/* Moves the vertices that cost the cut least into a side that has fewer
+ * than min_size entities until it has enough, and then out of a side that is
+ * heavier than its limit until it is not, never leaving the side that they
+ * come from with too few entities.
+ */
+void Rebalance(const WeightedGraph& g, const unsigned long limit[2],
+               const unsigned long min_size[2], Sides& side) {
+  unsigned long weight[2] = {0, 0}, size[2] = {0, 0};
+  for(unsigned int v = 0; v < g.size(); ++v) {
+    weight[side[v]] += g.weights_[v];
+    size[side[v]] += g.sizes_[v];
+  }
+
+  auto move_best = [&](unsigned char from) {
+    unsigned int best = g.size();
+    long best_gain = 0;
+    for(unsigned int v = 0; v < g.size(); ++v) {
+      if(side[v] != from || size[from] < min_size[from] + g.sizes_[v])
+        continue;
+      long gain = 0;
+      for(auto& e : g.edges_[v])
+        gain += side[e.first] != from ? long(e.second) : -long(e.second);
+      if(best == g.size() || gain > best_gain) {
+        best = v;
+        best_gain = gain;
+      }
+    }
+    if(best == g.size()) return false;
+
+    side[best] = 1 - from;
+    weight[from] -= g.weights_[best];
+    weight[1 - from] += g.weights_[best];
+    size[from] -= g.sizes_[best];
+    size[1 - from] += g.sizes_[best];
+    return true;
+  };
+
+  for(unsigned char lacking = 0; lacking < 2; ++lacking)
+    while(size[lacking] < min_size[lacking])
+      if(!move_best(1 - lacking)) break;
+
+  for(unsigned char heavy = 0; heavy < 2; ++heavy)
+    while(weight[heavy] > limit[heavy])
+      if(!move_best(heavy)) break;
+}
+
+/* How far side 0 is from weighing target0 */
+unsigned long Deviation(unsigned long weight0, unsigned long target0) {
+  return weight0 > target0 ? weight0 - target0 : target0 - weight0;
+}
+
+/* A side may exceed its share by kMaxImbalance, or by half its heaviest
+ * vertex where that is more, since coarse vertices can be too heavy to
+ * balance within the ratio.  The slack is inherited by the num_parts parts
+ * that the side is split into later, so it is also capped at half the share
+ * of one of them: near the bottom of the recursion the heaviest vertex is
+ * as heavy as a whole part, and the slack would otherwise add up over the
+ * levels into parts far heavier than their share.
+ */
+unsigned long Limit(unsigned long share, unsigned long heaviest,
+                    unsigned int num_parts) {
+  return share + max(static_cast<unsigned long>(
+      share * (Partitioner::kMaxImbalance - 1)),
+      min(heaviest / 2, share / (2 * num_parts)));
+}
+
+/* Fiduccia-Mattheyses refinement.  Each pass moves vertices one at a time,
+ * always the one whose move cuts the fewest links among those that keep the
+ * sides within their limits, even when the move makes the cut worse, and
+ * locks every vertex once it has moved.  The pass is then rolled back to the
+ * point at which the cut was smallest, or balanced best among equal cuts.
+ * Each side has to keep at least as many entities as it has parts to fill.
+ */
+void Refine(const WeightedGraph& g, unsigned long target0,
+            const unsigned int num_parts[2], Sides& side) {
+  unsigned long total = g.TotalWeight();
+  unsigned long heaviest = g.MaxWeight();
+  const unsigned long limit[2] = {
+    Limit(target0, heaviest, num_parts[0]),
+    Limit(total - target0, heaviest, num_parts[1])
+  };
+  const unsigned long min_size[2] = {num_parts[0], num_parts[1]};
+
+  Rebalance(g, limit, min_size, side);
+
+  vector<long> gain(g.size());
+  vector<bool> locked(g.size());
+  vector<unsigned int> moves;
+
+  for(unsigned int pass = 0; pass < kMaxRefinePasses; ++pass) {
+    unsigned long weight[2] = {0, 0}, size[2] = {0, 0};
+    set<pair<long, unsigned int>, greater<pair<long, unsigned int> > > by_gain;
+    auto can_move = [&](unsigned int v) {
+      return weight[1 - side[v]] + g.weights_[v] <= limit[1 - side[v]] &&
+             size[side[v]] >= min_size[side[v]] + g.sizes_[v];
+    };
+
+    for(unsigned int v = 0; v < g.size(); ++v) {
+      weight[side[v]] += g.weights_[v];
+      size[side[v]] += g.sizes_[v];
+      gain[v] = 0;
+      bool is_boundary = false;
+      for(auto& e : g.edges_[v]) {
+        bool is_cut = side[e.first] != side[v];
+        gain[v] += is_cut ? long(e.second) : -long(e.second);
+        is_boundary |= is_cut;
+      }
+      if(is_boundary) by_gain.insert({gain[v], v});
+    }
+
+    std::fill(locked.begin(), locked.end(), false);
+    moves.clear();
+    long cut_change = 0, best_change = 0;
+    unsigned long best_deviation = Deviation(weight[0], target0);
+    unsigned int best_moves = 0;
+
+    while(!by_gain.empty() &&
+          moves.size() - best_moves < kMaxFruitlessMoves) {
+      auto it = by_gain.begin();
+      while(it != by_gain.end() && !can_move(it->second))
+        ++it;
+      if(it == by_gain.end()) break;
+
+      unsigned int v = it->second;
+      by_gain.erase(it);
+      locked[v] = true;
+      weight[side[v]] -= g.weights_[v];
+      size[side[v]] -= g.sizes_[v];
+      side[v] = 1 - side[v];
+      weight[side[v]] += g.weights_[v];
+      size[side[v]] += g.sizes_[v];
+      cut_change -= gain[v];
+      moves.push_back(v);
+
+      for(auto& e : g.edges_[v]) {
+        unsigned int u = e.first;
+        if(locked[u]) continue;
+        by_gain.erase({gain[u], u});
+        gain[u] += side[u] == side[v] ? -2 * long(e.second)
+                                      : 2 * long(e.second);
+        by_gain.insert({gain[u], u});
+      }
+
+      unsigned long deviation = Deviation(weight[0], target0);
+      if(cut_change < best_change ||
+         (cut_change == best_change && deviation < best_deviation)) {
+        best_change = cut_change;
+        best_deviation = deviation;
+        best_moves = moves.size();
+      }
+    }
+
+    for(unsigned int i = best_moves; i < moves.size(); ++i)
+      side[moves[i]] = 1 - side[moves[i]];
+
+    if(best_moves == 0) break;
+  }
+}
+
+/* Grows side 0 breadth first from a random seed, starting again from
+ * another where a component runs out, until it weighs target0 and has at
+ * least min_size[0] entities.  Vertices that would leave side 1 with fewer
+ * than min_size[1] entities are passed over.
+ */
+void GrowBisection(const WeightedGraph& g, unsigned long target0,
+                   const unsigned long min_size[2], Sides& side,
+                   default_random_engine& entropy_src) {
+  side.assign(g.size(), 1);
+  if(g.size() == 0) return;
+
+  std::uniform_int_distribution<unsigned int> seed_dist(0, g.size() - 1);
+  unsigned long weight0 = 0, size0 = 0, size1 = g.TotalSize();
+  unsigned int next_seed = seed_dist(entropy_src);
+  queue<unsigned int> frontier;
+
+  auto is_short = [&]() { return weight0 < target0 || size0 < min_size[0]; };
+  auto can_take = [&](unsigned int v) {
+    return side[v] == 1 && size1 >= min_size[1] + g.sizes_[v];
+  };
+  auto take = [&](unsigned int v) {
+    side[v] = 0;
+    weight0 += g.weights_[v];
+    size0 += g.sizes_[v];
+    size1 -= g.sizes_[v];
+    frontier.push(v);
+  };
+
+  while(is_short()) {
+    if(frontier.empty()) {
+      unsigned int tried = 0;
+      while(tried < g.size() && !can_take(next_seed)) {
+        next_seed = (next_seed + 1) % g.size();
+        ++tried;
+      }
+      if(tried == g.size()) break;
+      take(next_seed);
+      continue;
+    }
+
+    unsigned int v = frontier.front();
+    frontier.pop();
+    for(auto& e : g.edges_[v]) {
+      if(!is_short()) break;
+      if(can_take(e.first)) take(e.first);
+    }
+  }
+}
+
+/* Splits g into sides that are to be split further into num_parts[0] and
+ * num_parts[1] parts, with loads in proportion.
+ */
+void Bisect(const WeightedGraph& g, const unsigned int num_parts[2],
+            Sides& side, default_random_engine& entropy_src) {
+  double fraction = double(num_parts[0]) / (num_parts[0] + num_parts[1]);
+  unsigned long target0 = fraction * g.TotalWeight();
+  const unsigned long min_size[2] = {num_parts[0], num_parts[1]};
+
+  if(g.size() > kCoarsestSize) {
+    WeightedGraph coarse;
+    vector<unsigned int> fine_to_coarse;
+    Coarsen(g, coarse, fine_to_coarse, entropy_src);
+
+    if(coarse.size() < (1 - kMinShrink) * g.size()) {
+      Sides coarse_side;
+      Bisect(coarse, num_parts, coarse_side, entropy_src);
+
+      side.resize(g.size());
+      for(unsigned int v = 0; v < g.size(); ++v)
+        side[v] = coarse_side[fine_to_coarse[v]];
+      Refine(g, target0, num_parts, side);
+      return;
+    }
+  }
+
+  Sides tried;
+  unsigned long best_cut = 0;
+  for(unsigned int i = 0; i < kInitialTries; ++i) {
+    GrowBisection(g, target0, min_size, tried, entropy_src);
+    Refine(g, target0, num_parts, tried);
+    unsigned long cut = CutWeight(g, tried);
+    if(i == 0 || cut < best_cut) {
+      best_cut = cut;
+      side = tried;
+    }
+  }
+}
+
+} // namespace
+
+/* Links are made symmetric, and duplicates and links to self dropped, so
+ * that topologies that list each link from one end only are handled too.
+ */
+Partitioner::Partitioner(const Topology& physical)
+    : links_(physical.size()), loads_(physical.size()), assignment_(),
+      num_parts_(0), num_links_(0), cut_links_(0), part_loads_(),
+      entropy_src_() {
+  for(Id u = 0; u < Id(physical.size()); ++u) {
+    for(Id v : physical[u]) {
+      if(v == u || v < 0 || v >= Id(physical.size())) continue;
+      links_[u].push_back(v);
+      links_[v].push_back(u);
+    }
+  }
+
+  for(Id u = 0; u < Id(links_.size()); ++u) {
+    std::sort(links_[u].begin(), links_[u].end());
+    links_[u].erase(std::unique(links_[u].begin(), links_[u].end()),
+                    links_[u].end());
+    loads_[u] = links_[u].size() + 1;
+    num_links_ += links_[u].size();
+  }
+  num_links_ /= 2;
+}
+
+void Partitioner::Partition(unsigned int num_parts) {
+  CHECK_GT(num_parts, 0);
+  CHECK_LE(num_parts, links_.size());
+
+  num_parts_ = num_parts;
+  assignment_.assign(links_.size(), 0);
+
+  vector<Id> all(links_.size());
+  for(Id u = 0; u < Id(all.size()); ++u)
+    all[u] = u;
+  Split(all, num_parts, 0);
+
+  part_loads_.assign(num_parts, 0);
+  cut_links_ = 0;
+  for(Id u = 0; u < Id(links_.size()); ++u) {
+    part_loads_[assignment_[u]] += loads_[u];
+    for(Id v : links_[u])
+      if(u < v && assignment_[u] != assignment_[v]) ++cut_links_;
+  }
+}
+
+const vector<unsigned int>& Partitioner::assignment() const {
+  return assignment_;
+}
+
+unsigned int Partitioner::num_parts() const { return num_parts_; }
+
+unsigned long Partitioner::num_links() const { return num_links_; }
+
+unsigned long Partitioner::cut_links() const { return cut_links_; }
+
+const vector<unsigned long>& Partitioner::part_loads() const {
+  return part_loads_;
+}
+
+/* The load of the heaviest part over the average load of a part */
+double Partitioner::Imbalance() const {
+  unsigned long total = 0, heaviest = 0;
+  for(unsigned long load : part_loads_) {
+    total += load;
+    heaviest = max(heaviest, load);
+  }
+  return total == 0 ? 1 : double(heaviest) * num_parts_ / total;
+}
+
+string Partitioner::Description() const {
+  ostringstream out;
+  out << num_parts_ << " parts cut " << cut_links_ << " of " << num_links_
+      << " links, loads";
+  for(unsigned long load : part_loads_)
+    out << " " << load;
+  out << ", imbalance " << Imbalance();
+  return out.str();
+}
+
+/* Writes a line of the form id,part for every entity */
+bool Partitioner::WriteAssignment(string path) const {
+  ofstream out(path, std::ios::out | std::ios::trunc);
+  if(!out) {
+    LOG(ERROR) << "Could not open " << path;
+    return false;
+  }
+
+  for(Id u = 0; u < Id(assignment_.size()); ++u)
+    out << u << "," << assignment_[u] << "\n";
+
+  if(!out) {
+    LOG(ERROR) << "Could not write " << path;
+    return false;
+  }
+  return true;
+}
+
+/* Assigns entities to parts first through first + num_parts - 1, splitting
+ * them in two with loads in proportion to the number of parts on each side.
+ */
+void Partitioner::Split(const vector<Id>& entities, unsigned int num_parts,
+                        unsigned int first) {
+  if(num_parts == 1 || entities.size() <= 1) {
+    for(Id u : entities)
+      assignment_[u] = first;
+    return;
+  }
+
+  vector<int> index(links_.size(), -1);
+  for(unsigned int i = 0; i < entities.size(); ++i)
+    index[entities[i]] = i;
+
+  WeightedGraph g;
+  g.weights_.resize(entities.size());
+  g.sizes_.assign(entities.size(), 1);
+  g.edges_.resize(entities.size());
+  for(unsigned int i = 0; i < entities.size(); ++i) {
+    g.weights_[i] = loads_[entities[i]];
+    for(Id v : links_[entities[i]])
+      if(index[v] >= 0) g.edges_[i].push_back({unsigned(index[v]), 1});
+  }
+
+  const unsigned int halves_parts[2] = {num_parts / 2,
+                                        num_parts - num_parts / 2};
+  Sides side;
+  Bisect(g, halves_parts, side, entropy_src_);
+
+  vector<Id> halves[2];
+  for(unsigned int i = 0; i < entities.size(); ++i)
+    halves[side[i]].push_back(entities[i]);
+
+  Split(halves[0], halves_parts[0], first);
+  Split(halves[1], halves_parts[1], first + halves_parts[0]);
+}
@@ -0,0 +1,50 @@
+#ifndef DDCSIM_PARTITIONER_H_
+#define DDCSIM_PARTITIONER_H_
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+/* Assigns the entities of a physical topology to a number of parts, meant to
+ * be simulated by separate workers, so that few links cross between parts
+ * while every part carries about the same load.  An entity's load is its
+ * degree plus one: floods cost it work on every link, and it handles its own
+ * timers even without any.
+ *
+ * The parts come from recursive bisection, and each bisection is multilevel
+ * in the manner of METIS: the graph is coarsened by merging the endpoints of
+ * its heaviest links, the coarsest graph is split by growing one side from
+ * a seed, and the split is carried back down level by level, improving it
+ * with Fiduccia-Mattheyses passes at each one.
+ */
+class Partitioner {
+ public:
+  Partitioner(const Topology&);
+  void Partition(unsigned int);
+  const std::vector<unsigned int>& assignment() const;
+  unsigned int num_parts() const;
+  unsigned long num_links() const;
+  unsigned long cut_links() const;
+  const std::vector<unsigned long>& part_loads() const;
+  double Imbalance() const;
+  std::string Description() const;
+  bool WriteAssignment(std::string) const;
+  static const std::string ASSIGNMENT_FILE_NAME;
+  static const double kMaxImbalance;
+
+ private:
+  void Split(const std::vector<Id>&, unsigned int, unsigned int);
+  Topology links_;
+  std::vector<unsigned long> loads_;
+  std::vector<unsigned int> assignment_;
+  unsigned int num_parts_;
+  unsigned long num_links_;
+  unsigned long cut_links_;
+  std::vector<unsigned long> part_loads_;
+  std::default_random_engine entropy_src_;
+  DISALLOW_COPY_AND_ASSIGN(Partitioner);
+};
+
+#endif
@@ -20,7 +20,8 @@ using namespace YAML;
 Reader::Reader(std::string topo_file_path, std::string event_file_path,
                Scheduler& sched)
     : topo_file_path_(topo_file_path), event_file_path_(event_file_path),
-      scheduler_(sched), id_to_entity_(), physical_topo_(sched.num_entities()) {}
+      scheduler_(sched), id_to_entity_(), physical_topo_(sched.num_entities()),
+      switches_() {}
 
 bool Reader::IsGenericEntity(Node n) {
   return !n["type"].as<string>().compare("entity");
@@ -34,7 +35,12 @@ bool Reader::IsController(Node n) {
   return !n["type"].as<string>().compare("controller");
 }
 
-bool Reader::ParseEntities(Node raw_entities, Statistics& s) {
+bool Reader::ParseEntities(Node raw_entities, bool compute_routes,
+                           Time spf_hold_down, unsigned int ls_full_every,
+                           bool heartbeat_tree, unsigned int gossip_fanout,
+                           Time aggregation_hold, Time heartbeat_period,
+                           Time heartbeat_max_period, bool elect_leaders,
+                           Statistics& s) {
   // TODO error handling
   // TODO hoist raw_entities.end out of loop?
   for(auto it = raw_entities.begin(); it != raw_entities.end(); ++it) {
@@ -42,9 +48,24 @@ bool Reader::ParseEntities(Node raw_entities, Statistics& s) {
     Id id = n["id"].as<Id>();
 
     if(IsController(n)) {
-      id_to_entity_.insert({id, new Controller(scheduler_, id, s)});
+      Controller* c = new Controller(scheduler_, id, s);
+      if(heartbeat_tree) c->EnableSpanningTree();
+      if(gossip_fanout > 0) c->EnableGossip(gossip_fanout);
+      if(heartbeat_max_period > 0)
+        c->EnableAdaptiveHeartbeats(heartbeat_period, heartbeat_max_period);
+      if(elect_leaders) c->EnableLeaderElection();
+      id_to_entity_.insert({id, c});
     } else if(IsSwitch(n)) {
-      id_to_entity_.insert({id, new Switch(scheduler_, id, s)});
+      Switch* sw = new Switch(scheduler_, id, s);
+      if(compute_routes) sw->EnableRoutes(spf_hold_down);
+      if(ls_full_every > 1) sw->EnableLSDeltas(ls_full_every);
+      if(heartbeat_tree) sw->EnableSpanningTree();
+      if(gossip_fanout > 0) sw->EnableGossip(gossip_fanout);
+      if(aggregation_hold > 0) sw->EnableHeartbeatAggregation(aggregation_hold);
+      if(heartbeat_max_period > 0)
+        sw->EnableAdaptiveHeartbeats(heartbeat_period, heartbeat_max_period);
+      id_to_entity_.insert({id, sw});
+      switches_.push_back(sw);
     } else if(IsGenericEntity(n)) {
       LOG(ERROR) << "Construction of generic entities is disallowed";
       return false;
@@ -81,7 +102,11 @@ bool Reader::ParseLinks(Node&& raw_links, Size bucket_capacity,
 }
 
 bool Reader::ParseTopology(Size bucket_capacity, Rate fill_rate,
-                           Statistics& s) {
+                           bool compute_routes, Time spf_hold_down,
+                           unsigned int ls_full_every, bool heartbeat_tree,
+                           unsigned int gossip_fanout, Time aggregation_hold,
+                           Time heartbeat_period, Time heartbeat_max_period,
+                           bool elect_leaders, Statistics& s) {
   Node raw_topo(LoadFile(topo_file_path_));
 
   if(!raw_topo.IsMap()) {
@@ -90,7 +115,11 @@ bool Reader::ParseTopology(Size bucket_capacity, Rate fill_rate,
   }
 
   // TODO error handling
-  bool valid_entities = ParseEntities(raw_topo["entities"], s);
+  bool valid_entities = ParseEntities(raw_topo["entities"], compute_routes,
+                                      spf_hold_down, ls_full_every,
+                                      heartbeat_tree, gossip_fanout,
+                                      aggregation_hold, heartbeat_period,
+                                      heartbeat_max_period, elect_leaders, s);
 
   if(!valid_entities) return false;
 
@@ -98,6 +127,12 @@ bool Reader::ParseTopology(Size bucket_capacity, Rate fill_rate,
 
   if(!valid_links) return false;
 
+  /* Link state rows are sized by port counts, so they can only be laid out
+   * once every link is known
+   */
+  for(Switch* sw : switches_)
+    sw->InitLinkState(physical_topo_);
+
   return true;
 }
 
@@ -133,11 +168,13 @@ bool Reader::IsHeartbeat(Node n) {
   return !n["type"].as<string>().compare("heartbeat");
 }
 
-bool Reader::ParseEvents() {
+bool Reader::ParseEvents() { return ParseEvents(event_file_path_); }
+
+bool Reader::ParseEvents(string event_file_path) {
   // TODO verify there are no double down's/up's or at least log
-  if(event_file_path_ == NO_EVENT_FILE) return true;
+  if(event_file_path == NO_EVENT_FILE) return true;
 
-  Node raw_events(LoadFile(event_file_path_));
+  Node raw_events(LoadFile(event_file_path));
 
   Time t;
   Node ev;
@@ -149,31 +186,38 @@ bool Reader::ParseEvents() {
     t = it->first.as<Time>();
     ev = it->second;
 
+    /* Only possible when resuming from a checkpoint or forking scenarios */
+    if(t < scheduler_.cur_time()) {
+      LOG(ERROR) << "Event at time " << t << " precedes the current time "
+                 << scheduler_.cur_time();
+      return false;
+    }
+
     if(IsUp(ev)) {
       affected_id = it->second["id"].as<Id>();
       // TODO how to cleanly remove static cast
-      scheduler_.AddEvent(new Up(t,
-                                 static_cast<Switch*>
-                                 (id_to_entity_[affected_id])));
+      scheduler_.AddEvent(Up(t,
+                             static_cast<Switch*>
+                             (id_to_entity_[affected_id])));
     } else if(IsDown(ev)) {
       affected_id = it->second["id"].as<Id>();
-      scheduler_.AddEvent(new Down(t,
-                                   static_cast<Switch*>
-                                   (id_to_entity_[affected_id])));
+      scheduler_.AddEvent(Down(t,
+                               static_cast<Switch*>
+                               (id_to_entity_[affected_id])));
     } else if(IsLinkUp(ev)) {
       affected_id = it->second["src_id"].as<Id>();
       Entity* src = id_to_entity_[affected_id];
       Entity* dst = id_to_entity_[it->second["dst_id"].as<Id>()];
       Port p = src->links().GetPortTo(dst);
       CHECK_NE(p, PORT_NOT_FOUND);
-      scheduler_.AddEvent(new LinkUp(t, src, p));
+      scheduler_.AddEvent(LinkUp(t, src, p));
     } else if(IsLinkDown(ev)) {
       affected_id = it->second["src_id"].as<Id>();
       Entity* src = id_to_entity_[affected_id];
       Entity* dst = id_to_entity_[it->second["dst_id"].as<Id>()];
       Port p = src->links().GetPortTo(dst);
       CHECK_NE(p, PORT_NOT_FOUND);
-      scheduler_.AddEvent(new LinkDown(t, src, p));
+      scheduler_.AddEvent(LinkDown(t, src, p));
     } else if(IsGenericEvent(ev)) {
       LOG(ERROR) << "Construction of generic events is disallowed";
       return false;
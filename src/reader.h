@@ -5,6 +5,7 @@
 
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "common.h"
 
@@ -13,12 +14,15 @@
 class Entity;
 class Scheduler;
 class Statistics;
+class Switch;
 
 class Reader {
 public:
   Reader(std::string, std::string, Scheduler&);
-  bool ParseTopology(Size, Rate, Statistics&);
+  bool ParseTopology(Size, Rate, bool, Time, unsigned int, bool, unsigned int,
+                     Time, Time, Time, bool, Statistics&);
   bool ParseEvents();
+  bool ParseEvents(std::string);
   // TODO take out type of iterator
   // TODO just make id_to_entity_ public?
   std::unordered_map<Id, Entity*>& id_to_entity();
@@ -28,7 +32,8 @@ private:
   bool IsGenericEntity(YAML::Node);
   bool IsSwitch(YAML::Node);
   bool IsController(YAML::Node);
-  bool ParseEntities(YAML::Node, Statistics&); // TODO why isn't ref allowed?
+  bool ParseEntities(YAML::Node, bool, Time, unsigned int, bool, unsigned int,
+                     Time, Time, Time, bool, Statistics&); // TODO why isn't ref allowed?
   bool IsUp(YAML::Node);
   bool IsDown(YAML::Node);
   bool IsLinkUp(YAML::Node);
@@ -43,6 +48,7 @@ private:
   Scheduler& scheduler_;
   std::unordered_map<Id, Entity*> id_to_entity_;
   Topology physical_topo_;
+  std::vector<Switch*> switches_;
   DISALLOW_COPY_AND_ASSIGN(Reader);
 };
 
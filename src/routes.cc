@@ -0,0 +1,139 @@
+#include "routes.h"
+#include "checkpoint.h"
+#include "entities.h"
+
+#include <limits>
+
+using std::numeric_limits;
+using std::pair;
+using std::vector;
+
+const unsigned int Routes::kUnreachable = numeric_limits<unsigned int>::max();
+
+Routes::Routes(Id root, unsigned int num_entities)
+    : root_(root), id_to_dist_(num_entities, kUnreachable),
+      id_to_parent_(num_entities, NONE_ID), changed_links_() {
+  id_to_dist_[root_] = 0;
+}
+
+/* Returns the number of nodes whose distance was recomputed, which is the
+ * cost of the update in units of BFS work.
+ */
+unsigned int Routes::Recompute(LinkState& ls) {
+  ls.TakeChangedLinks(changed_links_);
+
+  vector<Id> cut;
+  Frontier frontier;
+
+  /* Cut first so that the relaxations below never start from a node whose
+   * distance is about to be invalidated.
+   */
+  for(const pair<Id, Id>& l : changed_links_) {
+    if(ls.HasLink(l.first, l.second)) continue;
+    if(id_to_parent_[l.second] == l.first)
+      Cut(l.second, ls, cut);
+    else if(id_to_parent_[l.first] == l.second)
+      Cut(l.first, ls, cut);
+  }
+
+  /* Reattach the cut nodes through whichever neighbors kept their distance */
+  for(Id id : cut)
+    for(unsigned int i = 0; i < ls.Degree(id); ++i)
+      if(ls.Advertises(ls.Neighbor(id, i), id))
+        Relax(ls.Neighbor(id, i), id, frontier);
+
+  for(const pair<Id, Id>& l : changed_links_) {
+    if(ls.HasLink(l.first, l.second)) {
+      Relax(l.first, l.second, frontier);
+      Relax(l.second, l.first, frontier);
+    }
+  }
+
+  changed_links_.clear();
+
+  unsigned int settled = 0;
+
+  while(!frontier.empty()) {
+    Candidate c = frontier.top();
+    frontier.pop();
+
+    Id id = c.second;
+    if(c.first != id_to_dist_[id]) continue;
+
+    ++settled;
+    for(unsigned int i = 0; i < ls.Degree(id); ++i)
+      if(ls.Advertises(ls.Neighbor(id, i), id))
+        Relax(id, ls.Neighbor(id, i), frontier);
+  }
+
+  return cut.size() + settled;
+}
+
+Id Routes::NextHop(Id dst) const {
+  if(dst == root_ || id_to_dist_[dst] == kUnreachable) return NONE_ID;
+
+  while(id_to_parent_[dst] != root_)
+    dst = id_to_parent_[dst];
+
+  return dst;
+}
+
+unsigned int Routes::Distance(Id dst) const { return id_to_dist_[dst]; }
+
+void Routes::Save(Checkpoint& c) const {
+  c.WriteVector(id_to_dist_);
+  c.WriteVector(id_to_parent_);
+}
+
+void Routes::Restore(Checkpoint& c) {
+  unsigned int num_entities = id_to_dist_.size();
+
+  c.ReadVector(id_to_dist_);
+  c.ReadVector(id_to_parent_);
+
+  if(c.failed()) return;
+
+  bool valid = id_to_dist_.size() == num_entities &&
+      id_to_parent_.size() == num_entities;
+  for(unsigned int i = 0; valid && i < num_entities; ++i)
+    valid = id_to_parent_[i] == NONE_ID ||
+        (id_to_parent_[i] >= 0 && id_to_parent_[i] < Id(num_entities));
+
+  if(!valid) c.Fail("routes are inconsistent");
+}
+
+/* Marks the subtree below top as unreachable.  A child whose own tree link
+ * was also removed is not found here but is cut by its own changed link.
+ */
+void Routes::Cut(Id top, const LinkState& ls, vector<Id>& cut) {
+  if(id_to_dist_[top] == kUnreachable) return;
+
+  vector<Id> stack(1, top);
+  id_to_dist_[top] = kUnreachable;
+  id_to_parent_[top] = NONE_ID;
+
+  while(!stack.empty()) {
+    Id id = stack.back();
+    stack.pop_back();
+    cut.push_back(id);
+
+    for(unsigned int i = 0; i < ls.Degree(id); ++i) {
+      Id child = ls.Neighbor(id, i);
+      if(id_to_parent_[child] == id) {
+        id_to_dist_[child] = kUnreachable;
+        id_to_parent_[child] = NONE_ID;
+        stack.push_back(child);
+      }
+    }
+  }
+}
+
+void Routes::Relax(Id from, Id to, Frontier& frontier) {
+  if(id_to_dist_[from] == kUnreachable) return;
+
+  if(id_to_dist_[from] + 1 < id_to_dist_[to]) {
+    id_to_dist_[to] = id_to_dist_[from] + 1;
+    id_to_parent_[to] = from;
+    frontier.emplace(id_to_dist_[to], to);
+  }
+}
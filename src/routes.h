@@ -0,0 +1,44 @@
+#ifndef DDCSIM_ROUTES_H_
+#define DDCSIM_ROUTES_H_
+
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+
+class Checkpoint;
+class LinkState;
+
+/* A shortest path (in hops) tree rooted at a single switch, computed over the
+ * links in its link state database that both endpoints advertise.  Rather
+ * than rerunning BFS from scratch, Recompute folds the links that changed
+ * since the last call into the existing tree: subtrees hanging off removed
+ * tree links are cut loose and reattached, and new links only relax the
+ * nodes they bring closer.
+ */
+class Routes {
+ public:
+  Routes(Id, unsigned int);
+  unsigned int Recompute(LinkState&);
+  Id NextHop(Id) const;
+  unsigned int Distance(Id) const;
+  void Save(Checkpoint&) const;
+  void Restore(Checkpoint&);
+  static const unsigned int kUnreachable;
+
+ private:
+  typedef std::pair<unsigned int, Id> Candidate;
+  typedef std::priority_queue<Candidate, std::vector<Candidate>,
+                              std::greater<Candidate> > Frontier;
+  void Cut(Id, const LinkState&, std::vector<Id>&);
+  void Relax(Id, Id, Frontier&);
+  Id root_;
+  std::vector<unsigned int> id_to_dist_;
+  std::vector<Id> id_to_parent_;
+  std::vector<std::pair<Id, Id> > changed_links_;
+  DISALLOW_COPY_AND_ASSIGN(Routes);
+};
+
+#endif
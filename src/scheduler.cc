@@ -2,86 +2,107 @@
 
 #include <glog/logging.h>
 
+#include "checkpoint.h"
 #include "entities.h"
 #include "events.h"
 #include "scheduler.h"
 #include "statistics.h"
 
+#include <algorithm>
 #include <iostream>
 #include <random>
 
 using std::default_random_engine;
 using std::discrete_distribution;
+using std::function;
+using std::is_heap;
+using std::min;
 using std::uniform_real_distribution;
 using std::string;
 using std::to_string;
 using std::unordered_map;
 using std::vector;
 
-/* The type-specific parts of Scheduler::Forward are deferred to this class.
+/* The type-specific parts of Scheduler::Flood are deferred to this class.
  * This functionality is implemented as a class rather than as a generic
  * method (with appropriate specializations) so that we can leverage partial
  * specialization, which is forbidden for methods but not classes.
  */
 template<class E, class M> class Schedule {
  public:
-  Event* operator()(E* sender, M* msg_in, Entity* reciever, Port in) {};
+  Event operator()(E* sender, M* msg_in, Port first, PortMask ports);
 };
 
 // TODO should the scheduler create messages?
 template<> class Schedule<Entity, Heartbeat> {
  public:
-  Event* operator()(Entity* sender, Heartbeat* heartbeat_in, Entity* receiver,
-                    Port in) {
-    return new Heartbeat(heartbeat_in->time_ + Scheduler::Delay(),
-                         heartbeat_in->src_,
-                         receiver,
-                         in,
-                         heartbeat_in->sn_,
-                         heartbeat_in->recently_seen_);
+  Event operator()(Entity* sender, Heartbeat* heartbeat_in, Port first,
+                   PortMask ports) {
+    HeartbeatFlood f(heartbeat_in->time_ + Scheduler::Delay(),
+                     sender,
+                     first,
+                     ports,
+                     heartbeat_in->src_,
+                     heartbeat_in->sn_,
+                     heartbeat_in->recently_seen_);
+    f.dissemination_ = heartbeat_in->dissemination_;
+    f.tree_parent_ = heartbeat_in->tree_parent_;
+    f.period_ = heartbeat_in->period_;
+    f.current_partition_ = heartbeat_in->current_partition_;
+    f.leader_ = heartbeat_in->leader_;
+    return f;
   }
 };
 
 template<> class Schedule<Entity, InitiateHeartbeat> {
  public:
-  Event* operator()(Entity* sender, InitiateHeartbeat* init, Entity* receiver,
-                    Port in) {
-    return new Heartbeat(init->time_ + Scheduler::Delay(),
-                         sender,
-                         receiver,
-                         in,
-                         sender->NextHeartbeatSeqNum(),
-                         sender->ComputeRecentlySeen());
+  Event operator()(Entity* sender, InitiateHeartbeat* init, Port first,
+                   PortMask ports) {
+    HeartbeatFlood f(init->time_ + Scheduler::Delay(),
+                     sender,
+                     first,
+                     ports,
+                     sender,
+                     sender->NextHeartbeatSeqNum(),
+                     sender->ComputeRecentlySeen());
+    f.dissemination_ = sender->HeartbeatDissemination();
+    f.tree_parent_ = sender->TreeParent();
+    f.period_ = sender->AdvertisedPeriod();
+    f.current_partition_ = sender->CurrentPartition();
+    f.leader_ = sender->Leader();
+    return f;
   }
 };
 
 template<> class Schedule<Switch, LinkStateUpdate> {
  public:
-  Event* operator()(Entity* sender, LinkStateUpdate* ls, Entity* receiver,
-                    Port in) {
-    return new LinkStateUpdate(ls->time_ + Scheduler::Delay(),
-                               receiver,
-                               in,
-                               ls->src_,
-                               ls->sn_,
-                               ls->neighbors_,
-                               ls->expiration_);
+  Event operator()(Switch* sender, LinkStateUpdate* ls, Port first,
+                   PortMask ports) {
+    return LinkStateFlood(ls->time_ + Scheduler::Delay(),
+                          sender,
+                          first,
+                          ports,
+                          ls->src_,
+                          ls->sn_,
+                          ls->advertisement_,
+                          ls->expiration_);
   }
 };
 
 template<> class Schedule<Switch, InitiateLinkState> {
  public:
-  Event* operator()(Switch* sender, InitiateLinkState* ls, Entity* receiver,
-                    Port in) {
-    return new LinkStateUpdate(ls->time_ + Scheduler::Delay(),
-                               receiver,
-                               in,
-                               sender,
-                               sender->NextLSSeqNum(),
-                               sender->ComputeUpNeighbors(),
-                               ls->time_ +
-                               Scheduler::kComputationDelay +
-                               Scheduler::kExpireDelta);
+  Event operator()(Switch* sender, InitiateLinkState* ls, Port first,
+                   PortMask ports) {
+    return LinkStateFlood(ls->time_ + Scheduler::Delay(),
+                          sender,
+                          first,
+                          ports,
+                          sender,
+                          sender->NextLSSeqNum(),
+                          sender->CurrentAdvertisement(),
+                          ls->time_ +
+                          Scheduler::kComputationDelay +
+                          Scheduler::kExpireDelta);
     // TODO use either the encapsulated message time or the global scheduler time
   }
 };
@@ -93,50 +114,113 @@ const Time Scheduler::kDefaultHelloDelay = 0.001;  /* 1 ms */
 
 const Time Scheduler::kDefaultHeartbeatPeriod = 3;
 const Time Scheduler::kDefaultLSUpdatePeriod = 3;
+const Time Scheduler::kDefaultGossipPeriod = 1;
 const Time Scheduler::kDefaultEndTime = 60;
 
+/* Progress is logged every time another 5% of the simulation has passed */
+const Time Scheduler::kMilestoneGranularity = 0.05;
+
+/* Timers are jittered over whole heartbeat periods, so a millisecond tick
+ * leaves few of them to be ordered within each tick.
+ */
+const Time Scheduler::kTimerTick = 0.001;
+
 // TODO this depends on topology and should probably be set according to each input
 const Time Scheduler::kExpireDelta = 3;
 
 Scheduler::Scheduler(Time end_time, unsigned int num_entities) :
-    event_queue_(), end_time_(end_time),  num_entities_(num_entities) {}
+    cur_time_(START_TIME), end_time_(end_time), milestone_start_(START_TIME),
+    next_milestone_(kMilestoneGranularity), milestone_listener_(),
+    num_entities_(num_entities), num_events_processed_(0), event_queue_(),
+    timers_(kTimerTick), batch_() {}
+
+void Scheduler::AddEvent(const Event& e) {
+  if(IsTimer(e))
+    timers_.Add(e);
+  else
+    event_queue_.push(e);
+}
 
-void Scheduler::AddEvent(Event* e) {  event_queue_.emplace(e->time_, e); }
+/* Timers are the events that entities schedule for themselves rather than
+ * receive from their neighbors.
+ */
+bool Scheduler::IsTimer(const Event& e) {
+  switch(e.type()) {
+    case INITIATE_HEARTBEAT:
+    case INITIATE_LINK_STATE:
+    case INITIATE_GOSSIP:
+    case FLUSH_HEARTBEATS:
+      return true;
+    default:
+      return false;
+  }
+}
 
-bool Scheduler::HasNextEvent() { return ! event_queue_.empty(); }
+bool Scheduler::HasNextEvent() {
+  return !event_queue_.empty() || !timers_.empty();
+}
 
-Event* Scheduler::NextEvent() {
-  std::pair<Time, Event*> next = event_queue_.top();
+Time Scheduler::NextEventTime() {
+  if(timers_.empty()) return event_queue_.top().time();
+  if(event_queue_.empty()) return timers_.NextTime();
+  return min(event_queue_.top().time(), timers_.NextTime());
+}
+
+Event Scheduler::NextEvent() {
+  Event next = event_queue_.top();
   event_queue_.pop();
-  return next.second;
+  return next;
 }
 
-bool Scheduler::Comparator::operator() (const std::pair<Time, const Event* const> lhs,
-                                        const std::pair<Time, const Event* const> rhs) const {
-  return lhs.first > rhs.first;
+/* Moves every queued event that shares the earliest timestamp into batch_, in
+ * the order the queue would have yielded them one at a time.  Links all have
+ * the same delay, so floods sent at the same time arrive together and
+ * batches tend to be large.  Events that handlers schedule for the current
+ * time are picked up by the following batch.
+ */
+void Scheduler::NextBatch() {
+  batch_.clear();
+  Time t = NextEventTime();
+  while(!timers_.empty() && timers_.NextTime() == t)
+    batch_.push_back(timers_.Next());
+  while(!event_queue_.empty() && event_queue_.top().time() == t)
+    batch_.push_back(NextEvent());
 }
 
-// TODO why isn't partial specialization of methods allowed?
-template<class E, class M> void Scheduler::Forward(E* sender, M* msg_in, Port out,
-                                                   Statistics& stats) {
-  Links& l = sender->links();
+bool Scheduler::Comparator::operator() (const Event& lhs,
+                                        const Event& rhs) const {
+  return lhs.time() > rhs.time();
+}
 
-  if(! l.IsLinkUp(out)) return;
+/* Sends msg_in out of every port of sender except the one numbered except
+ * whose link is up, or, if only is given, out of just those of them whose bit
+ * is set in it.  All of the copies arrive at the same time, so rather than
+ * queueing one event per port, a single flood event is queued per
+ * kFloodWidth ports and expanded into the individual deliveries when it is
+ * dequeued.
+ */
+// TODO why isn't partial specialization of methods allowed?
+template<class E, class M> void Scheduler::Flood(E* sender, M* msg_in,
+                                                 Port except,
+                                                 Statistics& stats,
+                                                 const vector<bool>* only) {
+  // TODO move this check into Schedule?
+  if(msg_in->time_ + Delay() > end_time_) return;
 
-  Entity* receiver = l.GetEndpoint(out);
+  Links& l = sender->links();
+  Schedule<E, M> s;
 
-  Port in = receiver->links().GetPortTo(sender);
-  CHECK_NE(in, PORT_NOT_FOUND);
+  for(Port first = 0; first < l.PortCount(); first += kFloodWidth) {
+    PortMask ports = 0;
+    for(Port p = first; p < l.PortCount() && p < first + kFloodWidth; ++p)
+      if(p != except && l.IsLinkUp(p) && (only == nullptr || (*only)[p]))
+        ports |= PortMask(1) << (p - first);
 
-  Schedule<E, M> s;
-  Event* new_event = s(sender, msg_in, receiver, in);
+    if(ports == 0) continue;
 
-  // TODO move this before allocation of new_event?
-  if(new_event->time_ <= end_time_) {
-    AddEvent(new_event);
-    stats.RecordSend(new_event);
-  } else {
-    delete new_event;
+    Event flood = s(sender, msg_in, first, ports);
+    AddEvent(flood);
+    stats.RecordSend(flood);
   }
 }
 
@@ -144,63 +228,171 @@ template<class E, class M> void Scheduler::Forward(E* sender, M* msg_in, Port ou
 // TODO feed default_random_engine a seed to make it deterministic
 void Scheduler::SchedulePeriodicEvents(unordered_map<Id, Entity*>& id_to_entity,
                                        Time heartbeat_period,
-                                       Time ls_update_period) {
+                                       Time ls_update_period,
+                                       Time gossip_period,
+                                       bool adaptive_heartbeats) {
   default_random_engine entropy_src;
 
   Time half_hrtbt = heartbeat_period / 2;
   uniform_real_distribution<Time> hrtbt_init_dist(0, half_hrtbt);
   uniform_real_distribution<Time> hrtbt_dist(-1 * half_hrtbt, half_hrtbt);
 
-  // TODO verify that it's okay to use entropy_src for both init_dist and dist
-  for(auto it : id_to_entity)
-    AddEvent(new InitiateHeartbeat(hrtbt_init_dist(entropy_src),
-                                         it.second));
-
-  // TODO verify semantics of end_time
-  for (Time t = heartbeat_period; t <= end_time_; t += heartbeat_period)
+  /* Entities that adapt their heartbeat periods schedule their own
+   * heartbeats after the first
+   */
+  if(adaptive_heartbeats) {
     for(auto it : id_to_entity)
-      AddEvent(new InitiateHeartbeat(t + hrtbt_dist(entropy_src),
+      it.second->ScheduleHeartbeat(hrtbt_init_dist(entropy_src));
+  } else {
+    // TODO verify that it's okay to use entropy_src for both init_dist and dist
+    for(auto it : id_to_entity)
+      AddEvent(InitiateHeartbeat(hrtbt_init_dist(entropy_src),
                                            it.second));
 
+    // TODO verify semantics of end_time
+    for (Time t = heartbeat_period; t <= end_time_; t += heartbeat_period)
+      for(auto it : id_to_entity)
+        AddEvent(InitiateHeartbeat(t + hrtbt_dist(entropy_src),
+                                             it.second));
+  }
+
   Time half_ls = ls_update_period / 2;
   uniform_real_distribution<Time> ls_init_dist(0, half_ls);
   uniform_real_distribution<Time> ls_dist(-1 * half_ls, half_ls);
 
   for(auto it : id_to_entity)
-    // AddEvent(new InitiateLinkState(ls_init_dist(entropy_src),
+    // AddEvent(InitiateLinkState(ls_init_dist(entropy_src),
     //                                      it.second));
-    AddEvent(new InitiateLinkState(0, it.second));
+    AddEvent(InitiateLinkState(0, it.second));
 
 
   for (Time t = ls_update_period; t <= end_time_; t += ls_update_period)
     for(auto it : id_to_entity)
-      AddEvent(new InitiateLinkState(t, it.second));
+      AddEvent(InitiateLinkState(t, it.second));
+
+  /* Gossip rounds are jittered like heartbeats.  A period of zero means
+   * heartbeats are flooded and there are no rounds.
+   */
+  if(gossip_period <= 0) return;
+
+  Time half_gossip = gossip_period / 2;
+  uniform_real_distribution<Time> gossip_init_dist(0, half_gossip);
+  uniform_real_distribution<Time> gossip_dist(-1 * half_gossip, half_gossip);
+
+  for(auto it : id_to_entity)
+    AddEvent(InitiateGossip(gossip_init_dist(entropy_src), it.second));
+
+  for (Time t = gossip_period; t <= end_time_; t += gossip_period)
+    for(auto it : id_to_entity)
+      AddEvent(InitiateGossip(t + gossip_dist(entropy_src), it.second));
 }
 
 // TODO do a better job of sharing the id_to_entity_ mapping between reader
 void Scheduler::StartSimulation(unordered_map<Id, Entity*>& id_to_entity) {
-  Time last_time, next_milestone, milestone_granularity;
+  while(HasNextEvent() && cur_time_ < end_time_)
+    HandleNextBatch();
+}
+
+/* Handles every event up to and including time pause, leaving the rest queued
+ * so that the simulation can be checkpointed there.  StartSimulation carries
+ * on from where this stopped.
+ */
+void Scheduler::RunUntil(Time pause) {
+  while(HasNextEvent() && NextEventTime() <= pause && cur_time_ < end_time_)
+    HandleNextBatch();
+}
+
+/* Milestones start over from the current time, so that the listener of a
+ * simulation forked part way through hears about the part that is left.
+ */
+void Scheduler::set_milestone_listener(function<void(Time)> listener) {
+  milestone_listener_ = listener;
+  milestone_start_ = cur_time_;
+  next_milestone_ = kMilestoneGranularity;
+}
+
+Time Scheduler::Progress() {
+  if(end_time_ <= milestone_start_) return 1;
+  return (cur_time_ - milestone_start_) / (end_time_ - milestone_start_);
+}
+
+void Scheduler::HandleNextBatch() {
+  Time last_time = cur_time_;
+
+  NextBatch();
+
+  cur_time_ = batch_.front().time();
+  CHECK_GE(cur_time_, last_time);
+
+  if (Progress() > next_milestone_) {
+    if(milestone_listener_)
+      milestone_listener_(next_milestone_);
+    else
+      LOG(WARNING) << "Progress: " << (next_milestone_ * 100) << "%";
+    next_milestone_ += kMilestoneGranularity;
+  }
+
+  /* Handlers may queue new events but never touch batch_, so it is safe to
+   * iterate over it while they run.  As before batching, only the first
+   * event at or past the end of the simulation is handled; the rest of the
+   * batch is released unhandled.
+   */
+  auto ev = batch_.begin();
+  while(ev != batch_.end()) {
+    num_events_processed_ += ev->Handle();
+    (ev++)->Release();
+    if(cur_time_ >= end_time_) break;
+  }
+  for( ; ev != batch_.end(); ++ev)
+    ev->Release();
+}
 
-  last_time = cur_time_ = START_TIME;
-  next_milestone = milestone_granularity = 0.05;
+/* The end time is not saved: a restored simulation may stop earlier or later
+ * than the one that was checkpointed, though periodic events were only
+ * scheduled up to the latter's end time.
+ */
+void Scheduler::Save(Checkpoint& c) const {
+  c.Write(cur_time_);
+  c.Write(num_events_processed_);
+
+  const vector<Event>& events = event_queue_.events();
+  c.Write<uint64_t>(events.size());
+  for(const Event& ev : events)
+    ev.Save(c);
 
-  while(HasNextEvent() && cur_time_ < end_time_) {
-    Event* ev = NextEvent();
+  timers_.Save(c);
+}
 
-    last_time = cur_time_;
-    cur_time_ = ev->time_;
-    CHECK_GE(cur_time_, last_time);
+void Scheduler::Restore(Checkpoint& c) {
+  uint64_t num_events = 0;
 
-    if (cur_time_ / end_time_ > next_milestone) {
-      LOG(WARNING) << "Progress: " << (next_milestone * 100) << "%";
-      next_milestone += milestone_granularity;
-    }
+  CHECK(!HasNextEvent());
 
-    for (Entity* e : ev->affected_entities_)
-      ev->Handle(e);
+  c.Read(cur_time_);
+  c.Read(num_events_processed_);
+  c.Read(num_events);
 
-    delete ev;
+  vector<Event>& events = event_queue_.events();
+  for(uint64_t i = 0; i < num_events && !c.failed(); ++i) {
+    Event ev = Event::Restore(c);
+    if(!c.failed()) events.push_back(ev);
   }
+
+  /* A corrupt time would break the ordering that the queue relies on */
+  if(!c.failed() && !is_heap(events.begin(), events.end(), Comparator())) {
+    c.Fail("event queue is out of order");
+    return;
+  }
+
+  timers_.Restore(c);
+
+  if(!c.failed() && HasNextEvent() && NextEventTime() < cur_time_) {
+    c.Fail("event queue holds events from before the checkpoint");
+    return;
+  }
+
+  while(Progress() > next_milestone_)
+    next_milestone_ += kMilestoneGranularity;
 }
 
 Time Scheduler::cur_time() { return cur_time_; }
@@ -209,6 +401,10 @@ Time Scheduler::end_time() { return end_time_; }
 
 unsigned int Scheduler::num_entities() { return num_entities_; }
 
+unsigned long Scheduler::num_events_processed() {
+  return num_events_processed_;
+}
+
 Time Scheduler::Delay() {
   // TODO make these functions of link bandwidth and length
   return kComputationDelay + kTransDelay + kPropDelay;
@@ -217,16 +413,20 @@ Time Scheduler::Delay() {
 /* TODO explain why we need to oblige the compiler to instantiate this templated
 * method explicity
 */
-template void Scheduler::Forward<Entity, Heartbeat>(Entity*, Heartbeat*, Port,
-                                                    Statistics&);
-template void Scheduler::Forward<Entity, InitiateHeartbeat>(Entity*,
-                                                            InitiateHeartbeat*,
-                                                            Port, Statistics&);
-template void Scheduler::Forward<Switch, LinkStateUpdate>(Switch*,
-                                                          LinkStateUpdate*,
+template void Scheduler::Flood<Entity, Heartbeat>(Entity*, Heartbeat*, Port,
+                                                  Statistics&,
+                                                  const vector<bool>*);
+template void Scheduler::Flood<Entity, InitiateHeartbeat>(Entity*,
+                                                          InitiateHeartbeat*,
+                                                          Port, Statistics&,
+                                                          const vector<bool>*);
+template void Scheduler::Flood<Switch, LinkStateUpdate>(Switch*,
+                                                        LinkStateUpdate*,
+                                                        Port,
+                                                        Statistics&,
+                                                        const vector<bool>*);
+template void Scheduler::Flood<Switch, InitiateLinkState>(Switch*,
+                                                          InitiateLinkState*,
                                                           Port,
-                                                          Statistics&);
-template void Scheduler::Forward<Switch, InitiateLinkState>(Switch*,
-                                                            InitiateLinkState*,
-                                                            Port,
-                                                            Statistics&);
+                                                          Statistics&,
+                                                          const vector<bool>*);
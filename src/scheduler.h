@@ -1,17 +1,18 @@
 #ifndef DDCSIM_SCHEDULER_H_
 #define DDCSIM_SCHEDULER_H_
 
+#include <functional>
 #include <queue>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include "common.h"
+#include "events.h"
+#include "timer_wheel.h"
 
+class Checkpoint;
 class Entity;
-class Event;
-class Heartbeat;
-class LinkStateUpdate;
 class Statistics;
 
 class Scheduler {
@@ -29,21 +30,38 @@ class Scheduler {
    */
   class Comparator {
    public:
-    bool operator() (const std::pair<Time, const Event* const>,
-                     const std::pair<Time, const Event* const>) const;
+    bool operator() (const Event&, const Event&) const;
+  };
+
+  /* The layout of the heap decides the order in which events with equal
+   * times are dequeued, so checkpoints save and restore the underlying
+   * vector as is rather than pushing its events one at a time.
+   */
+  class EventQueue
+      : public std::priority_queue<Event, std::vector<Event>, Comparator> {
+   public:
+    std::vector<Event>& events() { return c; }
+    const std::vector<Event>& events() const { return c; }
   };
 
  public:
   Scheduler(Time, unsigned int);
-  void AddEvent(Event*);
+  void AddEvent(const Event&);
   // TODO more descriptive template type names? what is the convention?
-  template<class E, class M> void Forward(E* sender, M* msg_in, Port out,
-                                          Statistics&);
-  void SchedulePeriodicEvents(std::unordered_map<Id, Entity*>&, Time, Time);
+  template<class E, class M> void Flood(E* sender, M* msg_in, Port except,
+                                        Statistics&,
+                                        const std::vector<bool>* only = nullptr);
+  void SchedulePeriodicEvents(std::unordered_map<Id, Entity*>&, Time, Time,
+                              Time, bool);
   void StartSimulation(std::unordered_map<Id, Entity*>&);
+  void RunUntil(Time);
+  void set_milestone_listener(std::function<void(Time)>);
+  void Save(Checkpoint&) const;
+  void Restore(Checkpoint&);
   Time cur_time();
   Time end_time();
   unsigned int num_entities();
+  unsigned long num_events_processed();
   static Time Delay();
   static const Time kComputationDelay;
   static const Time kTransDelay;
@@ -51,16 +69,38 @@ class Scheduler {
   static const Time kExpireDelta;
   static const Time kDefaultHeartbeatPeriod;
   static const Time kDefaultLSUpdatePeriod;
+  static const Time kDefaultGossipPeriod;
   static const Time kDefaultEndTime;
   static const Time kDefaultHelloDelay;
+  static const Time kMilestoneGranularity;
+  static const Time kTimerTick;
 
  private:
+  static bool IsTimer(const Event&);
   bool HasNextEvent();
-  Event* NextEvent();
+  Time NextEventTime();
+  Event NextEvent();
+  void NextBatch();
+  void HandleNextBatch();
+  Time Progress();
   Time cur_time_;
   Time end_time_;
+  /* Milestones count the fraction of the time from milestone_start_ to the
+   * end that has passed.
+   */
+  Time milestone_start_;
+  Time next_milestone_;
+  /* Told the fraction at each milestone, in place of logging it */
+  std::function<void(Time)> milestone_listener_;
   unsigned int num_entities_;
-  std::priority_queue<std::pair<Time, Event*>, std::vector<std::pair<Time, Event*> >, Comparator> event_queue_;
+  unsigned long num_events_processed_;
+  EventQueue event_queue_;
+  /* Timers are kept apart from the events that entities send each other.
+   * Events of both kinds that share a time are handled in the same batch,
+   * timers first.
+   */
+  TimerWheel timers_;
+  std::vector<Event> batch_;
   DISALLOW_COPY_AND_ASSIGN(Scheduler);
 };
 
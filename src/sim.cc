@@ -1,20 +1,29 @@
 #include <boost/program_options.hpp>
 #include <glog/logging.h>
+#include <sys/stat.h>
 
+#include <cerrno>
 #include <iostream>
+#include <limits>
 #include <string>
+#include <vector>
 
+#include "checkpoint.h"
 #include "common.h"
 #include "entities.h"
 #include "events.h"
+#include "job_pool.h"
+#include "partitioner.h"
 #include "reader.h"
 #include "scheduler.h"
 #include "statistics.h"
 
 using std::cerr;
 using std::endl;
+using std::numeric_limits;
 using std::string;
-using std::unordered_map;
+using std::to_string;
+using std::vector;
 
 namespace po = boost::program_options;
 using po::options_description;
@@ -29,7 +38,16 @@ using po::notify;
 bool ParseArgs(int ac, char* av[], string& topo_file_path,
                string& event_file_path, Time& heartbeat_period,
                Time& ls_update_period, Time& end_time, unsigned int& num_entities,
-               Size& bucket_capacity, Rate& fill_rate, string& out_prefix) {
+               Size& bucket_capacity, Rate& fill_rate, bool& compute_routes,
+               Time& spf_hold_down, unsigned int& ls_full_every,
+               bool& heartbeat_tree, unsigned int& gossip_fanout,
+               Time& gossip_period, Time& aggregation_hold,
+               Time& heartbeat_max_period, bool& elect_leaders,
+               unsigned int& parts, string& checkpoint_path,
+               Time& checkpoint_time, string& restore_path,
+               vector<string>& scenario_paths, Time& fork_time,
+               unsigned int& jobs, unsigned long& job_memory,
+               string& out_prefix) {
   options_description desc("Allowed options");
   desc.add_options()
       ("help",
@@ -60,6 +78,79 @@ bool ParseArgs(int ac, char* av[], string& topo_file_path,
       ("fill-rate,R",
        value<Rate>(&fill_rate)->default_value(BandwidthMeter::kDefaultRate),
        "the rate at which the token bucket fills up (in units of bytes/sec)")
+      ("compute-routes,c",
+       po::bool_switch(&compute_routes),
+       "maintain shortest path next hops on every switch")
+      ("spf-hold-down,H",
+       value<Time>(&spf_hold_down)->default_value(Switch::kDefaultSPFHoldDown),
+       "wait spf-hold-down seconds after a link state change before "
+       "recomputing routes, batching the changes that arrive meanwhile")
+      ("ls-full-every,d",
+       value<unsigned int>(&ls_full_every)->default_value(1),
+       "send a complete link state advertisement every ls-full-every "
+       "originations and only the changes since the previous one in between")
+      ("heartbeat-tree,b",
+       po::bool_switch(&heartbeat_tree),
+       "forward heartbeats along a spanning tree instead of out of every "
+       "port, flooding them only while the tree is being repaired")
+      ("gossip-fanout,g",
+       value<unsigned int>(&gossip_fanout)->default_value(0),
+       "instead of flooding heartbeats, send a digest of the latest heartbeat "
+       "known from every entity to gossip-fanout random neighbors every "
+       "gossip-period seconds; 0 floods heartbeats")
+      ("gossip-period,G",
+       value<Time>(&gossip_period)->default_value(
+           Scheduler::kDefaultGossipPeriod),
+       "the time between gossip rounds when gossip-fanout is set")
+      ("heartbeat-aggregation,a",
+       value<Time>(&aggregation_hold)->default_value(0),
+       "have switches hold heartbeats back for up to heartbeat-aggregation "
+       "seconds and send those held back together, one message per port; "
+       "0 sends each heartbeat on its own")
+      ("heartbeat-max-period,x",
+       value<Time>(&heartbeat_max_period)->default_value(0),
+       "let each entity double its heartbeat period, starting from "
+       "heartbeat-period, up to heartbeat-max-period seconds while its "
+       "neighborhood is stable, and drop back after changes; 0 keeps the "
+       "heartbeat period fixed")
+      ("elect-leaders,L",
+       po::bool_switch(&elect_leaders),
+       "have controllers compute the partitions from the recently seen "
+       "vectors in heartbeats, elect a leader for each and put both in their "
+       "own heartbeats")
+      ("parts,P",
+       value<unsigned int>(&parts)->default_value(0),
+       "split the topology into this many parts of balanced load with few "
+       "links between them, as workers of a parallel run would be assigned, "
+       "and write the part of each entity to out-prefix/assignment.txt; 0 "
+       "does not")
+      ("checkpoint,k",
+       value<string>(&checkpoint_path),
+       "save the state of the simulation to this file at checkpoint-time")
+      ("checkpoint-time,T",
+       value<Time>(&checkpoint_time),
+       "the simulated time at which to save the checkpoint")
+      ("restore,r",
+       value<string>(&restore_path),
+       "resume the simulation saved in this checkpoint; the topology and "
+       "num-entities must be the same as when it was taken, and the events "
+       "file may only inject events that follow it")
+      ("scenarios,s",
+       value<vector<string> >(&scenario_paths)->multitoken(),
+       "after fork-time, run a copy of the simulation for each of these "
+       "event files, writing its out files and logs to out-prefix/scenarioN/")
+      ("fork-time,F",
+       value<Time>(&fork_time),
+       "the simulated time at which to fork the scenarios")
+      ("jobs,j",
+       value<unsigned int>(&jobs)->default_value(1),
+       "the number of scenarios to simulate at once, starting the ones with "
+       "the largest event files first")
+      ("job-memory,m",
+       value<unsigned long>(&job_memory)->default_value(0),
+       "the most address space in MiB that the process simulating each "
+       "scenario may use, counting the state it is forked with; 0 does not "
+       "limit it")
       ("out-prefix,O",
        value<string>(&out_prefix)->default_value("./"),
        "directory to put out files");
@@ -86,6 +177,66 @@ bool ParseArgs(int ac, char* av[], string& topo_file_path,
       return false;
     }
 
+    if(vm.count("checkpoint") != vm.count("checkpoint-time")) {
+      cerr << "A checkpoint needs both a file and a time" << endl;
+      return false;
+    }
+
+    if(vm.count("scenarios") != vm.count("fork-time")) {
+      cerr << "Scenarios need both event files and a fork time" << endl;
+      return false;
+    }
+
+    if(ls_full_every == 0) {
+      cerr << "ls-full-every must be at least 1" << endl;
+      return false;
+    }
+
+    if(gossip_fanout > 0 && gossip_period <= 0) {
+      cerr << "gossip-period must be positive" << endl;
+      return false;
+    }
+
+    if(aggregation_hold > 0 && (heartbeat_tree || gossip_fanout > 0)) {
+      cerr << "heartbeat-aggregation cannot be combined with heartbeat-tree "
+          "or gossip-fanout" << endl;
+      return false;
+    }
+
+    if(heartbeat_max_period > 0 &&
+       (heartbeat_tree || gossip_fanout > 0 || aggregation_hold > 0)) {
+      cerr << "heartbeat-max-period cannot be combined with heartbeat-tree, "
+          "gossip-fanout or heartbeat-aggregation" << endl;
+      return false;
+    }
+
+    if(elect_leaders && gossip_fanout > 0) {
+      cerr << "elect-leaders cannot be combined with gossip-fanout, whose "
+          "digests carry no recently seen vectors" << endl;
+      return false;
+    }
+
+    if(heartbeat_max_period > 0 && heartbeat_max_period < heartbeat_period) {
+      cerr << "heartbeat-max-period must be at least heartbeat-period" << endl;
+      return false;
+    }
+
+    if(parts > num_entities) {
+      cerr << "parts cannot exceed the number of entities, since every part "
+          "needs at least one" << endl;
+      return false;
+    }
+
+    if(jobs == 0) {
+      cerr << "At least one scenario has to run at a time" << endl;
+      return false;
+    }
+
+    if(job_memory > numeric_limits<unsigned long>::max() >> 20) {
+      cerr << "job-memory is too large to count in bytes" << endl;
+      return false;
+    }
+
   }
 
   return true;
@@ -100,17 +251,65 @@ void InitLogging(const char* argv0, string out_prefix) {
   FLAGS_logbuflevel = 0;
 }
 
+/* A forked scenario inherits the log files that the parent has open, so the
+ * messages of every scenario would end up interleaved in them.  Each severity
+ * is sent to a file of its own under the scenario's out directory instead,
+ * named like the parent's.
+ */
+void RedirectLogging(const char* argv0, string out_prefix) {
+  string program = argv0;
+  program = program.substr(program.find_last_of('/') + 1);
+
+  FLAGS_log_dir = out_prefix;
+  for(int severity = google::INFO; severity < google::NUM_SEVERITIES;
+      ++severity)
+    google::SetLogDestination(severity,
+                              (out_prefix + program + "." +
+                               google::GetLogSeverityName(severity) +
+                               ".").c_str());
+}
+
+/* Weighs each scenario by the size of its event file, as the events that it
+ * injects are what set it apart from the others.
+ */
+double ScenarioCost(const string& scenario_path) {
+  struct stat info;
+  if(stat(scenario_path.c_str(), &info) != 0) return 0;
+  return info.st_size;
+}
+
 int main(int ac, char* av[]) {
   string topo_file_path, event_file_path, out_prefix;
   Time heartbeat_period, ls_update_period, end_time;
   unsigned int num_entities;
   Size bucket_capacity;
   Rate fill_rate;
+  bool compute_routes;
+  Time spf_hold_down;
+  unsigned int ls_full_every;
+  bool heartbeat_tree;
+  unsigned int gossip_fanout;
+  Time gossip_period;
+  Time aggregation_hold;
+  Time heartbeat_max_period;
+  bool elect_leaders;
+  unsigned int parts;
+  string checkpoint_path, restore_path;
+  Time checkpoint_time;
+  vector<string> scenario_paths;
+  Time fork_time;
+  unsigned int jobs;
+  unsigned long job_memory;
 
   bool valid_args = ParseArgs(ac, av, topo_file_path, event_file_path,
                               heartbeat_period, ls_update_period, end_time,
                               num_entities, bucket_capacity, fill_rate,
-                              out_prefix);
+                              compute_routes, spf_hold_down, ls_full_every,
+                              heartbeat_tree, gossip_fanout, gossip_period,
+                              aggregation_hold, heartbeat_max_period,
+                              elect_leaders, parts, checkpoint_path,
+                              checkpoint_time, restore_path, scenario_paths,
+                              fork_time, jobs, job_memory, out_prefix);
 
   if(!valid_args) return -1;
 
@@ -122,23 +321,94 @@ int main(int ac, char* av[]) {
 
   Reader in(topo_file_path, event_file_path, sched);
 
-  bool valid_topology = in.ParseTopology(bucket_capacity, fill_rate, stats);
+  bool valid_topology = in.ParseTopology(bucket_capacity, fill_rate,
+                                         compute_routes, spf_hold_down,
+                                         ls_full_every, heartbeat_tree,
+                                         gossip_fanout, aggregation_hold,
+                                         heartbeat_period,
+                                         heartbeat_max_period, elect_leaders,
+                                         stats);
 
   if(!valid_topology) return -1;
 
+  if(parts > 0) {
+    Partitioner partitioner(in.physical_topo());
+    partitioner.Partition(parts);
+    LOG(WARNING) << "Partitioned the topology into "
+                 << partitioner.Description();
+    if(!partitioner.WriteAssignment(out_prefix +
+                                    Partitioner::ASSIGNMENT_FILE_NAME))
+      return -1;
+  }
+
+  /* A restored queue already holds the periodic events */
+  if(!restore_path.empty()) {
+    Checkpoint restored(in.id_to_entity());
+    if(!restored.Restore(restore_path, sched, stats)) return -1;
+  }
+
   // TODO check that entities and links are correct by implementing print
   // functions for them
   bool valid_events = in.ParseEvents();
 
   if(!valid_events) return -1;
 
-  sched.SchedulePeriodicEvents(in.id_to_entity(),
-                               heartbeat_period,
-                               ls_update_period);
+  if(restore_path.empty())
+    sched.SchedulePeriodicEvents(in.id_to_entity(),
+                                 heartbeat_period,
+                                 ls_update_period,
+                                 gossip_fanout > 0 ? gossip_period : 0,
+                                 heartbeat_max_period > 0);
 
   stats.Init(out_prefix, in.physical_topo());
 
+  if(!checkpoint_path.empty()) {
+    sched.RunUntil(checkpoint_time);
+    Checkpoint saved(in.id_to_entity());
+    if(!saved.Save(checkpoint_path, sched, stats)) return -1;
+  }
+
+  JobPool pool(jobs, job_memory << 20);
+
+  if(!scenario_paths.empty()) {
+    sched.RunUntil(fork_time);
+
+    /* Anything still buffered would otherwise be written once by each child */
+    stats.Flush();
+    google::FlushLogFiles(google::INFO);
+
+    for(const string& scenario_path : scenario_paths)
+      pool.Add("Scenario " + scenario_path, ScenarioCost(scenario_path));
+
+    bool all_succeeded;
+    int scenario = pool.Run(all_succeeded);
+
+    if(scenario == JobPool::kParent) return all_succeeded ? 0 : -1;
+
+    /* The pool logs the progress of all scenarios from the fork on instead */
+    sched.set_milestone_listener([&](Time fraction) {
+        pool.ReportProgress(fraction);
+      });
+
+    string scenario_prefix = out_prefix + "scenario" + to_string(scenario) +
+        "/";
+
+    if(mkdir(scenario_prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+      LOG(ERROR) << "Could not create " << scenario_prefix;
+      return -1;
+    }
+
+    RedirectLogging(av[0], scenario_prefix);
+
+    stats.Init(scenario_prefix, in.physical_topo());
+
+    if(!in.ParseEvents(scenario_paths[scenario])) return -1;
+  }
+
   sched.StartSimulation(in.id_to_entity());
 
+  /* bench/scaling.py parses this line */
+  LOG(WARNING) << "Processed " << sched.num_events_processed() << " events";
+
   return 0;
 }
@@ -0,0 +1,155 @@
+#include "spanning_tree.h"
+#include "checkpoint.h"
+#include "entities.h"
+#include "links.h"
+
+#include <algorithm>
+
+using std::max;
+using std::vector;
+
+/* Heartbeats are sent every 3 seconds by default with up to 1.5 seconds of
+ * jitter either way, so consecutive ones from the same entity can be up to 6
+ * seconds apart.  An entity is only given up on after a longer silence.
+ */
+const Time SpanningTree::kTimeout = 9;
+
+/* Long enough for an entity to send at least one heartbeat announcing its new
+ * parent before it stops flooding.
+ */
+const Time SpanningTree::kRepairTime = 6;
+
+SpanningTree::SpanningTree(Id self)
+    : self_(self), root_(self), root_since_(START_TIME),
+      parent_port_(PORT_NOT_FOUND), parent_(NONE_ID),
+      parent_since_(START_TIME), port_is_child_(), ports_(),
+      repair_until_(START_TIME + kRepairTime) {}
+
+/* Forgets the tree, as an entity that has just come back up has to */
+void SpanningTree::Reset(Time now) {
+  root_ = self_;
+  root_since_ = now;
+  SetParent(PORT_NOT_FOUND, NONE_ID, now);
+  port_is_child_.assign(port_is_child_.size(), false);
+  ports_.assign(ports_.size(), false);
+  Repair(now);
+}
+
+/* Gives up on a root or parent that has not been heard from in kTimeout, and
+ * on a parent whose link is down.
+ */
+void SpanningTree::Refresh(const Links& links, const HeartbeatHistory& history,
+                           Time now) {
+  Resize(links.PortCount());
+
+  if(root_ != self_ &&
+     now - max(root_since_, history.LastSighting(root_)) > kTimeout) {
+    root_ = self_;
+    root_since_ = now;
+    SetParent(PORT_NOT_FOUND, NONE_ID, now);
+    Repair(now);
+  } else if(parent_port_ != PORT_NOT_FOUND &&
+            (!links.IsLinkUp(parent_port_) ||
+             now - max(parent_since_, history.LastSighting(parent_)) >
+             kTimeout)) {
+    SetParent(PORT_NOT_FOUND, NONE_ID, now);
+    Repair(now);
+  }
+}
+
+/* Must be called with each heartbeat the first time it is seen, which is when
+ * it arrives over a shortest path from its source.
+ */
+void SpanningTree::Observe(const Heartbeat* h, const Links& links, Time now) {
+  Id src = h->src_->id();
+  if(src == self_) return;
+
+  if(src < root_ || (src == root_ && parent_port_ == PORT_NOT_FOUND)) {
+    root_ = src;
+    root_since_ = now;
+    SetParent(h->in_port_, links.GetEndpoint(h->in_port_)->id(), now);
+    Repair(now);
+  }
+
+  Port p = links.GetPortTo(h->src_);
+  if(p != PORT_NOT_FOUND)
+    SetChild(p, h->tree_parent_ == self_ || h->tree_parent_ == NONE_ID);
+}
+
+void SpanningTree::LinkDown(Port p, Time now) {
+  if(p >= Port(port_is_child_.size())) return;
+
+  if(p == parent_port_ || port_is_child_[p]) {
+    if(p == parent_port_) SetParent(PORT_NOT_FOUND, NONE_ID, now);
+    SetChild(p, false);
+    Repair(now);
+  }
+}
+
+Dissemination SpanningTree::Mode(Time now) const {
+  bool is_orphan = root_ != self_ && parent_port_ == PORT_NOT_FOUND;
+  return now < repair_until_ || is_orphan ? TREE_REPAIR : TREE;
+}
+
+Id SpanningTree::AnnouncedParent(Time now) const {
+  if(Mode(now) == TREE_REPAIR) return NONE_ID;
+  return root_ == self_ ? self_ : parent_;
+}
+
+const vector<bool>& SpanningTree::ports() const { return ports_; }
+
+void SpanningTree::Save(Checkpoint& c) const {
+  c.Write(root_);
+  c.Write(root_since_);
+  c.Write(parent_port_);
+  c.Write(parent_);
+  c.Write(parent_since_);
+  c.WriteBits(port_is_child_);
+  c.WriteBits(ports_);
+  c.Write(repair_until_);
+}
+
+void SpanningTree::Restore(Checkpoint& c) {
+  c.Read(root_);
+  c.Read(root_since_);
+  c.Read(parent_port_);
+  c.Read(parent_);
+  c.Read(parent_since_);
+  c.ReadBits(port_is_child_);
+  c.ReadBits(ports_);
+  c.Read(repair_until_);
+
+  if(port_is_child_.size() != ports_.size())
+    c.Fail("spanning tree is inconsistent");
+}
+
+/* The port count is not known until the links are read, which happens after
+ * the tree is constructed.
+ */
+void SpanningTree::Resize(unsigned int port_count) {
+  if(ports_.size() == port_count) return;
+
+  port_is_child_.resize(port_count, false);
+  ports_.resize(port_count, false);
+}
+
+void SpanningTree::SetParent(Port p, Id parent, Time now) {
+  if(parent_port_ != PORT_NOT_FOUND && parent_port_ < Port(ports_.size()))
+    ports_[parent_port_] = port_is_child_[parent_port_];
+
+  parent_port_ = p;
+  parent_ = parent;
+  parent_since_ = now;
+
+  if(p != PORT_NOT_FOUND)
+    ports_[p] = true;
+}
+
+void SpanningTree::SetChild(Port p, bool is_child) {
+  port_is_child_[p] = is_child;
+  ports_[p] = is_child || p == parent_port_;
+}
+
+void SpanningTree::Repair(Time now) {
+  repair_until_ = max(repair_until_, now + kRepairTime);
+}
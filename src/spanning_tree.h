@@ -0,0 +1,62 @@
+#ifndef DDCSIM_SPANNING_TREE_H_
+#define DDCSIM_SPANNING_TREE_H_
+
+#include <vector>
+
+#include "common.h"
+#include "events.h"
+
+class Checkpoint;
+class HeartbeatHistory;
+class Links;
+
+/* One entity's part of a spanning tree along which heartbeats are forwarded
+ * instead of being flooded out of every port.  The tree is rooted at the
+ * entity with the smallest id that is still heard from, and an entity's
+ * parent is the neighbor over whose link the root's heartbeats first arrived,
+ * which is the next hop on a shortest path to the root.  Heartbeats carry
+ * their source's parent, so the neighbors of an entity learn whether they
+ * are its parent from its own heartbeats.  The root announces itself as its
+ * parent.  An entity that is repairing its part of the tree announces none,
+ * and its neighbors treat it as their child meanwhile so that it hears from
+ * the root again.
+ *
+ * An entity whose part of the tree breaks, because it lost its root, its
+ * parent or a tree link, or because it has just come up, repairs it for
+ * kRepairTime: the heartbeats it sends are marked TREE_REPAIR and flooded out
+ * of every port again, until its own heartbeats have announced a new parent.
+ */
+class SpanningTree {
+ public:
+  SpanningTree(Id);
+  void Reset(Time);
+  void Refresh(const Links&, const HeartbeatHistory&, Time);
+  void Observe(const Heartbeat*, const Links&, Time);
+  void LinkDown(Port, Time);
+  Dissemination Mode(Time) const;
+  Id AnnouncedParent(Time) const;
+  const std::vector<bool>& ports() const;
+  void Save(Checkpoint&) const;
+  void Restore(Checkpoint&);
+  static const Time kTimeout;
+  static const Time kRepairTime;
+
+ private:
+  void Resize(unsigned int);
+  void SetParent(Port, Id, Time);
+  void SetChild(Port, bool);
+  void Repair(Time);
+  Id self_;
+  Id root_;
+  Time root_since_;
+  Port parent_port_;
+  Id parent_;
+  Time parent_since_;
+  std::vector<bool> port_is_child_;
+  /* Bit p is set when port p leads to the parent or to a child */
+  std::vector<bool> ports_;
+  Time repair_until_;
+  DISALLOW_COPY_AND_ASSIGN(SpanningTree);
+};
+
+#endif
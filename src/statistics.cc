@@ -1,4 +1,5 @@
 #include "statistics.h"
+#include "checkpoint.h"
 #include "entities.h"
 #include "events.h"
 #include "scheduler.h"
@@ -12,33 +13,132 @@ using std::to_string;
 using std::ofstream;
 
 const string Statistics::USAGE_LOG_NAME = "network_usage.txt";
+const string Statistics::ROUTING_LOG_NAME = "routing.txt";
+const string Statistics::MESSAGES_LOG_NAME = "messages.txt";
+const string Statistics::DETECTIONS_LOG_NAME = "detections.txt";
+const string Statistics::PARTITIONS_LOG_NAME = "partitions.txt";
 const string Statistics::SEPARATOR = ",";
 const Time Statistics::WINDOW_SIZE = 0.05; /* 50 ms */
 
 Statistics::Statistics(Scheduler& s) : scheduler_(s), bandwidth_usage_log_(),
+                                       routing_log_(),
+                                       messages_log_(),
+                                       detections_log_(),
+                                       partitions_log_(),
                                        window_left_(START_TIME),
                                        window_right_(WINDOW_SIZE),
-                                       cur_window_count_(0) {}
+                                       cur_window_count_(0),
+                                       cur_window_heartbeats_(0),
+                                       cur_window_link_states_(0) {}
 
-Statistics::~Statistics() { bandwidth_usage_log_.close(); }
+Statistics::~Statistics() {
+  bandwidth_usage_log_.close();
+  routing_log_.close();
+  messages_log_.close();
+  detections_log_.close();
+  partitions_log_.close();
+}
 
+/* May be called again to move the logs elsewhere, as each forked scenario
+ * does, in which case the current window carries over.
+ */
 void Statistics::Init(string out_prefix, Topology physical) {
+  if(bandwidth_usage_log_.is_open()) bandwidth_usage_log_.close();
+  if(routing_log_.is_open()) routing_log_.close();
+  if(messages_log_.is_open()) messages_log_.close();
+  if(detections_log_.is_open()) detections_log_.close();
+  if(partitions_log_.is_open()) partitions_log_.close();
+
   bandwidth_usage_log_.open(out_prefix + USAGE_LOG_NAME,
                             ofstream::out | ofstream::app);
+  routing_log_.open(out_prefix + ROUTING_LOG_NAME,
+                    ofstream::out | ofstream::app);
+  messages_log_.open(out_prefix + MESSAGES_LOG_NAME,
+                     ofstream::out | ofstream::app);
+  detections_log_.open(out_prefix + DETECTIONS_LOG_NAME,
+                       ofstream::out | ofstream::app);
+  partitions_log_.open(out_prefix + PARTITIONS_LOG_NAME,
+                       ofstream::out | ofstream::app);
 
   physical_ = physical;
 }
 
-void Statistics::RecordSend(Event* e) {
-  Time put_on_link = e->time_ + Scheduler::kComputationDelay;
+void Statistics::Flush() {
+  bandwidth_usage_log_.flush();
+  routing_log_.flush();
+  messages_log_.flush();
+  detections_log_.flush();
+  partitions_log_.flush();
+}
+
+void Statistics::RecordSend(const Event& e) {
+  Time put_on_link = e.time() + Scheduler::kComputationDelay;
 
   if (! (window_left_ <= put_on_link && put_on_link < window_right_)) {
     bandwidth_usage_log_ << window_left_ << SEPARATOR << cur_window_count_ << "\n";
+    messages_log_ << window_left_ << SEPARATOR << cur_window_heartbeats_
+                  << SEPARATOR << cur_window_link_states_ << "\n";
 
     cur_window_count_ = 0;
+    cur_window_heartbeats_ = 0;
+    cur_window_link_states_ = 0;
     window_left_ = floor(put_on_link / WINDOW_SIZE) * WINDOW_SIZE;
     window_right_ = window_left_ + WINDOW_SIZE;
   }
 
-  cur_window_count_ += e->size();
+  cur_window_count_ += e.size();
+
+  if(e.type() == HEARTBEAT || e.type() == HEARTBEAT_FLOOD ||
+     e.type() == GOSSIP || e.type() == HEARTBEAT_AGGREGATE)
+    cur_window_heartbeats_ += e.Copies();
+  else
+    cur_window_link_states_ += e.Copies();
+}
+
+/* Each line records when a switch recomputed its routes and how many nodes of
+ * its shortest path tree had to be revisited, so the last line for a given
+ * switch marks when its routes converged.
+ */
+void Statistics::RecordRouteComputation(Entity* e, unsigned int touched) {
+  routing_log_ << scheduler_.cur_time() << SEPARATOR << e->id() << SEPARATOR
+               << touched << "\n";
+}
+
+/* Each line records when an entity stopped considering another recently
+ * seen.  The time from a failure to the detections that follow it is the
+ * failure detection latency.
+ */
+void Statistics::RecordDetection(Entity* observer, Id subject) {
+  detections_log_ << scheduler_.cur_time() << SEPARATOR << observer->id()
+                  << SEPARATOR << subject << "\n";
+}
+
+/* Each line records that a controller's view of the partitions changed: how
+ * many partitions it counts, which one it is in and that partition's leader.
+ * Per controller, the lines form the partition count and leader time series.
+ */
+void Statistics::RecordPartitions(Entity* e, unsigned int num_partitions,
+                                  unsigned int partition, Id leader) {
+  partitions_log_ << scheduler_.cur_time() << SEPARATOR << e->id()
+                  << SEPARATOR << num_partitions << SEPARATOR << partition
+                  << SEPARATOR << leader << "\n";
+}
+
+/* Only the window being filled is saved.  Lines already written to the logs
+ * stay in the files of the run that took the checkpoint.
+ */
+void Statistics::Save(Checkpoint& c) const {
+  c.Write(window_left_);
+  c.Write(window_right_);
+  c.Write(cur_window_count_);
+  c.Write(cur_window_heartbeats_);
+  c.Write(cur_window_link_states_);
+}
+
+void Statistics::Restore(Checkpoint& c) {
+  c.Read(window_left_);
+  c.Read(window_right_);
+  c.Read(cur_window_count_);
+  c.Read(cur_window_heartbeats_);
+  c.Read(cur_window_link_states_);
 }
@@ -7,17 +7,28 @@
 #include <string>
 #include <vector>
 
-class Event;
-class Heartbeat;
+class Checkpoint;
+class Entity;
 class Scheduler;
+union Event;
 
 class Statistics {
  public:
   Statistics(Scheduler&);
   ~Statistics();
   void Init(std::string, Topology);
-  void RecordSend(Event*);
+  void Flush();
+  void RecordSend(const Event&);
+  void RecordRouteComputation(Entity*, unsigned int);
+  void RecordDetection(Entity*, Id);
+  void RecordPartitions(Entity*, unsigned int, unsigned int, Id);
+  void Save(Checkpoint&) const;
+  void Restore(Checkpoint&);
   static const std::string USAGE_LOG_NAME;
+  static const std::string ROUTING_LOG_NAME;
+  static const std::string MESSAGES_LOG_NAME;
+  static const std::string DETECTIONS_LOG_NAME;
+  static const std::string PARTITIONS_LOG_NAME;
   static const std::string SEPARATOR;
   static const Time WINDOW_SIZE;
 
@@ -28,9 +39,19 @@ class Statistics {
    * better solution.
    */
   std::ofstream bandwidth_usage_log_;
+  std::ofstream routing_log_;
+  std::ofstream messages_log_;
+  std::ofstream detections_log_;
+  std::ofstream partitions_log_;
   Time window_left_;
   Time window_right_;
   Size cur_window_count_;
+  /* The number of liveness (heartbeat, aggregate and gossip) and link state
+   * messages put on links in the current window, each copy of a flood
+   * counting once
+   */
+  unsigned long cur_window_heartbeats_;
+  unsigned long cur_window_link_states_;
   Topology physical_;
   DISALLOW_COPY_AND_ASSIGN(Statistics);
 };
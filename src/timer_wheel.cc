@@ -0,0 +1,161 @@
+#include "timer_wheel.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <limits>
+
+#include "checkpoint.h"
+
+using std::min;
+using std::numeric_limits;
+using std::vector;
+
+TimerWheel::TimerWheel(Time tick)
+    : tick_(tick), cur_tick_(0), next_seq_(0), size_(0),
+      slots_(kLevels * kSlots), level_sizes_(kLevels, 0), spreading_(),
+      due_() {
+  CHECK_GT(tick_, 0);
+}
+
+void TimerWheel::Add(const Event& e) {
+  Place(Timer(e, next_seq_++));
+  ++size_;
+}
+
+bool TimerWheel::empty() const { return size_ == 0; }
+
+unsigned long TimerWheel::size() const { return size_; }
+
+Time TimerWheel::NextTime() {
+  CHECK(!empty());
+  Advance();
+  return due_.top().event_.time();
+}
+
+Event TimerWheel::Next() {
+  CHECK(!empty());
+  Advance();
+  Event next = due_.top().event_;
+  due_.pop();
+  --size_;
+  return next;
+}
+
+/* Events are saved in the order in which they will be taken out, so that
+ * restoring them one at a time rebuilds the same order whatever the state of
+ * the wheel that they are restored into.
+ */
+void TimerWheel::Save(Checkpoint& c) const {
+  vector<Timer> timers;
+  timers.reserve(size_);
+  for(auto pending = due_; !pending.empty(); pending.pop())
+    timers.push_back(pending.top());
+  for(const vector<Timer>& slot : slots_)
+    timers.insert(timers.end(), slot.begin(), slot.end());
+
+  Later later;
+  std::sort(timers.begin(), timers.end(),
+            [&](const Timer& lhs, const Timer& rhs) {
+              return later(rhs, lhs);
+            });
+
+  c.Write<uint64_t>(timers.size());
+  for(const Timer& t : timers)
+    t.event_.Save(c);
+}
+
+void TimerWheel::Restore(Checkpoint& c) {
+  uint64_t num_timers = 0;
+
+  CHECK(empty());
+
+  c.Read(num_timers);
+  for(uint64_t i = 0; i < num_timers && !c.failed(); ++i) {
+    Event ev = Event::Restore(c);
+    if(!c.failed()) Add(ev);
+  }
+}
+
+bool TimerWheel::Later::operator() (const Timer& lhs,
+                                    const Timer& rhs) const {
+  if(lhs.event_.time() != rhs.event_.time())
+    return lhs.event_.time() > rhs.event_.time();
+  return lhs.seq_ > rhs.seq_;
+}
+
+/* Dividing by a positive tick is monotonic, so an event in an earlier tick
+ * never has a later time than one in a later tick.
+ */
+uint64_t TimerWheel::TickOf(Time time) const {
+  Time ticks = time / tick_;
+  if(ticks <= 0) return 0;
+  if(ticks >= Time(numeric_limits<uint64_t>::max() / 2))
+    return numeric_limits<uint64_t>::max() / 2;
+  return uint64_t(ticks);
+}
+
+/* Puts t on the lowest level whose slots reach its tick from the current
+ * one.  Events further away than the top level reaches wait in its last slot
+ * and are placed again when it is spread.
+ */
+void TimerWheel::Place(const Timer& t) {
+  uint64_t tick = TickOf(t.event_.time());
+  if(tick <= cur_tick_) {
+    due_.push(t);
+    return;
+  }
+
+  for(unsigned int level = 0; level < kLevels; ++level) {
+    unsigned int shift = kSlotBits * level;
+    uint64_t slot = tick >> shift;
+    uint64_t cur_slot = cur_tick_ >> shift;
+    if(slot - cur_slot >= kSlots && level + 1 < kLevels) continue;
+
+    slot = min(slot, cur_slot + kSlots - 1);
+    slots_[level * kSlots + slot % kSlots].push_back(t);
+    ++level_sizes_[level];
+    return;
+  }
+}
+
+/* Moves the wheel forward until the events of the current tick are not all
+ * gone.  When the lowest levels are empty, the ticks that they stand for are
+ * skipped at once.
+ */
+void TimerWheel::Advance() {
+  while(due_.empty()) {
+    unsigned int level = 0;
+    while(level_sizes_[level] == 0) {
+      ++level;
+      CHECK_LT(level, kLevels);
+    }
+    if(level > 0)
+      cur_tick_ |= (uint64_t(1) << (kSlotBits * level)) - 1;
+
+    ++cur_tick_;
+    if(cur_tick_ % kSlots == 0) Cascade(1);
+    Spread(0, cur_tick_ % kSlots);
+  }
+}
+
+/* Spreads the slot of the given level that the current tick has just entered,
+ * after the one of the level above if that has been entered too.
+ */
+void TimerWheel::Cascade(unsigned int level) {
+  if(level == kLevels) return;
+
+  unsigned int slot = (cur_tick_ >> (kSlotBits * level)) % kSlots;
+  if(slot == 0) Cascade(level + 1);
+  Spread(level, slot);
+}
+
+/* The slot is swapped with spreading_ so that each keeps the memory it has */
+void TimerWheel::Spread(unsigned int level, unsigned int slot) {
+  spreading_.clear();
+  spreading_.swap(slots_[level * kSlots + slot]);
+  level_sizes_[level] -= spreading_.size();
+
+  for(const Timer& t : spreading_)
+    Place(t);
+}
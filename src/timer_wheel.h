@@ -0,0 +1,67 @@
+#ifndef DDCSIM_TIMER_WHEEL_H_
+#define DDCSIM_TIMER_WHEEL_H_
+
+#include <inttypes.h>
+#include <queue>
+#include <vector>
+
+#include "common.h"
+#include "events.h"
+
+class Checkpoint;
+
+/* A hierarchical timing wheel for the events that entities schedule for
+ * themselves at fixed periods, which make up most of the queue but are only
+ * ever added and taken out in time order.
+ *
+ * Time is divided into ticks.  Level 0 has a slot for each of the next
+ * kSlots ticks, and every level above has a slot for each of the next kSlots
+ * slots of the level below, so adding an event takes constant time however
+ * far away it is.  When the wheel moves past the end of a slot of level l,
+ * the next slot of level l + 1 is spread over the levels below.  The events
+ * of the current tick are kept in a small heap of their own, ordered by
+ * time and then by the order in which they were added.
+ */
+class TimerWheel {
+ public:
+  TimerWheel(Time);
+  void Add(const Event&);
+  bool empty() const;
+  unsigned long size() const;
+  Time NextTime();
+  Event Next();
+  void Save(Checkpoint&) const;
+  void Restore(Checkpoint&);
+
+ private:
+  struct Timer {
+    Timer(const Event& event, unsigned long seq) : event_(event), seq_(seq) {}
+    Event event_;
+    unsigned long seq_;
+  };
+
+  class Later {
+   public:
+    bool operator() (const Timer&, const Timer&) const;
+  };
+
+  static const unsigned int kLevels = 4;
+  static const unsigned int kSlotBits = 8;
+  static const unsigned int kSlots = 1 << kSlotBits;
+  uint64_t TickOf(Time) const;
+  void Place(const Timer&);
+  void Advance();
+  void Cascade(unsigned int);
+  void Spread(unsigned int, unsigned int);
+  Time tick_;
+  uint64_t cur_tick_;
+  unsigned long next_seq_;
+  unsigned long size_;
+  std::vector<std::vector<Timer> > slots_;
+  std::vector<unsigned long> level_sizes_;
+  std::vector<Timer> spreading_;
+  std::priority_queue<Timer, std::vector<Timer>, Later> due_;
+  DISALLOW_COPY_AND_ASSIGN(TimerWheel);
+};
+
+#endif
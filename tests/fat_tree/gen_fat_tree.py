@@ -0,0 +1,59 @@
+# Writes the YAML description of a k-ary fat tree without hosts to stdout.
+#
+# Switches are numbered like the shipped inputs: the (k/2)^2 core switches
+# come first, followed by each pod's k/2 aggregation switches and then its k/2
+# edge switches.  Core switch c connects to aggregation switch c / (k/2) of
+# every pod, and every edge switch connects to all aggregation switches in its
+# pod.
+#
+# Usage: python gen_fat_tree.py k > fat_tree_k_nohosts.yaml
+from __future__ import print_function
+
+from sys import argv, exit, stderr
+
+
+def fat_tree(k):
+    half = k // 2
+    num_core = half * half
+    pod_size = k
+
+    links = {}
+
+    def connect(a, b):
+        links.setdefault(a, []).append(b)
+        links.setdefault(b, []).append(a)
+
+    for pod in range(k):
+        first = num_core + pod * pod_size
+        aggs = range(first, first + half)
+        edges = range(first + half, first + pod_size)
+        for i, agg in enumerate(aggs):
+            for c in range(i * half, (i + 1) * half):
+                connect(c, agg)
+            for edge in edges:
+                connect(agg, edge)
+
+    return num_core + k * pod_size, links
+
+
+def main():
+    if len(argv) != 2 or not argv[1].isdigit() or int(argv[1]) % 2 != 0 \
+            or int(argv[1]) < 2:
+        print("usage: " + argv[0] + " k, where k is a positive even integer",
+              file=stderr)
+        exit(1)
+
+    num_switches, links = fat_tree(int(argv[1]))
+
+    print('entities:')
+
+    for i in range(num_switches):
+        print("  - {id: " + str(i) + ", type: switch}")
+
+    print('links:')
+
+    for i in range(num_switches):
+        print("  " + str(i) + ": " + str(sorted(links[i])))
+
+if __name__ == "__main__":
+    main()
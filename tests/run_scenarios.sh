@@ -0,0 +1,46 @@
+#!/bin/bash
+# Runs the scenario tests and compares their out files with the expected ones.
+#
+# A scenario test is a directory under tests/ holding an "args" file with the
+# simulator's command line, whose paths are relative to that directory, and
+# an "expected" directory with the out files that the run has to reproduce
+# exactly.  Other out files are not compared.  Simulations are deterministic,
+# so a difference means that the behaviour pinned by the test has changed.
+# A run that takes longer than $timeout seconds fails, since events that the
+# scheduler loses can keep it from ever reaching the end time.
+#
+# Usage (from the root of the project, after "make"):
+#   tests/run_scenarios.sh [path to pilosim]
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+pilosim=$(cd "$(dirname "${1:-$root/pilosim}")" && pwd)/$(basename "${1:-pilosim}")
+failed=0
+timeout=300
+
+for test_dir in "$root"/tests/*/; do
+  [ -f "$test_dir/args" ] || continue
+  name=$(basename "$test_dir")
+  out_dir=$(mktemp -d)
+  passed=1
+
+  if ! (cd "$test_dir" && timeout $timeout "$pilosim" $(cat args) \
+        -O "$out_dir/" > "$out_dir/stderr.txt" 2>&1); then
+    echo "FAIL $name: pilosim exited with an error"
+    tail -n 5 "$out_dir/stderr.txt"
+    passed=0
+  else
+    for expected in "$test_dir"/expected/*; do
+      if ! diff -u "$expected" "$out_dir/$(basename "$expected")" \
+           > "$out_dir/diff.txt"; then
+        echo "FAIL $name: $(basename "$expected") differs"
+        head -n 20 "$out_dir/diff.txt"
+        passed=0
+      fi
+    done
+  fi
+
+  if [ $passed -eq 1 ]; then echo "ok   $name"; else failed=1; fi
+  rm -rf "$out_dir"
+done
+
+exit $failed